@@ -0,0 +1,184 @@
+#include <stdlib.h>
+#include <pthread.h>
+#include "bufpool.h"
+
+#define NUM_CLASSES (BUFPOOL_MAX_SHIFT - BUFPOOL_MIN_SHIFT + 1)
+// Cache at most this many bytes of free buffers per size class
+#define CLASS_CACHE_BYTES (4u << 20)
+#define RESERVE_ALIGN 16u // Alignment of each buffer in a bufpoolReserved
+
+struct freeBuf {
+   struct freeBuf *next;
+};
+
+struct sizeClass {
+   pthread_mutex_t lock;
+   struct freeBuf *free;
+   uint32_t cached;
+};
+
+static struct sizeClass classes[NUM_CLASSES] = {
+   [0 ... NUM_CLASSES - 1] = { PTHREAD_MUTEX_INITIALIZER, NULL, 0 }
+};
+
+static uint64_t heapCalls;
+
+static void *heapAlloc(uint32_t size)
+{
+   __atomic_fetch_add(&heapCalls, 1, __ATOMIC_RELAXED);
+   return malloc(size);
+}
+
+static void heapFree(void *buf)
+{
+   if (!buf)
+      return;
+   __atomic_fetch_add(&heapCalls, 1, __ATOMIC_RELAXED);
+   free(buf);
+}
+
+// Smallest class holding size bytes, or -1 if it is too big to pool
+static int sizeToClass(uint32_t size)
+{
+   int c = 0;
+
+   if (size > BUFPOOL_MAX_SIZE)
+      return -1;
+
+   while ((BUFPOOL_MIN_SIZE << c) < size)
+      c++;
+   return c;
+}
+
+// Call with the class locked
+static uint32_t classLimit(int c)
+{
+   uint32_t limit = CLASS_CACHE_BYTES >> (BUFPOOL_MIN_SHIFT + c);
+
+   return limit < 4 ? 4 : limit;
+}
+
+void *bufpoolGet(uint32_t size, uint32_t *actual)
+{
+   int c = sizeToClass(size);
+   struct freeBuf *buf;
+
+   if (c < 0) {
+      if (actual)
+         *actual = size;
+      return heapAlloc(size);
+   }
+
+   if (actual)
+      *actual = BUFPOOL_MIN_SIZE << c;
+
+   pthread_mutex_lock(&classes[c].lock);
+   buf = classes[c].free;
+   if (buf) {
+      classes[c].free = buf->next;
+      classes[c].cached--;
+   }
+   pthread_mutex_unlock(&classes[c].lock);
+
+   if (buf)
+      return buf;
+
+   return heapAlloc(BUFPOOL_MIN_SIZE << c);
+}
+
+void bufpoolPut(void *buf, uint32_t size)
+{
+   int c = sizeToClass(size);
+   struct freeBuf *fb = (struct freeBuf *)buf;
+
+   if (!buf)
+      return;
+
+   if (c >= 0) {
+      pthread_mutex_lock(&classes[c].lock);
+      if (classes[c].cached < classLimit(c)) {
+         fb->next = classes[c].free;
+         classes[c].free = fb;
+         classes[c].cached++;
+         fb = NULL;
+      }
+      pthread_mutex_unlock(&classes[c].lock);
+   }
+
+   heapFree(fb);
+}
+
+int bufpoolReserve(struct bufpoolReserved *r, uint32_t size, uint32_t count)
+{
+   struct freeBuf *fb;
+   uint32_t i;
+
+   // Every buffer starts aligned for whatever struct it will hold
+   size = (size + RESERVE_ALIGN - 1) & ~(RESERVE_ALIGN - 1);
+   r->size = size;
+   r->free = NULL;
+   r->block = NULL;
+   if (!size || count > UINT32_MAX / size)
+      return -1;
+   r->block = (char *)heapAlloc(size * count);
+   if (!r->block)
+      return -1;
+
+   for (i = count; i > 0; i--) {
+      fb = (struct freeBuf *)(r->block + (i - 1) * size);
+      fb->next = (struct freeBuf *)r->free;
+      r->free = fb;
+   }
+
+   return 0;
+}
+
+void *bufpoolReservedGet(struct bufpoolReserved *r)
+{
+   struct freeBuf *fb = (struct freeBuf *)r->free;
+
+   if (fb)
+      r->free = fb->next;
+   return fb;
+}
+
+void bufpoolReservedPut(struct bufpoolReserved *r, void *buf)
+{
+   struct freeBuf *fb = (struct freeBuf *)buf;
+
+   if (!buf)
+      return;
+   fb->next = (struct freeBuf *)r->free;
+   r->free = fb;
+}
+
+void bufpoolUnreserve(struct bufpoolReserved *r)
+{
+   heapFree(r->block);
+   r->block = NULL;
+   r->free = NULL;
+}
+
+uint64_t bufpoolHeapCalls(void)
+{
+   return __atomic_load_n(&heapCalls, __ATOMIC_RELAXED);
+}
+
+void bufpoolTrim(void)
+{
+   struct freeBuf *fb, *next;
+   int c;
+
+   for (c = 0; c < NUM_CLASSES; c++) {
+      pthread_mutex_lock(&classes[c].lock);
+      fb = classes[c].free;
+      classes[c].free = NULL;
+      classes[c].cached = 0;
+      pthread_mutex_unlock(&classes[c].lock);
+
+      for (; fb; fb = next) {
+         next = fb->next;
+         heapFree(fb);
+      }
+   }
+}
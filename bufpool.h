@@ -0,0 +1,68 @@
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Size classes are powers of two between these bounds
+#define BUFPOOL_MIN_SHIFT 8
+#define BUFPOOL_MAX_SHIFT 20
+#define BUFPOOL_MIN_SIZE (1u << BUFPOOL_MIN_SHIFT)
+#define BUFPOOL_MAX_SIZE (1u << BUFPOOL_MAX_SHIFT)
+
+/* Get a buffer of at least size bytes from the shared, size-classed pool.
+ *   Safe to call from any thread.
+ * @param size the minimum number of bytes needed.
+ * @param actual if not NULL, receives the usable size of the buffer.
+ * @return the buffer, or NULL if out of memory.
+ */
+void *bufpoolGet(uint32_t size, uint32_t *actual);
+
+/* Return a buffer to the pool.
+ * @param buf a buffer from bufpoolGet, or NULL.
+ * @param size the size it was requested with, or its actual size.
+ */
+void bufpoolPut(void *buf, uint32_t size);
+
+/* Free every buffer cached in the pool. */
+void bufpoolTrim(void);
+
+/* Buffers set aside for one user, such as one link.  They come from a
+ *   single allocation made up front and never mix with the shared size
+ *   classes, so a user that runs dry pushes back on itself only.  Not
+ *   locked: get and put from one thread.
+ */
+struct bufpoolReserved {
+   char *block; // Every buffer, back to back
+   void *free;  // Free list threaded through the unused buffers
+   uint32_t size; // Bytes per buffer
+};
+
+/* Allocate count buffers of size bytes for one user.
+ * @return 0 on success, -1 if out of memory.
+ */
+int bufpoolReserve(struct bufpoolReserved *r, uint32_t size, uint32_t count);
+
+/* Take a reserved buffer.
+ * @return the buffer, or NULL once all of them are in use.
+ */
+void *bufpoolReservedGet(struct bufpoolReserved *r);
+
+/* Return a buffer taken with bufpoolReservedGet. */
+void bufpoolReservedPut(struct bufpoolReserved *r, void *buf);
+
+/* Free the reserved buffers.  None may still be in use. */
+void bufpoolUnreserve(struct bufpoolReserved *r);
+
+/* Number of malloc and free calls the pool has made, for checking that a
+ *   steady state stays off the heap. */
+uint64_t bufpoolHeapCalls(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -3,32 +3,84 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <string.h>
 #include "serial.h"
-#include <stdlib.h>
+#include "kiss.h"
+#include "output.h"
+#include "rx_worker.h"
+#include "shard.h"
+#include "timeline.h"
+#include "inject.h"
+#include "schema.h"
+#include "netsys.h"
+#include "netsim.h"
+#include "upload.h"
+#include "kiss_server.h"
+#include "stress.h"
+#include "bufpool.h"
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <fcntl.h>
+
+#define RX_QUEUE_SLOTS 256
+#define STATS_INTERVAL_MS 1000
+#define RUN_TIME_MS 5000
+#define SIM_LIMIT_MS 120000 // Virtual time a -Z run waits for its reply
+#define MAX_LINKS 256
+#define STOP_POLL_MS 200
+#define SERIAL_BAUD 9600
+#define BENCH_CHUNK 4096 // Bytes per simulated read in the -x benchmark
+
+// Settings gathered from the command line
+struct config {
+   char *url;
+   enum outputFormat fmt;
+   struct serialOptions opts;
+   int threaded;
+   const char *statsPath; // Link statistics file, NULL for none
+   int shards; // Event loop threads for comma separated paths, 0 for one
+   struct timeline *tl; // Commands released at set times, NULL for one now
+   const char *injectPath; // Serve a shared memory injection socket here
+   struct netSim *sim; // Simulated peer and clock for -Z, NULL for real
+   struct upload *up; // Multi-frame upload to send instead of one command
+};
 
-#define FEND 0xC0
-#define FESC 0xDB
-#define TFEND 0xDC
-#define TFESC 0xDD
+// Per-link receive state when links are spread over shards
+struct shardLinkCtx {
+   const char *url;
+   enum outputFormat fmt;
+   struct kissDecoder dec;
+};
+
+// Shard threads share stdout and the output buffer
+static pthread_mutex_t outputLock = PTHREAD_MUTEX_INITIALIZER;
 
 struct params {
    unsigned char *cmd;
    int cmdLen;
+   int cmdPending; // Refused with SERIAL_WRITE_WOULDBLOCK, resent when writable
    struct serialInterface *si;
+   enum outputFormat fmt;
+   struct kissDecoder dec;
+   struct rxWorker *worker; // Decoding thread, NULL to decode inline
+   int rxDropped; // The worker lost received bytes; the run fails
+   const struct config *cfg;
+   struct injectServer *inject; // Producers' rings, NULL when not serving
+   const struct netOps *ops; // Clock and event loop the link runs on
+   EVTHandler *evt;
+   int upNext; // Next upload frame to write
+   int upDone; // Every upload frame has left the transmit queue
+   struct timeval upStart;
+   uint64_t upElapsedUs;
+   uint64_t progress; // Upload progress at the last run_done_cb check
+   struct uploadRx *rx; // Checks upload frames that come back, e.g. echoed
+   // Written only by the decoding thread, read with __atomic loads
+   uint64_t crcErrors;
+   uint64_t framingErrors;
+   int replied; // A good frame, or the whole upload, came back
 };
 
-uint16_t crc16(char* pData, int length)
-{
-   uint8_t i;
-   uint16_t wCrc = 0xffff;
-   while (length--) {
-      wCrc ^= *(unsigned char *)pData++ << 8;
-      for (i=0; i < 8; i++)
-         wCrc = wCrc & 0x8000 ? (wCrc << 1) ^ 0x1021 : wCrc << 1;
-   }
-   return wCrc & 0xffff;
-}
-
 static int exit_cb(void *arg)
 {
    EVTHandler *evt = (EVTHandler*)arg;
@@ -39,96 +91,1038 @@ static int exit_cb(void *arg)
    return EVENT_REMOVE;
 }
 
+// End of a plain run, on whichever clock the link uses
+static int run_done_cb(void *arg)
+{
+   struct params *p = (struct params*)arg;
+   uint64_t progress;
+
+   // An upload keeps the run going for as long as it makes progress
+   if (p->cfg->up && !p->upDone && p->si && p->si->stats) {
+      progress = p->si->stats(p->si)->bytesSent + p->upNext;
+      if (progress != p->progress) {
+         p->progress = progress;
+         return EVENT_KEEP;
+      }
+   }
+   // Virtual time is cheap: a -Z run waits out retries until SIM_LIMIT_MS
+   if (p->cfg->sim && !__atomic_load_n(&p->replied, __ATOMIC_RELAXED))
+      return EVENT_KEEP;
+
+   netExitLoop(p->ops, p->evt);
+
+   return EVENT_REMOVE;
+}
+
+static volatile sig_atomic_t stopRequested;
+
+static void stop_handler(int sig)
+{
+   stopRequested = 1;
+}
+
+// Injection mode runs until SIGINT or SIGTERM
+static int stop_cb(void *arg)
+{
+   if (stopRequested) {
+      EVT_exit_loop((EVTHandler*)arg);
+      return EVENT_REMOVE;
+   }
+
+   return EVENT_KEEP;
+}
+
+// Serve KISS clients on a local port until SIGINT or SIGTERM
+static int run_kiss_server(int port, const char *script)
+{
+   struct kissServerStats st;
+   struct kissServer *srv;
+   EVTHandler *evt;
+
+   evt = EVT_create_handler();
+   if (!evt)
+      return -1;
+   srv = kissServerStart(evt, port, script);
+   if (!srv) {
+      EVT_free_handler(evt);
+      return -1;
+   }
+   printf("KISS server on 127.0.0.1:%d, script %s\n", kissServerPort(srv),
+         script ? script : "echo");
+   fflush(stdout);
+
+   signal(SIGINT, &stop_handler);
+   signal(SIGTERM, &stop_handler);
+   EVT_sched_add(evt, EVT_ms2tv(STOP_POLL_MS), &stop_cb, evt);
+   EVT_start_loop(evt);
+
+   kissServerStats(srv, &st);
+   printf("served: %llu connections, %llu frames, %llu echoed, %llu acked, "
+         "%llu dropped\n", (unsigned long long)st.accepted,
+         (unsigned long long)st.frames, (unsigned long long)st.echoed,
+         (unsigned long long)st.acked, (unsigned long long)st.dropped);
+   kissServerStop(srv);
+   EVT_free_handler(evt);
+
+   return 0;
+}
+
+// Keep listening for replies after the last timed command goes out
+static void timeline_done_cb(void *arg)
+{
+   EVT_sched_add((EVTHandler*)arg, EVT_ms2tv(RUN_TIME_MS), &exit_cb, arg);
+}
+
+// Frames are <len> <payload> <crc16 hi> <crc16 lo>
+static int frame_crc_ok(const unsigned char *frame, int len)
+{
+   uint16_t crc;
+
+   if (len < 3)
+      return 0;
+
+   crc = crc16(frame, len - 2);
+   return frame[len - 2] == ((crc >> 8) & 0xFF) &&
+          frame[len - 1] == (crc & 0xFF);
+}
+
+static void kiss_frame_cb(int port, unsigned char *frame, int len, void *arg)
+{
+   struct params *p = (struct params*)arg;
+   int crcOk = frame_crc_ok(frame, len);
+   uint32_t rxLen;
+
+   // The link's counters belong to the event loop, which copies these in
+   if (!crcOk)
+      __atomic_store_n(&p->crcErrors, p->crcErrors + 1, __ATOMIC_RELAXED);
+
+   if (p->rx && crcOk && uploadRxFrame(p->rx, frame, len) < 0)
+      printf("Upload round trip failed\n");
+   if (crcOk && (!p->rx || uploadRxData(p->rx, &rxLen)))
+      __atomic_store_n(&p->replied, 1, __ATOMIC_RELAXED);
+   if (outputFramed(p->fmt))
+      outputFrame(p->fmt, port, frame, len, crcOk);
+}
+
+// Replace the stats file atomically so readers never see a partial update
+static void write_stats_file(struct params *p)
+{
+   struct serialStats *st;
+   char tmp[1024];
+   char buf[2048];
+   FILE *fp;
+   int len;
+
+   if (!p->cfg->statsPath || !p->si || !p->si->stats)
+      return;
+
+   st = p->si->stats(p->si);
+   st->crcErrors = __atomic_load_n(&p->crcErrors, __ATOMIC_RELAXED);
+   st->framingErrors = __atomic_load_n(&p->framingErrors, __ATOMIC_RELAXED);
+   len = serialStatsFormat(st, p->cfg->url, buf, sizeof(buf));
+
+   snprintf(tmp, sizeof(tmp), "%s.tmp", p->cfg->statsPath);
+   fp = fopen(tmp, "w");
+   if (!fp) {
+      perror(tmp);
+      return;
+   }
+   fwrite(buf, 1, len, fp);
+   if (fclose(fp) == 0)
+      rename(tmp, p->cfg->statsPath);
+}
+
+// Receive batching: how many reads each wakeup took and their size
+static void print_read_stats(const struct serialStats *st)
+{
+   if (!st->readWakeups || !st->readCalls)
+      return;
+
+   fprintf(stderr, "rx: %llu wakeups, %.2f reads per wakeup, %.1f bytes "
+         "per read\n", (unsigned long long)st->readWakeups,
+         (double)st->readCalls / st->readWakeups,
+         (double)st->bytesReceived / st->readCalls);
+}
+
+// Parse "lowat=64,busypoll=50,vmin=32,vtime=1" into the receive options
+static int parse_rx_options(const char *spec, struct serialOptions *opts)
+{
+   char *copy, *tok, *save, *val;
+   int res = 0;
+
+   copy = strdup(spec);
+   if (!copy)
+      return -1;
+
+   for (tok = strtok_r(copy, ",", &save); tok && !res;
+         tok = strtok_r(NULL, ",", &save)) {
+      val = strchr(tok, '=');
+      if (!val) {
+         res = -1;
+         break;
+      }
+      *val++ = 0;
+
+      if (!strcmp(tok, "lowat"))
+         opts->rcvLowat = strtoul(val, NULL, 0);
+      else if (!strcmp(tok, "busypoll"))
+         opts->busyPollUs = strtoul(val, NULL, 0);
+      else if (!strcmp(tok, "vmin"))
+         opts->vmin = strtoul(val, NULL, 0);
+      else if (!strcmp(tok, "vtime"))
+         opts->vtime = strtoul(val, NULL, 0);
+      else
+         res = -1;
+   }
+   free(copy);
+
+   return res;
+}
+
+static int stats_cb(void *arg)
+{
+   write_stats_file((struct params*)arg);
+
+   return EVENT_KEEP;
+}
+
+// Decode and print received bytes. Runs on the worker thread if there is one.
+static void process_chunk(void *buffer, int len, void *arg)
+{
+   struct params *p = (struct params*)arg;
+
+   if (outputFramed(p->fmt) || p->rx || p->cfg->sim) {
+      kissDecode(&p->dec, buffer, len);
+      __atomic_store_n(&p->framingErrors, (uint64_t)p->dec.framingErrors,
+            __ATOMIC_RELAXED);
+   }
+   if (!outputFramed(p->fmt))
+      outputChunk(p->fmt, buffer, len);
+
+   outputFlush();
+}
+
 void serial_read_cb(void *buffer, int len, void *arg)
 {
-   int i;
-   unsigned char *b = (unsigned char*)buffer;
+   struct params *p = (struct params*)arg;
 
-   printf("Recvd: ");
-   for (i = 0; i < len; i++)
-       printf("%02X ", b[i]);
-   printf("\n");
+   if (p->worker) {
+      if (rxWorkerPush(p->worker, buffer, len) < 0 && !p->rxDropped++)
+         fprintf(stderr, "rx worker stopped, received bytes dropped\n");
+   }
+   else
+      process_chunk(buffer, len, p);
+}
+
+static void write_cmd(struct params *p)
+{
+   int res = p->si->write(p->si, p->cmd, p->cmdLen);
+
+   p->cmdPending = res == SERIAL_WRITE_WOULDBLOCK;
+   if (res == SERIAL_WRITE_QUEUED)
+      printf("Written!\n");
+   else if (res == SERIAL_WRITE_DROPPED)
+      printf("Write dropped\n");
+}
+
+// Queue upload frames until the link pushes back or all are queued
+static void write_upload(struct params *p)
+{
+   const unsigned char *frame;
+   int len, res;
+
+   if (p->upNext == 0)
+      netNow(p->ops, &p->upStart);
+
+   while (p->upNext < uploadFrames(p->cfg->up)) {
+      frame = uploadFrame(p->cfg->up, p->upNext, &len);
+      res = p->si->write(p->si, (void *)frame, len);
+      if (res == SERIAL_WRITE_WOULDBLOCK)
+         return;
+      if (res == SERIAL_WRITE_DROPPED) {
+         printf("Upload frame %d dropped\n", p->upNext);
+         return;
+      }
+      p->upNext++;
+   }
+}
+
+// The upload is on the wire once the last frame leaves the queue
+static void upload_drained(struct params *p)
+{
+   struct timeval now, diff;
+
+   if (p->upDone || p->upNext < uploadFrames(p->cfg->up))
+      return;
+
+   netNow(p->ops, &now);
+   timersub(&now, &p->upStart, &diff);
+   p->upElapsedUs = (uint64_t)diff.tv_sec * 1000000 + diff.tv_usec;
+   p->upDone = 1;
 }
 
 void serial_connect_cb(int status, void *arg)
 {
    struct params *p = (struct params*)arg;
    if (p && status) {
-       if (p->si->write) {
-          p->si->write(p->si, p->cmd, p->cmdLen);
-          printf("Written!\n");
+       // A reconnect restarts the upload; its start frame resets the peer
+       if (p->cfg->up && p->si->write && !p->upDone) {
+          p->upNext = 0;
+          write_upload(p);
        }
+       else if (p->cmd && p->si->write)
+          write_cmd(p);
    }
 }
 
-static void send_command(char *url, unsigned char *cmd, int len)
+void serial_writable_cb(uint32_t queued, void *arg)
+{
+   struct params *p = (struct params*)arg;
+
+   if (p->cmdPending)
+      write_cmd(p);
+   if (p->cfg->up && !p->upDone) {
+      write_upload(p);
+      if (queued == 0)
+         upload_drained(p);
+   }
+   if (p->inject)
+      injectServerWritable(p->inject);
+   if (p->cfg->tl)
+      timelineWritable(p->cfg->tl, queued);
+}
+
+// @return 0 if a reply came back (see params.replied), -1 if not
+static int send_command(const struct config *cfg, unsigned char *cmd, int len)
 {
    EVTHandler *evt;
    struct serialInterface *si = NULL;
    struct params p;
+   struct rxWorkerStats stats;
+   struct injectStats ist;
+   struct serialOptions opts = cfg->opts;
+   uint32_t rxLen;
+   uint64_t heapCalls = 0;
+
+   opts.writableCallback = &serial_writable_cb;
+   p.ops = opts.netOps ? opts.netOps : &netSysOps;
+   p.cfg = cfg;
+   p.upNext = p.upDone = 0;
+   p.upElapsedUs = p.progress = 0;
+   p.rx = cfg->up ? uploadRxCreate() : NULL;
+   p.fmt = cfg->fmt;
+   kissDecoderInit(&p.dec, &kiss_frame_cb, &p);
+   p.crcErrors = p.framingErrors = 0;
+   p.replied = 0;
+   p.worker = NULL;
+   p.rxDropped = 0;
+   if (cfg->threaded)
+      p.worker = rxWorkerStart(&process_chunk, &p, RX_QUEUE_SLOTS);
 
    evt = EVT_create_handler();
    if (evt) {
-       serialInit(&si, evt, &serial_read_cb, &serial_connect_cb,
-               url, 9600, NULL, &p);
-       p.si = si;
+       // Serial devices report connected from inside serialInitOpts
+       p.si = NULL;
+       p.inject = NULL;
+       p.evt = evt;
        p.cmd = cmd;
        p.cmdLen = len;
+       p.cmdPending = 0;
+       serialInitOpts(&p.si, evt, &serial_read_cb, &serial_connect_cb,
+               cfg->url, SERIAL_BAUD, NULL, &p, &opts);
+       si = p.si;
+       heapCalls = bufpoolHeapCalls();
 
-       EVT_sched_add(evt, EVT_ms2tv(5000), &exit_cb, evt);
+       // The link is already up or connecting, so release pays no setup
+       if (cfg->tl && si) {
+          if (timelineStart(cfg->tl, evt, si, &timeline_done_cb, evt) < 0)
+             EVT_sched_add(evt, EVT_ms2tv(0), &exit_cb, evt);
+       }
+       else if (cfg->injectPath && si) {
+          p.inject = injectServerStart(evt, cfg->injectPath, si, 0);
+          if (p.inject) {
+             signal(SIGINT, &stop_handler);
+             signal(SIGTERM, &stop_handler);
+             EVT_sched_add(evt, EVT_ms2tv(STOP_POLL_MS), &stop_cb, evt);
+          }
+          else
+             EVT_sched_add(evt, EVT_ms2tv(0), &exit_cb, evt);
+       }
+       else
+          netSchedAdd(p.ops, evt, EVT_ms2tv(RUN_TIME_MS), &run_done_cb, &p);
+       if (cfg->statsPath)
+          netSchedAdd(p.ops, evt, EVT_ms2tv(STATS_INTERVAL_MS), &stats_cb,
+                &p);
 
-       EVT_start_loop(evt);
+       netRun(p.ops, evt);
+
+       if (p.worker)
+          rxWorkerStop(p.worker, &stats);
+       write_stats_file(&p);
+       if (si && si->stats)
+          print_read_stats(si->stats(si));
+       if (si && (opts.flags & SERIAL_OPT_PREALLOC))
+          fprintf(stderr, "pool: %llu heap calls after setup\n",
+                (unsigned long long)(bufpoolHeapCalls() - heapCalls));
+       if (cfg->tl)
+          timelineReport(cfg->tl, stdout);
+       if (cfg->up) {
+          uploadReport(cfg->up, SERIAL_BAUD, p.upElapsedUs, stdout);
+          printf("upload: round trip %s\n", uploadRxData(p.rx, &rxLen) ?
+                "verified" : "not seen");
+          uploadRxFree(p.rx);
+          p.rx = NULL;
+       }
+       if (p.inject) {
+          injectServerStats(p.inject, &ist);
+          printf("injected: %llu commands, %llu dropped, %llu pauses for "
+                "backpressure\n", (unsigned long long)ist.commands,
+                (unsigned long long)ist.dropped,
+                (unsigned long long)ist.blocked);
+          injectServerStop(p.inject);
+          p.inject = NULL;
+       }
 
        if (si && si->cleanup)
           si->cleanup(si);
        si = NULL;
        EVT_free_handler(evt);
    }
+
+   if (p.worker) {
+      fprintf(stderr, "rx queue: %llu chunks, high-water %u of %u, "
+            "%llu stalls, %llu dropped\n", (unsigned long long)stats.chunks,
+            stats.highWater, stats.slots, (unsigned long long)stats.stalls,
+            (unsigned long long)stats.drops);
+   }
+   outputFlush();
+
+   return p.replied && !p.rxDropped ? 0 : -1;
+}
+
+static void shard_frame_cb(int port, unsigned char *frame, int len, void *arg)
+{
+   struct shardLinkCtx *ctx = (struct shardLinkCtx*)arg;
+
+   outputFrame(ctx->fmt, port, frame, len, frame_crc_ok(frame, len));
+}
+
+static void shard_read_cb(void *buffer, int len, void *arg)
+{
+   struct shardLinkCtx *ctx = (struct shardLinkCtx*)arg;
+
+   pthread_mutex_lock(&outputLock);
+   if (outputFramed(ctx->fmt))
+      kissDecode(&ctx->dec, buffer, len);
+   else
+      outputChunk(ctx->fmt, buffer, len);
+   outputFlush();
+   pthread_mutex_unlock(&outputLock);
+}
+
+// Send the command to every link in a comma separated list of paths, with
+// the links spread across cfg->shards event loop threads
+// @return -1 if the shards could not be set up, 0 otherwise
+static int send_command_sharded(const struct config *cfg, unsigned char *cmd,
+      int len)
+{
+   struct shardLinkCtx *ctx;
+   struct shardPool *pool;
+   struct shardStats st;
+   struct timespec ts;
+   const char *c;
+   char *urls, *url, *save;
+   int links = 0, maxLinks = 1, i;
+
+   for (c = cfg->url; *c; c++)
+      if (*c == ',' && maxLinks < MAX_LINKS)
+         maxLinks++;
+
+   pool = shardPoolCreate(cfg->shards);
+   if (!pool)
+      return -1;
+
+   ctx = (struct shardLinkCtx *)calloc(maxLinks, sizeof(*ctx));
+   urls = strdup(cfg->url);
+   if (!ctx || !urls) {
+      fprintf(stderr, "Insufficient memory\n");
+      shardPoolStop(pool);
+      free(ctx);
+      free(urls);
+      return -1;
+   }
+
+   for (url = strtok_r(urls, ",", &save); url && links < maxLinks;
+         url = strtok_r(NULL, ",", &save)) {
+      ctx[links].url = url;
+      ctx[links].fmt = cfg->fmt;
+      kissDecoderInit(&ctx[links].dec, &shard_frame_cb, &ctx[links]);
+      if (shardPoolAddLink(pool, &shard_read_cb, NULL, url, SERIAL_BAUD, NULL,
+               &ctx[links], &cfg->opts) != links)
+         fprintf(stderr, "Unable to open %s\n", url);
+      else
+         links++;
+   }
+
+   if (shardPoolStart(pool) < 0) {
+      fprintf(stderr, "Unable to start the shard threads\n");
+      shardPoolStop(pool);
+      free(ctx);
+      free(urls);
+      return -1;
+   }
+   for (i = 0; i < links; i++)
+      if (shardPoolSend(pool, i, cmd, len) < 0)
+         fprintf(stderr, "Command to %s dropped\n", ctx[i].url);
+
+   ts.tv_sec = RUN_TIME_MS / 1000;
+   ts.tv_nsec = (RUN_TIME_MS % 1000) * 1000000L;
+   while (nanosleep(&ts, &ts) < 0)
+      ;
+
+   for (i = 0; i < shardPoolShards(pool); i++) {
+      shardPoolStats(pool, i, &st);
+      fprintf(stderr, "shard %d: %d links, %llu commands, %llu dropped, "
+            "latency avg %.1f us max %.1f us, cpu %.1f ms\n", i, st.links,
+            (unsigned long long)st.commands, (unsigned long long)st.dropped,
+            st.commands ? st.latencySumNs / 1000.0 / st.commands : 0.0,
+            st.latencyMaxNs / 1000.0, st.cpuNs / 1000000.0);
+   }
+
+   shardPoolStop(pool);
+   free(ctx);
+   free(urls);
+   outputFlush();
+
+   return 0;
+}
+
+// Run one output path over a synthetic stream; returns seconds taken
+static double bench_pass(enum outputFormat fmt, const unsigned char *stream,
+      int len)
+{
+   struct shardLinkCtx ctx;
+   struct timespec start, end;
+   int off, chunk;
+
+   ctx.url = "bench";
+   ctx.fmt = fmt;
+   kissDecoderInit(&ctx.dec, &shard_frame_cb, &ctx);
+
+   clock_gettime(CLOCK_MONOTONIC, &start);
+   for (off = 0; off < len; off += chunk) {
+      chunk = len - off < BENCH_CHUNK ? len - off : BENCH_CHUNK;
+      if (outputFramed(fmt))
+         kissDecode(&ctx.dec, stream + off, chunk);
+      else
+         outputChunk(fmt, stream + off, chunk);
+      outputFlush();
+   }
+   clock_gettime(CLOCK_MONOTONIC, &end);
+
+   return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// Fixed point and float fields decoded against known values, so a broken
+// scale path fails before anything is timed
+static int check_schema(void)
+{
+   static const char text[] =
+      "msg 0x01 check\n"
+      "u16 mv *0.001\n"
+      "i16 temp *0.1\n"
+      "f32 volts *0.1\n"
+      "f64 lat *10\n";
+   static const unsigned char payload[] = {
+      0xE4, 0x0C, 0x83, 0xFF, 0x00, 0x00, 0x48, 0x41,
+      0, 0, 0, 0, 0, 0, 0x12, 0x40,
+   };
+   static const char expect[] =
+      "\"mv\":3.300,\"temp\":-12.5,\"volts\":1.25,\"lat\":45";
+   struct schema *s;
+   char out[256];
+   FILE *fp;
+   int rc = -1;
+
+   fp = fmemopen((void *)text, sizeof(text) - 1, "r");
+   if (!fp)
+      return -1;
+   s = schemaLoadFile(fp, "check");
+   fclose(fp);
+   if (!s)
+      return -1;
+
+   if (schemaFormatJSON(schemaMsgAt(s, 0), payload, sizeof(payload), out,
+         sizeof(out)) < 0)
+      fprintf(stderr, "Schema check failed to format\n");
+   else if (strcmp(out, expect))
+      fprintf(stderr, "Schema check mismatch: %s\n", out);
+   else
+      rc = 0;
+   schemaFree(s);
+
+   return rc;
+}
+
+// Time hex, hex JSON, schema JSON and schema binary output on the same
+// synthetic downlink: frames cycle through the schema's messages with
+// random field values.  Output goes to /dev/null, results to stderr.
+static int run_benchmark(const struct schema *sch, int frames)
+{
+   static const struct {
+      const char *name;
+      enum outputFormat fmt;
+      int useSchema;
+   } passes[] = {
+      { "hex", OUTPUT_HEX, 0 },
+      { "json", OUTPUT_JSON, 0 },
+      { "json+schema", OUTPUT_JSON, 1 },
+      { "bin+schema", OUTPUT_BIN, 1 },
+   };
+   unsigned char body[256], *stream, *tmp;
+   const struct schemaMsg *m;
+   unsigned int seed = 1;
+   int len = 0, cap = 0, flen, i, j, saved, devnull;
+   double secs;
+
+   if (!schemaCount(sch)) {
+      fprintf(stderr, "Schema has no messages\n");
+      return -1;
+   }
+   if (check_schema() < 0)
+      return -1;
+
+   stream = NULL;
+   for (i = 0; i < frames; i++) {
+      m = schemaMsgAt(sch, i % schemaCount(sch));
+      if (m->minLen + 1 > sizeof(body)) {
+         fprintf(stderr, "Message %s too long to benchmark\n", m->name);
+         free(stream);
+         return -1;
+      }
+      body[0] = m->id;
+      for (j = 1; j <= m->minLen; j++)
+         body[j] = rand_r(&seed);
+
+      if (len + 2 * sizeof(body) + 9 > cap) {
+         cap = cap ? 2 * cap : 1024 * 1024;
+         tmp = realloc(stream, cap);
+         if (!tmp) {
+            free(stream);
+            return -1;
+         }
+         stream = tmp;
+      }
+      flen = kissCommand(stream + len, cap - len, body, m->minLen + 1);
+      if (flen > 0)
+         len += flen;
+   }
+
+   fflush(stdout);
+   saved = dup(STDOUT_FILENO);
+   devnull = open("/dev/null", O_WRONLY);
+   if (saved < 0 || devnull < 0) {
+      perror("/dev/null");
+      free(stream);
+      return -1;
+   }
+   dup2(devnull, STDOUT_FILENO);
+   close(devnull);
+
+   fprintf(stderr, "%d frames, %d bytes on the wire\n", frames, len);
+   for (i = 0; i < sizeof(passes) / sizeof(passes[0]); i++) {
+      outputSetSchema(passes[i].useSchema ? sch : NULL);
+      secs = bench_pass(passes[i].fmt, stream, len);
+      fprintf(stderr, "%-12s %8.3f s %12.0f frames/s %9.1f MB/s in\n",
+            passes[i].name, secs, frames / secs, len / secs / 1e6);
+   }
+   outputSetSchema(sch);
+
+   dup2(saved, STDOUT_FILENO);
+   close(saved);
+   free(stream);
+
+   return 0;
+}
+
+// Read a whole file and build its upload frames
+static struct upload *load_upload(const char *path, int compress)
+{
+   struct upload *up;
+   unsigned char *data = NULL, *tmp;
+   size_t len = 0, cap = 0, n;
+   FILE *fp;
+
+   fp = fopen(path, "rb");
+   if (!fp) {
+      perror(path);
+      return NULL;
+   }
+
+   do {
+      if (len == cap) {
+         cap = cap ? 2 * cap : 64 * 1024;
+         tmp = realloc(data, cap);
+         if (!tmp) {
+            free(data);
+            fclose(fp);
+            return NULL;
+         }
+         data = tmp;
+      }
+      n = fread(data + len, 1, cap - len, fp);
+      len += n;
+   } while (n > 0);
+   fclose(fp);
+
+   up = uploadCreate(data, len, compress, 0);
+   if (!up)
+      printf("Unable to build upload of %s\n", path);
+   free(data);
+
+   return up;
+}
+
+static void usage(const char *prog)
+{
+   printf("Usage: %s [options] <kiss path> <cmd byte> "
+          "[<cmd byte> ...]\n", prog);
+   printf("       %s [options] -t <timeline file> <kiss path>\n", prog);
+   printf("       %s [options] -i <socket> <kiss path>\n", prog);
+   printf("       %s -I <socket> <cmd byte> [<cmd byte> ...]\n", prog);
+   printf("       %s [options] -U <file> [-z] <kiss path>\n", prog);
+   printf("       %s -S <schema> [-H] [-x <frames>]\n", prog);
+   printf("       %s -L <port> [-K <script>]\n", prog);
+   printf("       %s [options] -M <spec> [-K <script>]\n", prog);
+   printf("  -f  receive output format: hex (default), raw, json or bin\n");
+   printf("  -u  use the io_uring transport when available\n");
+   printf("  -T  decode received data on a separate thread\n");
+   printf("  -P  use SOCK_SEQPACKET for unix:// paths\n");
+   printf("  -F  TCP Fast Open and immediate connect for tcp:// paths\n");
+   printf("  -p  reserve link buffers up front so traffic makes no heap "
+          "calls\n");
+   printf("  -B  receive and transmit buffer size (default %d)\n",
+         SERIAL_DEFAULT_BUFFER_SIZE);
+   printf("  -Q  transmit queue high-water mark in bytes (default %d)\n",
+         SERIAL_DEFAULT_QUEUE_LIMIT);
+   printf("  -r  receive batching: lowat=bytes,busypoll=us for sockets, "
+          "vmin=bytes,vtime=ds\n      for serial devices\n");
+   printf("  -s  write link statistics to this file every second\n");
+   printf("  -j  spread a comma separated list of paths over this many "
+          "threads\n");
+   printf("  -b  hot standby host:port for a tcp:// path, may repeat\n");
+   printf("  -i  serve shared memory command rings on this UNIX socket "
+          "until SIGINT\n");
+   printf("  -I  the path is an -i socket; put the command in its ring\n");
+   printf("  -t  send the commands in this file at their scheduled UTC "
+          "times\n");
+   printf("  -S  decode frames into typed fields with this schema file\n");
+   printf("  -H  print the schema's binary record structs as a C header\n");
+   printf("  -x  benchmark output paths on this many synthetic frames\n");
+   printf("  -U  upload this file as a series of commands\n");
+   printf("  -z  LZ compress the -U upload\n");
+   printf("  -L  run a local KISS TCP server on this port until SIGINT\n");
+   printf("  -K  server reply script, e.g. echo*98,drop,ack@200\n");
+   printf("  -M  stress tcp:// links against a local server, e.g. "
+          "links=200,secs=20,kill=100\n");
+   printf("  -Z  run against a simulated peer on a virtual clock, e.g. "
+          "refuse=2,reset=64\n");
 }
 
 int main(int argc, char **argv)
 {
    unsigned char cmd[1024];
-   unsigned char kiss[1024];
-   int cmdLen = 1, kissLen = 0;
-   int ind;
-   uint16_t crc;
+   unsigned char kiss[2 * sizeof(cmd) + 3];
+   int cmdLen = 0, kissLen = 0;
+   int ind, res = 0, status = 0;
+   struct config cfg;
+   int opt;
+   const char *timelinePath = NULL;
+   char standby[1024] = "";
+   int injectProducer = 0;
+   struct injectClient *ic;
+   struct schema *sch = NULL;
+   int printHeader = 0, benchFrames = 0;
+   struct netSimPeer peer;
+   struct timespec wallStart, wallEnd;
+   const char *uploadPath = NULL;
+   int compress = 0;
+   const char *script = NULL;
+   int serverPort = -1, stress = 0;
+   struct stressConfig scfg;
+
+   memset(&cfg, 0, sizeof(cfg));
+   cfg.fmt = OUTPUT_HEX;
+   stressDefaults(&scfg);
+   while ((opt = getopt(argc, argv, "+f:uTB:Q:PFps:j:t:b:i:IS:Hx:Z:U:zL:K:M:r:")) != -1) {
+      switch (opt) {
+         case 'f':
+            if (outputParseFormat(optarg, &cfg.fmt) < 0) {
+               printf("Unknown output format: %s\n", optarg);
+               return 1;
+            }
+            break;
+
+         case 'u':
+            cfg.opts.flags |= SERIAL_OPT_URING;
+            break;
+
+         case 'T':
+            cfg.threaded = 1;
+            break;
+
+         case 'P':
+            cfg.opts.flags |= SERIAL_OPT_SEQPACKET;
+            break;
+
+         case 'F':
+            cfg.opts.flags |= SERIAL_OPT_FASTOPEN;
+            break;
+
+         case 'p':
+            cfg.opts.flags |= SERIAL_OPT_PREALLOC;
+            break;
+
+         case 'B':
+            cfg.opts.readBufferSize = cfg.opts.writeBufferSize =
+               strtoul(optarg, NULL, 0);
+            break;
+
+         case 'Q':
+            cfg.opts.highWater = strtoul(optarg, NULL, 0);
+            break;
+
+         case 'r':
+            if (parse_rx_options(optarg, &cfg.opts) < 0) {
+               printf("Bad receive options: %s\n", optarg);
+               return 1;
+            }
+            break;
+
+         case 's':
+            cfg.statsPath = optarg;
+            break;
+
+         case 'j':
+            cfg.shards = atoi(optarg);
+            break;
+
+         case 't':
+            timelinePath = optarg;
+            break;
+
+         case 'i':
+            cfg.injectPath = optarg;
+            break;
+
+         case 'I':
+            injectProducer = 1;
+            break;
+
+         case 'S':
+            schemaFree(sch);
+            sch = schemaLoad(optarg);
+            if (!sch)
+               return 1;
+            break;
+
+         case 'H':
+            printHeader = 1;
+            break;
+
+         case 'x':
+            benchFrames = atoi(optarg);
+            break;
+
+         case 'U':
+            uploadPath = optarg;
+            break;
+
+         case 'z':
+            compress = 1;
+            break;
+
+         case 'L':
+            serverPort = atoi(optarg);
+            break;
+
+         case 'K':
+            script = optarg;
+            break;
+
+         case 'M':
+            if (stressParse(&scfg, optarg) < 0) {
+               printf("Bad stress settings: %s\n", optarg);
+               return 1;
+            }
+            stress = 1;
+            break;
+
+         case 'Z':
+            if (netSimParsePeer(optarg, &peer) < 0) {
+               printf("Bad simulated peer: %s\n", optarg);
+               return 1;
+            }
+            if (!cfg.sim) {
+               cfg.sim = netSimCreate();
+               if (cfg.sim)
+                  netSimSetLimit(cfg.sim, SIM_LIMIT_MS);
+            }
+            if (!cfg.sim || netSimAddPeer(cfg.sim, 0, &peer) < 0)
+               return 1;
+            netSimSetLog(cfg.sim, stderr);
+            cfg.opts.netOps = netSimOps(cfg.sim);
+            break;
+
+         case 'b':
+            if (strlen(standby) + strlen(optarg) + 2 > sizeof(standby)) {
+               printf("Too many standby endpoints\n");
+               return 1;
+            }
+            if (*standby)
+               strcat(standby, " ");
+            strcat(standby, optarg);
+            cfg.opts.standby = standby;
+            break;
+
+         default:
+            usage(argv[0]);
+            return 1;
+      }
+   }
 
-   if (argc < 3) {
-      printf("Usage: %s <kiss path> <cmd byte> "
-             "[<cmd byte> ...]\n", argv[0]);
+   // Schema tools run offline and need no link
+   if (printHeader || benchFrames > 0) {
+      if (!sch) {
+         usage(argv[0]);
+         return 1;
+      }
+      if (printHeader)
+         schemaWriteHeader(sch, stdout);
+      if (benchFrames > 0 && run_benchmark(sch, benchFrames) < 0)
+         return 1;
+      schemaFree(sch);
       return 0;
    }
+   outputSetSchema(sch);
 
-   for (ind = 2; ind < argc && cmdLen < sizeof(cmd); ind++)
-      cmd[cmdLen++] = strtol(argv[ind], NULL, 0);
+   // The local server and the harness use real sockets on loopback
+   if (serverPort >= 0 || stress) {
+      schemaFree(sch);
+      if (cfg.sim || (serverPort >= 0 && stress)) {
+         usage(argv[0]);
+         return 1;
+      }
+      if (serverPort >= 0)
+         return run_kiss_server(serverPort, script) < 0;
+      scfg.script = script;
+      scfg.opts = cfg.opts;
+      return stressRun(&scfg, stdout) < 0;
+   }
+
+   // The simulator only stands in for tcp:// and unix:// links
+   if (cfg.sim && (cfg.injectPath || timelinePath || cfg.shards > 0 ||
+            injectProducer)) {
+      usage(argv[0]);
+      return 1;
+   }
+
+   if (uploadPath) {
+      if (argc - optind < 1 || cfg.shards > 0 || timelinePath ||
+            cfg.injectPath || injectProducer) {
+         usage(argv[0]);
+         return 1;
+      }
+      cfg.up = load_upload(uploadPath, compress);
+      if (!cfg.up)
+         return 1;
+
+      cfg.url = argv[optind];
+      clock_gettime(CLOCK_MONOTONIC, &wallStart);
+      res = send_command(&cfg, NULL, 0);
+      uploadFree(cfg.up);
+      goto done;
+   }
 
-   cmd[0] = cmdLen - 1;
-   crc = crc16((char*)cmd, cmdLen);
-   cmd[cmdLen++] = (crc >> 8) & 0xFF;
-   cmd[cmdLen++] = crc & 0xFF;
-
-   kiss[kissLen++] = FEND;
-   kiss[kissLen++] = 0;
-   for (ind = 0; ind < cmdLen; ind++) {
-      if (cmd[ind] == FESC) {
-         kiss[kissLen++] = FESC;
-         kiss[kissLen++] = TFESC;
+   if (cfg.injectPath) {
+      if (argc - optind < 1 || cfg.shards > 0 || timelinePath) {
+         usage(argv[0]);
+         return 1;
       }
-      else if (cmd[ind] == FEND) {
-         kiss[kissLen++] = FESC;
-         kiss[kissLen++] = TFEND;
+      cfg.url = argv[optind];
+      send_command(&cfg, NULL, 0);
+      return 0;
+   }
+
+   if (timelinePath) {
+      if (argc - optind < 1 || cfg.shards > 0) {
+         usage(argv[0]);
+         return 1;
       }
+      cfg.tl = timelineLoad(timelinePath);
+      if (!cfg.tl)
+         return 1;
+      printf("%d commands scheduled\n", timelineCount(cfg.tl));
+
+      cfg.url = argv[optind];
+      send_command(&cfg, NULL, 0);
+      timelineFree(cfg.tl);
+      return 0;
+   }
+
+   if (argc - optind < 2) {
+      usage(argv[0]);
+      return 0;
+   }
+
+   for (ind = optind + 1; ind < argc && cmdLen < sizeof(cmd) - 3; ind++)
+      cmd[cmdLen++] = strtol(argv[ind], NULL, 0);
+
+   // Hand the raw payload to a running -i daemon's ring
+   if (injectProducer) {
+      ic = injectClientOpen(argv[optind]);
+      if (!ic) {
+         perror(argv[optind]);
+         return 1;
+      }
+      if (injectClientSend(ic, cmd, cmdLen, 1000) < 0)
+         printf("Injection ring full\n");
       else
-         kiss[kissLen++] = cmd[ind];
+         printf("Injected!\n");
+      injectClientClose(ic);
+      return 0;
    }
-   kiss[kissLen++] = FEND;
+
+   kissLen = kissCommand(kiss, sizeof(kiss), cmd, cmdLen);
 
    for (ind = 0; ind < kissLen; ind++)
       printf("%02X ", kiss[ind]);
    printf("\n");
 
-   send_command(argv[1], kiss, kissLen);
+   cfg.url = argv[optind];
+   clock_gettime(CLOCK_MONOTONIC, &wallStart);
+   if (cfg.shards > 0) {
+      if (send_command_sharded(&cfg, kiss, kissLen) < 0)
+         status = 1;
+   }
+   else
+      res = send_command(&cfg, kiss, kissLen);
 
-   return 0;
+done:
+   schemaFree(sch);
+   if (cfg.sim) {
+      clock_gettime(CLOCK_MONOTONIC, &wallEnd);
+      fprintf(stderr, "simulated %.3f s in %.3f ms\n",
+            netSimElapsedUs(cfg.sim) / 1e6,
+            (wallEnd.tv_sec - wallStart.tv_sec) * 1e3 +
+            (wallEnd.tv_nsec - wallStart.tv_nsec) / 1e6);
+      netSimFree(cfg.sim);
+      // A simulated run is a test: fail it if nothing came back
+      if (res < 0) {
+         fprintf(stderr, "simulation: no reply\n");
+         return 1;
+      }
+   }
+
+   return status;
 }
@@ -0,0 +1,563 @@
+#define _GNU_SOURCE // memfd_create, accept4
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/eventfd.h>
+#include "spsc.h"
+#include "kiss.h"
+#include "inject.h"
+
+#define INJECT_MAGIC 0x454e4a31 // "ENJ1"
+// The ring starts one cache line into the mapping
+#define INJECT_HDR_SIZE SPSC_CACHELINE
+
+// First cache line of the shared mapping
+struct injectShm {
+   uint32_t magic;
+   uint32_t size; // Bytes in the whole mapping
+   volatile uint32_t producerWaiting; // Producer is blocked on spaceFd
+};
+
+// Sent with the fds when a producer connects
+struct injectHello {
+   uint32_t magic;
+   uint32_t size;
+};
+
+#define SHM_RING(shm) \
+   ((struct spscRing *)((char *)(shm) + INJECT_HDR_SIZE))
+
+struct injectProducer {
+   struct injectServer *srv;
+   struct injectProducer *next;
+   int sock; // -1 once the producer has gone
+   int dataFd; // Producer signals here when the ring becomes non-empty
+   int spaceFd; // We signal here when a waiting producer has room
+   struct injectShm *shm;
+   uint32_t size;
+   uint32_t slots; // Geometry as we set it; the shared copy is not trusted
+   uint32_t tail; // Our copy of the ring's tail, likewise
+};
+
+struct injectServer {
+   struct EventState *evt_loop;
+   struct serialInterface *si;
+   int sock;
+   char *path;
+   uint32_t slots;
+   int blocked; // The link refused a write; wait for injectServerWritable
+   struct injectProducer *producers;
+   struct injectStats st;
+};
+
+struct injectClient {
+   int sock;
+   int dataFd;
+   int spaceFd;
+   struct injectShm *shm;
+   uint32_t size;
+   struct spscRing *ring;
+};
+
+static void producerFree(struct injectProducer *p)
+{
+   struct injectProducer **pp;
+
+   for (pp = &p->srv->producers; *pp; pp = &(*pp)->next)
+      if (*pp == p) {
+         *pp = p->next;
+         break;
+      }
+
+   EVT_fd_remove(p->srv->evt_loop, p->dataFd, EVENT_FD_READ);
+   if (p->sock >= 0) {
+      EVT_fd_remove(p->srv->evt_loop, p->sock, EVENT_FD_READ);
+      close(p->sock);
+      p->srv->st.producers--;
+   }
+   close(p->dataFd);
+   close(p->spaceFd);
+   munmap(p->shm, p->size);
+   free(p);
+}
+
+// The producer can rewrite anything in the mapping at any time, so the
+// oldest record is found with our own geometry and tail and its length is
+// read once.  Returns 0 with a record, -1 if the ring is empty, -2 if the
+// head is impossible.
+static int producerPeek(struct injectProducer *p, void **buf, uint32_t *len)
+{
+   struct spscRing *ring = SHM_RING(p->shm);
+   uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+   char *slot;
+
+   if (head == p->tail)
+      return -1;
+   if (head - p->tail > p->slots)
+      return -2;
+
+   slot = ring->data + (size_t)(p->tail & (p->slots - 1)) *
+      SPSC_STRIDE(INJECT_SLOT_SIZE);
+   *len = __atomic_load_n((uint32_t *)slot, __ATOMIC_RELAXED);
+   *buf = slot + SPSC_SLOT_HDR;
+
+   return 0;
+}
+
+static void producerRelease(struct injectProducer *p)
+{
+   p->tail++;
+   __atomic_store_n(&SHM_RING(p->shm)->tail, p->tail, __ATOMIC_RELEASE);
+}
+
+// Write queued records to the link until the ring empties or the link
+// pushes back.  Returns -1 if the producer was freed.
+static int producerDrain(struct injectProducer *p)
+{
+   unsigned char frame[2 * (INJECT_SLOT_SIZE + 3) + 3];
+   struct serialInterface *si = p->srv->si;
+   int flen, res, peek, released = 0;
+   uint64_t val = 1;
+   uint32_t len;
+   void *buf;
+
+   while (!p->srv->blocked) {
+      if ((peek = producerPeek(p, &buf, &len)) == -1) {
+         // Publish our tail before the final look so a racing commit
+         // either sees the ring empty and signals, or we see its record
+         __atomic_thread_fence(__ATOMIC_SEQ_CST);
+         peek = producerPeek(p, &buf, &len);
+      }
+      if (peek == -2) {
+         DBG_print(DBG_LEVEL_WARN, "Injection ring corrupted, "
+               "disconnecting\n");
+         producerFree(p);
+         return -1;
+      }
+      if (peek < 0)
+         break;
+
+      flen = -1;
+      if (len <= INJECT_SLOT_SIZE)
+         flen = kissCommand(frame, sizeof(frame), buf, len);
+      res = flen < 0 ? SERIAL_WRITE_DROPPED : si->write(si, frame, flen);
+      if (res == SERIAL_WRITE_WOULDBLOCK) {
+         // Leave the record in the ring; the producer sees it fill up
+         p->srv->blocked = 1;
+         p->srv->st.blocked++;
+         break;
+      }
+      if (res < 0)
+         p->srv->st.dropped++;
+      else
+         p->srv->st.commands++;
+      producerRelease(p);
+      released = 1;
+   }
+
+   if (released) {
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&p->shm->producerWaiting, __ATOMIC_SEQ_CST)) {
+         __atomic_store_n(&p->shm->producerWaiting, 0, __ATOMIC_SEQ_CST);
+         if (write(p->spaceFd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+            DBG_print(DBG_LEVEL_WARN, "Injection wakeup failed: %s\n",
+                  strerror(errno));
+      }
+   }
+
+   // A departed producer's records are still sent before it is freed
+   if (p->sock < 0 && producerPeek(p, &buf, &len) != 0) {
+      producerFree(p);
+      return -1;
+   }
+
+   return 0;
+}
+
+static int dataEvent(int fd, char type, void *arg)
+{
+   struct injectProducer *p = (struct injectProducer *)arg;
+   uint64_t val;
+
+   if (read(p->dataFd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+      return EVENT_KEEP;
+
+   producerDrain(p);
+
+   return EVENT_KEEP;
+}
+
+static int producerSockEvent(int fd, char type, void *arg)
+{
+   struct injectProducer *p = (struct injectProducer *)arg;
+   char buf[64];
+   int res;
+
+   res = read(p->sock, buf, sizeof(buf));
+   if (res > 0 || (res < 0 && (errno == EAGAIN || errno == EINTR)))
+      return EVENT_KEEP;
+
+   // Producer went away; drain what it left, then free it
+   close(p->sock);
+   p->sock = -1;
+   p->srv->st.producers--;
+   producerDrain(p);
+
+   return EVENT_REMOVE;
+}
+
+// Give a new producer its ring and eventfds
+static int producerSetup(struct injectServer *srv, int sock)
+{
+   struct injectProducer *p;
+   struct injectHello hello;
+   struct msghdr msg;
+   struct iovec iov;
+   struct cmsghdr *cmsg;
+   char control[CMSG_SPACE(3 * sizeof(int))];
+   int memfd, fds[3];
+
+   p = (struct injectProducer *)calloc(1, sizeof(*p));
+   if (!p) {
+      DBG_print(DBG_LEVEL_WARN, "Insufficient memory\n");
+      return -1;
+   }
+   p->srv = srv;
+   p->sock = sock;
+   p->slots = srv->slots;
+   p->size = INJECT_HDR_SIZE + spscSize(srv->slots, INJECT_SLOT_SIZE);
+
+   memfd = memfd_create("endura-inject", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+   p->dataFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   p->spaceFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (memfd < 0 || p->dataFd < 0 || p->spaceFd < 0 ||
+         ftruncate(memfd, p->size) < 0) {
+      DBG_print(DBG_LEVEL_WARN, "Unable to create injection ring: %s\n",
+            strerror(errno));
+      goto fail;
+   }
+
+   // A producer that shrank the file could fault us with SIGBUS
+   if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW |
+            F_SEAL_SEAL) < 0)
+      DBG_print(DBG_LEVEL_WARN, "Unable to seal injection ring: %s\n",
+            strerror(errno));
+
+   p->shm = mmap(NULL, p->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+         memfd, 0);
+   if (p->shm == MAP_FAILED) {
+      p->shm = NULL;
+      DBG_print(DBG_LEVEL_WARN, "Unable to map injection ring: %s\n",
+            strerror(errno));
+      goto fail;
+   }
+   p->shm->magic = INJECT_MAGIC;
+   p->shm->size = p->size;
+   spscInit(SHM_RING(p->shm), srv->slots, INJECT_SLOT_SIZE);
+   p->slots = SHM_RING(p->shm)->slots;
+
+   hello.magic = INJECT_MAGIC;
+   hello.size = p->size;
+   iov.iov_base = &hello;
+   iov.iov_len = sizeof(hello);
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = control;
+   msg.msg_controllen = sizeof(control);
+   cmsg = CMSG_FIRSTHDR(&msg);
+   cmsg->cmsg_level = SOL_SOCKET;
+   cmsg->cmsg_type = SCM_RIGHTS;
+   cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+   fds[0] = memfd;
+   fds[1] = p->dataFd;
+   fds[2] = p->spaceFd;
+   memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+   if (sendmsg(sock, &msg, MSG_NOSIGNAL) != sizeof(hello)) {
+      DBG_print(DBG_LEVEL_WARN, "Unable to send injection ring: %s\n",
+            strerror(errno));
+      goto fail;
+   }
+   close(memfd);
+
+   EVT_fd_add(srv->evt_loop, p->dataFd, EVENT_FD_READ, &dataEvent, p);
+   EVT_fd_add(srv->evt_loop, sock, EVENT_FD_READ, &producerSockEvent, p);
+   p->next = srv->producers;
+   srv->producers = p;
+   srv->st.producers++;
+
+   return 0;
+
+fail:
+   if (memfd >= 0)
+      close(memfd);
+   if (p->dataFd >= 0)
+      close(p->dataFd);
+   if (p->spaceFd >= 0)
+      close(p->spaceFd);
+   if (p->shm)
+      munmap(p->shm, p->size);
+   free(p);
+   return -1;
+}
+
+static int acceptEvent(int fd, char type, void *arg)
+{
+   struct injectServer *srv = (struct injectServer *)arg;
+   int sock;
+
+   sock = accept4(srv->sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+   if (sock < 0)
+      return EVENT_KEEP;
+
+   if (producerSetup(srv, sock) < 0)
+      close(sock);
+
+   return EVENT_KEEP;
+}
+
+struct injectServer *injectServerStart(struct EventState *evt_loop,
+      const char *path, struct serialInterface *si, uint32_t slots)
+{
+   struct injectServer *srv;
+   struct sockaddr_un addr;
+
+   if (!path || strlen(path) >= sizeof(addr.sun_path)) {
+      DBG_print(DBG_LEVEL_WARN, "Invalid injection socket path\n");
+      return NULL;
+   }
+
+   srv = (struct injectServer *)calloc(1, sizeof(*srv));
+   if (!srv || !(srv->path = strdup(path))) {
+      DBG_print(DBG_LEVEL_WARN, "Insufficient memory\n");
+      free(srv);
+      return NULL;
+   }
+   srv->evt_loop = evt_loop;
+   srv->si = si;
+   srv->slots = slots ? slots : INJECT_DEFAULT_SLOTS;
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, path);
+   unlink(path);
+
+   srv->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+         0);
+   if (srv->sock < 0 ||
+         bind(srv->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+         listen(srv->sock, 8) < 0) {
+      DBG_print(DBG_LEVEL_WARN, "Unable to listen on %s: %s\n", path,
+            strerror(errno));
+      if (srv->sock >= 0)
+         close(srv->sock);
+      free(srv->path);
+      free(srv);
+      return NULL;
+   }
+
+   EVT_fd_add(evt_loop, srv->sock, EVENT_FD_READ, &acceptEvent, srv);
+
+   return srv;
+}
+
+void injectServerWritable(struct injectServer *srv)
+{
+   struct injectProducer *p, *next;
+
+   if (!srv || !srv->blocked)
+      return;
+
+   srv->blocked = 0;
+   for (p = srv->producers; p && !srv->blocked; p = next) {
+      next = p->next;
+      producerDrain(p);
+   }
+}
+
+void injectServerStats(const struct injectServer *srv,
+      struct injectStats *stats)
+{
+   *stats = srv->st;
+}
+
+void injectServerStop(struct injectServer *srv)
+{
+   if (!srv)
+      return;
+
+   while (srv->producers)
+      producerFree(srv->producers);
+
+   EVT_fd_remove(srv->evt_loop, srv->sock, EVENT_FD_READ);
+   close(srv->sock);
+   unlink(srv->path);
+   free(srv->path);
+   free(srv);
+}
+
+struct injectClient *injectClientOpen(const char *path)
+{
+   struct injectClient *c;
+   struct injectHello hello;
+   struct sockaddr_un addr;
+   struct msghdr msg;
+   struct iovec iov;
+   struct cmsghdr *cmsg;
+   char control[CMSG_SPACE(3 * sizeof(int))];
+   int fds[3] = { -1, -1, -1 };
+   int err;
+
+   if (strlen(path) >= sizeof(addr.sun_path)) {
+      errno = ENAMETOOLONG;
+      return NULL;
+   }
+
+   c = (struct injectClient *)calloc(1, sizeof(*c));
+   if (!c)
+      return NULL;
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sun_family = AF_UNIX;
+   strcpy(addr.sun_path, path);
+   c->sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+   if (c->sock < 0 ||
+         connect(c->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+      goto fail;
+
+   iov.iov_base = &hello;
+   iov.iov_len = sizeof(hello);
+   memset(&msg, 0, sizeof(msg));
+   msg.msg_iov = &iov;
+   msg.msg_iovlen = 1;
+   msg.msg_control = control;
+   msg.msg_controllen = sizeof(control);
+   if (recvmsg(c->sock, &msg, MSG_CMSG_CLOEXEC) != sizeof(hello) ||
+         hello.magic != INJECT_MAGIC) {
+      errno = EPROTO;
+      goto fail;
+   }
+
+   cmsg = CMSG_FIRSTHDR(&msg);
+   if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS ||
+         cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+      errno = EPROTO;
+      goto fail;
+   }
+   memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+   c->dataFd = fds[1];
+   c->spaceFd = fds[2];
+
+   c->size = hello.size;
+   c->shm = mmap(NULL, c->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+         fds[0], 0);
+   if (c->shm == MAP_FAILED) {
+      c->shm = NULL;
+      goto fail;
+   }
+   close(fds[0]);
+   c->ring = SHM_RING(c->shm);
+
+   return c;
+
+fail:
+   err = errno;
+   if (fds[0] >= 0)
+      close(fds[0]);
+   if (fds[1] >= 0)
+      close(fds[1]);
+   if (fds[2] >= 0)
+      close(fds[2]);
+   if (c->sock >= 0)
+      close(c->sock);
+   free(c);
+   errno = err;
+   return NULL;
+}
+
+void *injectClientReserve(struct injectClient *c)
+{
+   return spscReserve(c->ring);
+}
+
+void injectClientCommit(struct injectClient *c, uint32_t len)
+{
+   uint64_t val = 1;
+
+   spscCommit(c->ring, len);
+
+   // Only the commit that makes the ring non-empty needs a wakeup
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   if (spscDepth(c->ring) == 1 && write(c->dataFd, &val, sizeof(val)) < 0)
+      DBG_print(DBG_LEVEL_WARN, "Injection wakeup failed: %s\n",
+            strerror(errno));
+}
+
+static int ringHasRoom(struct injectClient *c)
+{
+   return spscDepth(c->ring) < c->ring->slots;
+}
+
+int injectClientWait(struct injectClient *c, int timeoutMs)
+{
+   struct pollfd pfd;
+   uint64_t val;
+
+   pfd.fd = c->spaceFd;
+   pfd.events = POLLIN;
+   while (!ringHasRoom(c)) {
+      // Announce the wait, then look again so a release is never missed
+      __atomic_store_n(&c->shm->producerWaiting, 1, __ATOMIC_SEQ_CST);
+      if (ringHasRoom(c))
+         break;
+
+      if (poll(&pfd, 1, timeoutMs) <= 0) {
+         __atomic_store_n(&c->shm->producerWaiting, 0, __ATOMIC_SEQ_CST);
+         return -1;
+      }
+      if (read(c->spaceFd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+         return -1;
+   }
+   __atomic_store_n(&c->shm->producerWaiting, 0, __ATOMIC_SEQ_CST);
+
+   return 0;
+}
+
+int injectClientSend(struct injectClient *c, const void *src, uint32_t len,
+      int timeoutMs)
+{
+   void *slot;
+
+   if (len > INJECT_SLOT_SIZE)
+      return -1;
+
+   slot = injectClientReserve(c);
+   if (!slot && timeoutMs != 0 && injectClientWait(c, timeoutMs) == 0)
+      slot = injectClientReserve(c);
+   if (!slot)
+      return -1;
+
+   memcpy(slot, src, len);
+   injectClientCommit(c, len);
+
+   return 0;
+}
+
+void injectClientClose(struct injectClient *c)
+{
+   if (!c)
+      return;
+
+   munmap(c->shm, c->size);
+   close(c->dataFd);
+   close(c->spaceFd);
+   close(c->sock);
+   free(c);
+}
@@ -0,0 +1,100 @@
+#ifndef INJECT_H
+#define INJECT_H
+
+#include <stdint.h>
+#include <polysat/polysat.h>
+#include "serial.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Largest raw command payload a producer may put in one slot
+#define INJECT_SLOT_SIZE 256
+#define INJECT_DEFAULT_SLOTS 1024
+
+/* Command injection over shared memory.  The daemon listens on a UNIX
+ *   socket.  Each producer that connects is sent a memfd holding its own
+ *   SPSC ring and two eventfds over SCM_RIGHTS: one to wake the daemon
+ *   and one to wake a producer waiting for room.  Producers write raw
+ *   EnduraSat payloads into the ring.  The daemon adds the length and
+ *   CRC, KISS encodes straight from the slot and writes to the link.
+ *
+ *   Flow control: a full ring refuses the push, and the producer may wait
+ *   for room.  When the link returns SERIAL_WRITE_WOULDBLOCK the record
+ *   stays in the ring, so link backpressure reaches the producer.
+ */
+
+struct injectServer;
+struct injectClient;
+
+// Daemon side counters
+struct injectStats {
+   uint32_t producers; // Producers currently connected
+   uint64_t commands;  // Records written to the link
+   uint64_t dropped;   // Records the link dropped, or that were malformed
+   uint64_t blocked;   // Times draining paused on SERIAL_WRITE_WOULDBLOCK
+};
+
+/* Listen for producers on a UNIX socket path.  Any existing file at path
+ *   is replaced.
+ * @param evt_loop the event loop si runs on.
+ * @param path the UNIX socket path.
+ * @param si the link commands are written to.
+ * @param slots ring capacity per producer, 0 for the default.
+ * @return the server, or NULL on error. Check /var/log/syslog on error.
+ */
+struct injectServer *injectServerStart(struct EventState *evt_loop,
+      const char *path, struct serialInterface *si, uint32_t slots);
+
+/* Resume draining after the link refused a write.  Call from the link's
+ *   writable callback.
+ */
+void injectServerWritable(struct injectServer *srv);
+
+/* Snapshot the daemon side counters. */
+void injectServerStats(const struct injectServer *srv,
+      struct injectStats *stats);
+
+/* Disconnect every producer, unlink the socket and free the server. */
+void injectServerStop(struct injectServer *srv);
+
+/* Producer: connect to a daemon and map its ring.
+ * @return the client, or NULL on error with errno set.
+ */
+struct injectClient *injectClientOpen(const char *path);
+
+/* Producer: reserve the next slot to build a payload in place.
+ * @return a pointer to INJECT_SLOT_SIZE bytes, or NULL if the ring is full.
+ */
+void *injectClientReserve(struct injectClient *c);
+
+/* Producer: publish the slot from injectClientReserve and wake the daemon
+ *   if it is idle.
+ * @param len the number of payload bytes written.
+ */
+void injectClientCommit(struct injectClient *c, uint32_t len);
+
+/* Producer: wait until the ring has a free slot.
+ * @param timeoutMs longest to wait, -1 for no limit.
+ * @return 0 when there is room, -1 on timeout or error.
+ */
+int injectClientWait(struct injectClient *c, int timeoutMs);
+
+/* Producer: copy a payload into the ring, waiting for room if it is full.
+ * @param timeoutMs longest to wait for room, 0 to fail at once.
+ * @return -1 if the ring stayed full or len is too large, 0 on success.
+ */
+int injectClientSend(struct injectClient *c, const void *src, uint32_t len,
+      int timeoutMs);
+
+/* Producer: unmap the ring and disconnect.  Queued records are still sent
+ *   by the daemon.
+ */
+void injectClientClose(struct injectClient *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,236 @@
+#include <string.h>
+#include <pthread.h>
+#include "kiss.h"
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+/* Slice-by-8 tables: crcTable[k][b] is the CRC, from zero, of byte b
+ *   followed by k zero bytes.  The CRC is linear, so eight bytes fold into
+ *   eight independent lookups instead of 64 dependent shift steps.
+ */
+static uint16_t crcTable[8][256];
+static pthread_once_t crcOnce = PTHREAD_ONCE_INIT;
+
+static void crcTableInit(void)
+{
+   uint16_t crc;
+   int b, i, k;
+
+   for (b = 0; b < 256; b++) {
+      crc = b << 8;
+      for (i = 0; i < 8; i++)
+         crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+      crcTable[0][b] = crc;
+   }
+   for (k = 1; k < 8; k++)
+      for (b = 0; b < 256; b++)
+         crcTable[k][b] = (crcTable[k - 1][b] << 8) ^
+            crcTable[0][crcTable[k - 1][b] >> 8];
+}
+
+static uint16_t crc16Update(uint16_t wCrc, const unsigned char *p,
+      int length)
+{
+   uint16_t x;
+
+   pthread_once(&crcOnce, &crcTableInit);
+
+   // The running CRC only meets the first two bytes of each block
+   for (; length >= 8; p += 8, length -= 8) {
+      x = wCrc ^ ((p[0] << 8) | p[1]);
+      wCrc = crcTable[7][x >> 8] ^ crcTable[6][x & 0xFF] ^
+         crcTable[5][p[2]] ^ crcTable[4][p[3]] ^ crcTable[3][p[4]] ^
+         crcTable[2][p[5]] ^ crcTable[1][p[6]] ^ crcTable[0][p[7]];
+   }
+   while (length--)
+      wCrc = (wCrc << 8) ^ crcTable[0][((wCrc >> 8) ^ *p++) & 0xFF];
+
+   return wCrc;
+}
+
+#ifdef __ARM_NEON
+// Non-zero if any of the 16 bytes at p is FEND or FESC
+static inline int kissSpecial16(const unsigned char *p)
+{
+   uint8x16_t v = vld1q_u8(p);
+   uint8x16_t m = vorrq_u8(vceqq_u8(v, vdupq_n_u8(FEND)),
+         vceqq_u8(v, vdupq_n_u8(FESC)));
+   uint8x8_t h = vorr_u8(vget_low_u8(m), vget_high_u8(m));
+
+   return vget_lane_u64(vreinterpret_u64_u8(h), 0) != 0;
+}
+#endif
+
+uint16_t crc16(const void *pData, int length)
+{
+   return crc16Update(0xffff, (const unsigned char *)pData, length);
+}
+
+// Append one escaped byte; the caller leaves room for the closing FEND
+static int kissPut(unsigned char *dst, int dstLen, int out, unsigned char c)
+{
+   if (out + 3 > dstLen)
+      return -1;
+
+   if (c == FESC) {
+      dst[out++] = FESC;
+      dst[out++] = TFESC;
+   }
+   else if (c == FEND) {
+      dst[out++] = FESC;
+      dst[out++] = TFEND;
+   }
+   else
+      dst[out++] = c;
+
+   return out;
+}
+
+// Append len escaped bytes, leaving room for the closing FEND
+static int kissEscape(unsigned char *dst, int dstLen, int out,
+      const unsigned char *s, int len)
+{
+   int ind = 0;
+#ifdef __ARM_NEON
+   int end;
+
+   // Blocks without FEND or FESC are copied whole; the room check is the
+   // one the last byte of the block would get on its own
+   while (len - ind >= 16 && out + 18 <= dstLen) {
+      if (kissSpecial16(s + ind)) {
+         for (end = ind + 16; ind < end && out >= 0; ind++)
+            out = kissPut(dst, dstLen, out, s[ind]);
+         if (out < 0)
+            return -1;
+         continue;
+      }
+      memcpy(dst + out, s + ind, 16);
+      out += 16;
+      ind += 16;
+   }
+#endif
+
+   for (; ind < len && out >= 0; ind++)
+      out = kissPut(dst, dstLen, out, s[ind]);
+
+   return out;
+}
+
+int kissEncode(unsigned char *dst, int dstLen, int port,
+      const void *src, int len)
+{
+   int out = 0;
+
+   if (dstLen < 3)
+      return -1;
+
+   dst[out++] = FEND;
+   dst[out++] = (port & 0x0F) << 4;
+   out = kissEscape(dst, dstLen, out, (const unsigned char *)src, len);
+   if (out < 0)
+      return -1;
+   dst[out++] = FEND;
+
+   return out;
+}
+
+int kissCommand(unsigned char *dst, int dstLen, const void *body, int len)
+{
+   const unsigned char *s = (const unsigned char *)body;
+   unsigned char hdr = len & 0xFF;
+   uint16_t crc;
+   int out = 0;
+
+   // Encoded straight from body, so callers can pass a shared buffer
+   if (len < 0 || dstLen < 3)
+      return -1;
+
+   crc = crc16Update(crc16Update(0xffff, &hdr, 1), s, len);
+
+   dst[out++] = FEND;
+   dst[out++] = 0;
+   out = kissPut(dst, dstLen, out, hdr);
+   if (out >= 0)
+      out = kissEscape(dst, dstLen, out, s, len);
+   if (out >= 0)
+      out = kissPut(dst, dstLen, out, (crc >> 8) & 0xFF);
+   if (out >= 0)
+      out = kissPut(dst, dstLen, out, crc & 0xFF);
+   if (out < 0)
+      return -1;
+   dst[out++] = FEND;
+
+   return out;
+}
+
+void kissDecoderInit(struct kissDecoder *dec, kissFrameCB frameCB,
+      void *opaque)
+{
+   memset(dec, 0, sizeof(*dec));
+   dec->frameCB = frameCB;
+   dec->opaque = opaque;
+}
+
+void kissDecode(struct kissDecoder *dec, const void *src, int len)
+{
+   const unsigned char *s = (const unsigned char *)src;
+   unsigned char c;
+   int ind;
+#ifdef __ARM_NEON
+   int scalarUntil = 0;
+#endif
+
+   for (ind = 0; ind < len; ind++) {
+#ifdef __ARM_NEON
+      // Runs of plain bytes inside a frame go in 16 at a time; a block
+      // holding FEND or FESC is left to the byte loop below
+      while (ind >= scalarUntil && len - ind >= 16 && !dec->escape &&
+            dec->len + 16 <= KISS_MAX_FRAME) {
+         if (kissSpecial16(s + ind)) {
+            scalarUntil = ind + 16;
+            break;
+         }
+         memcpy(dec->frame + dec->len, s + ind, 16);
+         dec->len += 16;
+         ind += 16;
+      }
+      if (ind == len)
+         break;
+#endif
+      c = s[ind];
+
+      if (c == FEND) {
+         if (dec->overrun)
+            dec->framingErrors++;
+         else if (dec->len > 0 && dec->frameCB)
+            dec->frameCB((dec->frame[0] >> 4) & 0x0F, dec->frame + 1,
+                  dec->len - 1, dec->opaque);
+         dec->len = 0;
+         dec->escape = 0;
+         dec->overrun = 0;
+         continue;
+      }
+
+      if (dec->escape) {
+         dec->escape = 0;
+         if (c == TFEND)
+            c = FEND;
+         else if (c == TFESC)
+            c = FESC;
+         else
+            dec->framingErrors++;
+      }
+      else if (c == FESC) {
+         dec->escape = 1;
+         continue;
+      }
+
+      if (dec->len >= KISS_MAX_FRAME) {
+         dec->overrun = 1;
+         continue;
+      }
+      dec->frame[dec->len++] = c;
+   }
+}
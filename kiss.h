@@ -0,0 +1,87 @@
+#ifndef KISS_H
+#define KISS_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FEND 0xC0
+#define FESC 0xDB
+#define TFEND 0xDC
+#define TFESC 0xDD
+
+// Largest KISS frame the decoder will reassemble
+#define KISS_MAX_FRAME 2048
+
+/* Type definition of the callback invoked for each decoded KISS frame.
+ * @param port the KISS port (high nibble of the KISS command byte).
+ * @param frame a pointer to the unescaped frame bytes, command byte stripped.
+ * @param len the number of bytes in the frame.
+ * @param opaque user supplied argument
+ */
+typedef void (*kissFrameCB)(int port, unsigned char *frame, int len,
+      void *opaque);
+
+// Streaming KISS decoder state
+struct kissDecoder {
+   unsigned char frame[KISS_MAX_FRAME];
+   int len;
+   int escape;
+   int overrun;
+   uint32_t framingErrors;
+   kissFrameCB frameCB;
+   void *opaque;
+};
+
+/* Compute the CRC16-CCITT (0xFFFF seed) used by EnduraSat frames.
+ * @param pData a pointer to the bytes to checksum.
+ * @param length the number of bytes.
+ * @return the 16-bit CRC.
+ */
+uint16_t crc16(const void *pData, int length);
+
+/* KISS encode a payload.
+ * @param dst buffer that receives the encoded frame.
+ * @param dstLen size of dst. 2 * len + 3 bytes is always sufficient.
+ * @param port the KISS port number.
+ * @param src a pointer to the payload bytes.
+ * @param len the number of payload bytes.
+ * @return the number of encoded bytes, or -1 if dst is too small.
+ */
+int kissEncode(unsigned char *dst, int dstLen, int port,
+      const void *src, int len);
+
+/* Build an EnduraSat command frame: a length byte, the command bytes and
+ *   the big-endian CRC16, KISS encoded on port 0.
+ * @param dst buffer that receives the encoded frame.
+ * @param dstLen size of dst. 2 * len + 9 bytes is always sufficient.
+ * @param body a pointer to the command bytes.
+ * @param len the number of command bytes.  Only the low byte is sent as
+ *   the length, so commands should stay under 256 bytes.
+ * @return the number of encoded bytes, or -1 if the command does not fit.
+ */
+int kissCommand(unsigned char *dst, int dstLen, const void *body, int len);
+
+/* Initialize a streaming KISS decoder.
+ * @param dec the decoder to initialize.
+ * @param frameCB function called once for every complete frame.
+ * @param opaque pointer passed through to frameCB.
+ */
+void kissDecoderInit(struct kissDecoder *dec, kissFrameCB frameCB,
+      void *opaque);
+
+/* Feed raw bytes from the link into the decoder.  frameCB is called for
+ * every frame completed by these bytes.
+ * @param dec the decoder.
+ * @param src a pointer to the received bytes.
+ * @param len the number of received bytes.
+ */
+void kissDecode(struct kissDecoder *dec, const void *src, int len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
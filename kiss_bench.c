@@ -0,0 +1,264 @@
+/* Standalone check and benchmark of the KISS and CRC16 kernels and the
+ *   preallocated buffer pool.  It needs only kiss.c and bufpool.c, so a
+ *   static cross build runs under qemu-user, e.g.
+ *
+ *     make ARCH=arm bench && qemu-arm ./kiss-bench
+ *
+ *   Every kernel is first checked against a plain byte at a time version
+ *   on random data; a mismatch exits 1 before anything is timed.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "kiss.h"
+#include "bufpool.h"
+
+#define BENCH_BYTES (64 * 1024 * 1024) // Bytes through each timed kernel
+#define BENCH_CMD 200 // Command bytes per kissCommand
+#define CHECK_ROUNDS 2000
+
+struct decodeCheck {
+   unsigned char frame[KISS_MAX_FRAME];
+   int len;
+   int frames;
+};
+
+static double now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static uint16_t refCrc16(const unsigned char *p, int len)
+{
+   uint16_t crc = 0xFFFF;
+   int i;
+
+   while (len--) {
+      crc ^= *p++ << 8;
+      for (i = 0; i < 8; i++)
+         crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+   }
+   return crc;
+}
+
+static int refEncode(unsigned char *dst, int port, const unsigned char *s,
+      int len)
+{
+   int out = 0, i;
+
+   dst[out++] = FEND;
+   dst[out++] = (port & 0x0F) << 4;
+   for (i = 0; i < len; i++) {
+      if (s[i] == FEND || s[i] == FESC) {
+         dst[out++] = FESC;
+         dst[out++] = s[i] == FEND ? TFEND : TFESC;
+      }
+      else
+         dst[out++] = s[i];
+   }
+   dst[out++] = FEND;
+
+   return out;
+}
+
+// Random bytes with FEND and FESC mixed in at about the given percentage
+static void fill(unsigned char *p, int len, int specialPct, unsigned int *seed)
+{
+   int i, r;
+
+   for (i = 0; i < len; i++) {
+      r = rand_r(seed) % 100;
+      if (r < specialPct)
+         p[i] = r & 1 ? FEND : FESC;
+      else
+         p[i] = rand_r(seed);
+   }
+}
+
+static void checkFrame(int port, unsigned char *frame, int len, void *arg)
+{
+   struct decodeCheck *dc = (struct decodeCheck *)arg;
+
+   memcpy(dc->frame, frame, len);
+   dc->len = len;
+   dc->frames++;
+}
+
+static int check(void)
+{
+   unsigned char src[KISS_MAX_FRAME - 1], enc[2 * KISS_MAX_FRAME + 3];
+   unsigned char ref[sizeof(enc)];
+   struct kissDecoder dec;
+   struct decodeCheck dc;
+   unsigned int seed = 1;
+   int round, len, elen, rlen, off, chunk;
+
+   kissDecoderInit(&dec, &checkFrame, &dc);
+   for (round = 0; round < CHECK_ROUNDS; round++) {
+      len = rand_r(&seed) % sizeof(src);
+      fill(src, len, round % 4 == 0 ? 0 : round % 10, &seed);
+
+      if (crc16(src, len) != refCrc16(src, len)) {
+         fprintf(stderr, "crc16 mismatch, %d bytes\n", len);
+         return -1;
+      }
+
+      elen = kissEncode(enc, sizeof(enc), 0, src, len);
+      rlen = refEncode(ref, 0, src, len);
+      if (elen != rlen || memcmp(enc, ref, elen)) {
+         fprintf(stderr, "kissEncode mismatch, %d bytes\n", len);
+         return -1;
+      }
+      // One byte short of the worst case must still fail cleanly
+      if (kissEncode(enc, rlen - 1, 0, src, len) != -1) {
+         fprintf(stderr, "kissEncode overran a short buffer\n");
+         return -1;
+      }
+
+      // Reads split frames at arbitrary points
+      dc.frames = 0;
+      for (off = 0; off < elen; off += chunk) {
+         chunk = 1 + rand_r(&seed) % 64;
+         if (chunk > elen - off)
+            chunk = elen - off;
+         kissDecode(&dec, enc + off, chunk);
+      }
+      if (len && (dc.frames != 1 || dc.len != len ||
+            memcmp(dc.frame, src, len))) {
+         fprintf(stderr, "kissDecode mismatch, %d bytes\n", len);
+         return -1;
+      }
+   }
+   if (dec.framingErrors) {
+      fprintf(stderr, "kissDecode reported %u framing errors\n",
+            dec.framingErrors);
+      return -1;
+   }
+
+   return 0;
+}
+
+static void countFrame(int port, unsigned char *frame, int len, void *arg)
+{
+   (*(int *)arg)++;
+}
+
+static void report(const char *name, double secs, uint64_t bytes)
+{
+   printf("%-16s %8.3f s %9.1f MB/s\n", name, secs, bytes / secs / 1e6);
+}
+
+static void bench(void)
+{
+   unsigned char *data, *stream;
+   unsigned char cmd[2 * BENCH_CMD + 9];
+   struct kissDecoder dec;
+   unsigned int seed = 7;
+   volatile uint16_t sink = 0;
+   int i, n, len, frames = 0;
+   double start;
+
+   data = malloc(BENCH_BYTES);
+   stream = malloc(BENCH_BYTES);
+   if (!data || !stream) {
+      fprintf(stderr, "Insufficient memory\n");
+      free(data);
+      free(stream);
+      return;
+   }
+   // Mostly binary telemetry, the odd byte needing an escape
+   fill(data, BENCH_BYTES, 1, &seed);
+
+   start = now();
+   for (i = 0; i + 4096 <= BENCH_BYTES; i += 4096)
+      sink ^= refCrc16(data + i, 4096);
+   report("crc16 bitwise", now() - start, BENCH_BYTES);
+
+   start = now();
+   for (i = 0; i + 4096 <= BENCH_BYTES; i += 4096)
+      sink ^= crc16(data + i, 4096);
+   report("crc16", now() - start, BENCH_BYTES);
+
+   start = now();
+   for (i = 0; i + BENCH_CMD <= BENCH_BYTES; i += BENCH_CMD)
+      sink ^= kissCommand(cmd, sizeof(cmd), data + i, BENCH_CMD);
+   report("kissCommand", now() - start, BENCH_BYTES);
+
+   // Frames as the link would carry them, decoded in 4 KB reads
+   for (i = len = 0; len + sizeof(cmd) <= BENCH_BYTES; i += BENCH_CMD) {
+      n = kissCommand(stream + len, BENCH_BYTES - len,
+            data + i % (BENCH_BYTES - BENCH_CMD), BENCH_CMD);
+      if (n <= 0)
+         break;
+      len += n;
+   }
+   kissDecoderInit(&dec, &countFrame, &frames);
+   start = now();
+   for (i = 0; i < len; i += n) {
+      n = len - i < 4096 ? len - i : 4096;
+      kissDecode(&dec, stream + i, n);
+   }
+   report("kissDecode", now() - start, len);
+   printf("%d frames decoded\n", frames);
+
+   free(data);
+   free(stream);
+}
+
+// What a SERIAL_OPT_PREALLOC link does per write: node in, node out
+static int benchPool(void)
+{
+   struct bufpoolReserved res;
+   void *nodes[64];
+   uint64_t calls;
+   double start, secs;
+   int round, i;
+
+   if (bufpoolReserve(&res, 1024, 64) < 0) {
+      fprintf(stderr, "bufpoolReserve failed\n");
+      return -1;
+   }
+
+   calls = bufpoolHeapCalls();
+   start = now();
+   for (round = 0; round < 100000; round++) {
+      for (i = 0; i < 64; i++)
+         nodes[i] = bufpoolReservedGet(&res);
+      if (bufpoolReservedGet(&res)) {
+         fprintf(stderr, "Reserve handed out a 65th buffer\n");
+         return -1;
+      }
+      for (i = 0; i < 64; i++)
+         bufpoolReservedPut(&res, nodes[i]);
+   }
+   secs = now() - start;
+   printf("%-16s %8.3f s %9.1f M get/put per s\n", "bufpool", secs,
+         100000 * 64 / secs / 1e6);
+   calls = bufpoolHeapCalls() - calls;
+   printf("%llu heap calls in steady state\n", (unsigned long long)calls);
+   bufpoolUnreserve(&res);
+
+   return calls ? -1 : 0;
+}
+
+int main(int argc, char **argv)
+{
+#ifdef __ARM_NEON
+   printf("kernels: NEON\n");
+#else
+   printf("kernels: scalar\n");
+#endif
+
+   if (check() < 0)
+      return 1;
+   printf("kernels match the reference on %d random frames\n", CHECK_ROUNDS);
+
+   bench();
+
+   return benchPool() < 0 ? 1 : 0;
+}
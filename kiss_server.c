@@ -0,0 +1,411 @@
+#define _GNU_SOURCE // accept4
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include "kiss.h"
+#include "kiss_server.h"
+
+#define KS_ECHO 0
+#define KS_ACK 1
+#define KS_DROP 2
+
+#define KS_MAX_PENDING (1024 * 1024) // Unsent reply bytes per connection
+#define KS_READ_SIZE 4096
+// Largest reply: an echoed frame, every byte escaped
+#define KS_REPLY_MAX (2 * KISS_MAX_FRAME + 3)
+
+struct ksStep {
+   int action;
+   int delayMs;
+   int count;
+};
+
+struct ksDelayed {
+   struct ksConn *conn;
+   struct ksDelayed *next;
+   void *event;
+   int len;
+   unsigned char data[1];
+};
+
+struct ksConn {
+   struct kissServer *srv;
+   struct ksConn *next, *prev;
+   int fd;
+   struct kissDecoder dec;
+   int step, stepLeft; // Position in the script
+   unsigned char *out; // Reply bytes the socket did not take yet
+   int outLen, outCap;
+   int writeReg;
+   struct ksDelayed *delayed;
+};
+
+struct kissServer {
+   struct EventState *evt_loop;
+   int sock;
+   int port;
+   struct ksStep steps[KISS_SERVER_MAX_STEPS];
+   int nsteps;
+   struct ksConn *conns;
+   unsigned int seed;
+   struct kissServerStats st;
+};
+
+// Parse "echo*98,drop,ack@200" into steps; returns the count, -1 on error
+static int parseScript(const char *script, struct ksStep *steps, int max)
+{
+   const char *p = script;
+   char *end;
+   int n = 0, len;
+
+   while (*p) {
+      if (n == max)
+         return -1;
+      len = strcspn(p, "@*,");
+      if (len == 4 && !strncmp(p, "echo", 4))
+         steps[n].action = KS_ECHO;
+      else if (len == 3 && !strncmp(p, "ack", 3))
+         steps[n].action = KS_ACK;
+      else if (len == 4 && !strncmp(p, "drop", 4))
+         steps[n].action = KS_DROP;
+      else
+         return -1;
+      p += len;
+
+      steps[n].delayMs = 0;
+      steps[n].count = 1;
+      while (*p == '@' || *p == '*') {
+         if (*p++ == '@')
+            steps[n].delayMs = strtol(p, &end, 0);
+         else
+            steps[n].count = strtol(p, &end, 0);
+         if (end == p || steps[n].delayMs < 0 || steps[n].count < 1)
+            return -1;
+         p = end;
+      }
+      if (*p == ',')
+         p++;
+      else if (*p)
+         return -1;
+      n++;
+   }
+
+   return n;
+}
+
+// inRead: called from the read handler, which removes itself
+static void connClose(struct ksConn *c, int inRead)
+{
+   struct kissServer *srv = c->srv;
+   struct ksDelayed *d;
+
+   while ((d = c->delayed)) {
+      c->delayed = d->next;
+      EVT_sched_remove(srv->evt_loop, d->event);
+      free(d);
+   }
+
+   if (c->writeReg)
+      EVT_fd_remove(srv->evt_loop, c->fd, EVENT_FD_WRITE);
+   if (!inRead)
+      EVT_fd_remove(srv->evt_loop, c->fd, EVENT_FD_READ);
+   close(c->fd);
+
+   if (c->prev)
+      c->prev->next = c->next;
+   else
+      srv->conns = c->next;
+   if (c->next)
+      c->next->prev = c->prev;
+   srv->st.connections--;
+
+   free(c->out);
+   free(c);
+}
+
+static int connWriteEvent(int fd, char type, void *arg)
+{
+   struct ksConn *c = (struct ksConn *)arg;
+   int res;
+
+   res = write(c->fd, c->out, c->outLen);
+   if (res < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      return EVENT_KEEP;
+   if (res < 0) {
+      // The read side sees the failure and closes the connection
+      c->outLen = 0;
+      c->writeReg = 0;
+      return EVENT_REMOVE;
+   }
+
+   memmove(c->out, c->out + res, c->outLen - res);
+   c->outLen -= res;
+   if (c->outLen)
+      return EVENT_KEEP;
+
+   c->writeReg = 0;
+   return EVENT_REMOVE;
+}
+
+// Write now if the socket takes it, otherwise queue behind earlier replies
+static void connSend(struct ksConn *c, const unsigned char *data, int len)
+{
+   unsigned char *tmp;
+   int res = 0, cap;
+
+   if (!c->outLen) {
+      res = write(c->fd, data, len);
+      if (res == len)
+         return;
+      if (res < 0)
+         res = 0;
+   }
+   data += res;
+   len -= res;
+
+   if (c->outLen + len > KS_MAX_PENDING) {
+      c->srv->st.overflows++;
+      return;
+   }
+   if (c->outLen + len > c->outCap) {
+      cap = c->outCap ? c->outCap : KS_READ_SIZE;
+      while (cap < c->outLen + len)
+         cap *= 2;
+      tmp = realloc(c->out, cap);
+      if (!tmp) {
+         c->srv->st.overflows++;
+         return;
+      }
+      c->out = tmp;
+      c->outCap = cap;
+   }
+   memcpy(c->out + c->outLen, data, len);
+   c->outLen += len;
+
+   if (!c->writeReg) {
+      EVT_fd_add(c->srv->evt_loop, c->fd, EVENT_FD_WRITE, &connWriteEvent, c);
+      c->writeReg = 1;
+   }
+}
+
+static int delayedEvent(void *arg)
+{
+   struct ksDelayed *d = (struct ksDelayed *)arg;
+   struct ksDelayed **pp;
+
+   for (pp = &d->conn->delayed; *pp != d; pp = &(*pp)->next)
+      ;
+   *pp = d->next;
+   connSend(d->conn, d->data, d->len);
+   free(d);
+
+   return EVENT_REMOVE;
+}
+
+static void frameEvent(int port, unsigned char *frame, int len, void *arg)
+{
+   struct ksConn *c = (struct ksConn *)arg;
+   struct kissServer *srv = c->srv;
+   unsigned char reply[KS_REPLY_MAX], body[KISS_SERVER_ACK_BYTES + 1];
+   const struct ksStep *step;
+   struct ksDelayed *d;
+   uint16_t crc;
+   int n;
+
+   // <len> <command> <crc16 hi> <crc16 lo>
+   crc = len >= 3 ? crc16(frame, len - 2) : 0;
+   if (len < 3 || frame[len - 2] != (crc >> 8) || frame[len - 1] !=
+         (crc & 0xFF)) {
+      srv->st.badFrames++;
+      return;
+   }
+   srv->st.frames++;
+
+   step = &srv->steps[c->step];
+   if (--c->stepLeft == 0) {
+      c->step = (c->step + 1) % srv->nsteps;
+      c->stepLeft = srv->steps[c->step].count;
+   }
+
+   if (step->action == KS_DROP) {
+      srv->st.dropped++;
+      return;
+   }
+   if (step->action == KS_ECHO) {
+      n = kissEncode(reply, sizeof(reply), port, frame, len);
+      srv->st.echoed++;
+   }
+   else {
+      body[0] = KISS_SERVER_ACK;
+      n = len - 3 < KISS_SERVER_ACK_BYTES ? len - 3 : KISS_SERVER_ACK_BYTES;
+      memcpy(body + 1, frame + 1, n);
+      n = kissCommand(reply, sizeof(reply), body, n + 1);
+      srv->st.acked++;
+   }
+   if (n <= 0)
+      return;
+
+   if (!step->delayMs) {
+      connSend(c, reply, n);
+      return;
+   }
+
+   d = malloc(sizeof(*d) + n);
+   if (!d)
+      return;
+   d->conn = c;
+   d->len = n;
+   memcpy(d->data, reply, n);
+   d->next = c->delayed;
+   c->delayed = d;
+   d->event = EVT_sched_add(srv->evt_loop, EVT_ms2tv(step->delayMs),
+         &delayedEvent, d);
+   srv->st.delayed++;
+}
+
+static int connReadEvent(int fd, char type, void *arg)
+{
+   struct ksConn *c = (struct ksConn *)arg;
+   unsigned char buf[KS_READ_SIZE];
+   int res;
+
+   res = read(c->fd, buf, sizeof(buf));
+   if (res < 0 && (errno == EAGAIN || errno == EINTR))
+      return EVENT_KEEP;
+   if (res <= 0) {
+      connClose(c, 1);
+      return EVENT_REMOVE;
+   }
+   kissDecode(&c->dec, buf, res);
+
+   return EVENT_KEEP;
+}
+
+static int acceptEvent(int fd, char type, void *arg)
+{
+   struct kissServer *srv = (struct kissServer *)arg;
+   struct ksConn *c;
+   int sock, flag = 1;
+
+   sock = accept4(srv->sock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+   if (sock < 0)
+      return EVENT_KEEP;
+
+   c = (struct ksConn *)calloc(1, sizeof(*c));
+   if (!c) {
+      close(sock);
+      return EVENT_KEEP;
+   }
+   setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+   c->srv = srv;
+   c->fd = sock;
+   c->stepLeft = srv->steps[0].count;
+   kissDecoderInit(&c->dec, &frameEvent, c);
+
+   c->next = srv->conns;
+   if (srv->conns)
+      srv->conns->prev = c;
+   srv->conns = c;
+   srv->st.connections++;
+   srv->st.accepted++;
+
+   EVT_fd_add(srv->evt_loop, sock, EVENT_FD_READ, &connReadEvent, c);
+
+   return EVENT_KEEP;
+}
+
+struct kissServer *kissServerStart(struct EventState *evt_loop, int port,
+      const char *script)
+{
+   struct kissServer *srv;
+   struct sockaddr_in addr;
+   socklen_t len = sizeof(addr);
+   int flag = 1;
+
+   srv = (struct kissServer *)calloc(1, sizeof(*srv));
+   if (!srv) {
+      DBG_print(DBG_LEVEL_WARN, "Insufficient memory\n");
+      return NULL;
+   }
+   srv->evt_loop = evt_loop;
+   srv->seed = 1;
+
+   srv->nsteps = parseScript(script ? script : "echo", srv->steps,
+         KISS_SERVER_MAX_STEPS);
+   if (srv->nsteps <= 0) {
+      DBG_print(DBG_LEVEL_WARN, "Invalid KISS server script %s\n", script);
+      free(srv);
+      return NULL;
+   }
+
+   memset(&addr, 0, sizeof(addr));
+   addr.sin_family = AF_INET;
+   addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+   addr.sin_port = htons(port);
+
+   srv->sock = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+   if (srv->sock >= 0)
+      setsockopt(srv->sock, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+   if (srv->sock < 0 ||
+         bind(srv->sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+         listen(srv->sock, SOMAXCONN) < 0 ||
+         getsockname(srv->sock, (struct sockaddr *)&addr, &len) < 0) {
+      DBG_print(DBG_LEVEL_WARN, "Unable to listen on port %d: %s\n", port,
+            strerror(errno));
+      if (srv->sock >= 0)
+         close(srv->sock);
+      free(srv);
+      return NULL;
+   }
+   srv->port = ntohs(addr.sin_port);
+
+   EVT_fd_add(evt_loop, srv->sock, EVENT_FD_READ, &acceptEvent, srv);
+
+   return srv;
+}
+
+int kissServerPort(const struct kissServer *srv)
+{
+   return srv->port;
+}
+
+int kissServerKill(struct kissServer *srv)
+{
+   struct ksConn *c;
+   int i;
+
+   if (!srv->st.connections)
+      return -1;
+
+   i = rand_r(&srv->seed) % srv->st.connections;
+   for (c = srv->conns; i > 0; c = c->next, i--)
+      ;
+   connClose(c, 0);
+   srv->st.kills++;
+
+   return 0;
+}
+
+void kissServerStats(const struct kissServer *srv,
+      struct kissServerStats *stats)
+{
+   *stats = srv->st;
+}
+
+void kissServerStop(struct kissServer *srv)
+{
+   if (!srv)
+      return;
+
+   while (srv->conns)
+      connClose(srv->conns, 0);
+
+   EVT_fd_remove(srv->evt_loop, srv->sock, EVENT_FD_READ);
+   close(srv->sock);
+   free(srv);
+}
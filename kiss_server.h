@@ -0,0 +1,72 @@
+#ifndef KISS_SERVER_H
+#define KISS_SERVER_H
+
+#include <stdint.h>
+#include <polysat/polysat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A local KISS over TCP server standing in for a TNC, for exercising
+ *   tcp:// links without radios.  Every EnduraSat frame received on a
+ *   connection is handled by the next step of a script, which repeats:
+ *
+ *     echo   send the frame back unchanged
+ *     ack    reply with KISS_SERVER_ACK and the first command bytes
+ *     drop   say nothing
+ *
+ *   Steps are comma separated.  "@ms" delays the reply and "*n" repeats
+ *   the step, so "echo*98,drop,ack@200" echoes 98 frames, drops one and
+ *   acknowledges the next after 200 ms.  Each connection runs its own copy
+ *   of the script.
+ */
+#define KISS_SERVER_ACK 0x06
+#define KISS_SERVER_ACK_BYTES 16 // Command bytes quoted back in an ack
+#define KISS_SERVER_MAX_STEPS 64
+
+struct kissServer;
+
+// Server side counters
+struct kissServerStats {
+   uint32_t connections; // Connections currently open
+   uint64_t accepted;
+   uint64_t frames;      // Frames received with a valid CRC
+   uint64_t badFrames;   // Frames received with a bad CRC, not answered
+   uint64_t echoed;
+   uint64_t acked;
+   uint64_t dropped;     // Dropped by the script
+   uint64_t delayed;     // Replies that waited on an @ms step
+   uint64_t overflows;   // Replies lost because the client stopped reading
+   uint64_t kills;       // Connections closed by kissServerKill
+};
+
+/* Listen for KISS clients on a loopback TCP port.
+ * @param evt_loop the event loop to run on.
+ * @param port the port, or 0 to pick a free one (see kissServerPort).
+ * @param script the reply script, or NULL for "echo".
+ * @return the server, or NULL on error. Check /var/log/syslog on error.
+ */
+struct kissServer *kissServerStart(struct EventState *evt_loop, int port,
+      const char *script);
+
+/* The port the server listens on. */
+int kissServerPort(const struct kissServer *srv);
+
+/* Close one connection, chosen at random, as a TNC dropping its link does.
+ * @return 0 if a connection was closed, -1 if none are open.
+ */
+int kissServerKill(struct kissServer *srv);
+
+/* Snapshot the server side counters. */
+void kissServerStats(const struct kissServer *srv,
+      struct kissServerStats *stats);
+
+/* Close every connection and the listening socket and free the server. */
+void kissServerStop(struct kissServer *srv);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
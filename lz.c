@@ -0,0 +1,141 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include "lz.h"
+
+#define LZ_HASH_BITS 12
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+#define LZ_MAX_CHAIN 32 // Candidates tried per position; bounds the cost
+
+static unsigned hash3(const unsigned char *p)
+{
+   uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+
+   return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+int lzCompress(const void *src, int len, void *dst, int cap)
+{
+   const unsigned char *in = (const unsigned char *)src;
+   unsigned char *out = (unsigned char *)dst;
+   int *head, *prev;
+   int pos = 0, outLen = 0, flagPos = 0, items = 0;
+   int best, bestDist, cand, depth, n, i, end;
+   unsigned h;
+
+   head = (int *)malloc(LZ_HASH_SIZE * sizeof(*head));
+   prev = (int *)malloc(LZ_WINDOW * sizeof(*prev));
+   if (!head || !prev) {
+      free(head);
+      free(prev);
+      return -1;
+   }
+   for (i = 0; i < LZ_HASH_SIZE; i++)
+      head[i] = -1;
+
+   while (pos < len) {
+      // A new flag byte leads every group of eight items
+      if (items % 8 == 0) {
+         if (outLen >= cap)
+            goto full;
+         flagPos = outLen++;
+         out[flagPos] = 0;
+      }
+
+      best = 0;
+      bestDist = 0;
+      if (pos + LZ_MIN_MATCH <= len) {
+         end = len - pos < LZ_MAX_MATCH ? len - pos : LZ_MAX_MATCH;
+         cand = head[hash3(in + pos)];
+         for (depth = 0; cand >= 0 && pos - cand <= LZ_WINDOW &&
+               depth < LZ_MAX_CHAIN; depth++) {
+            for (n = 0; n < end && in[cand + n] == in[pos + n]; n++)
+               ;
+            if (n > best) {
+               best = n;
+               bestDist = pos - cand;
+               if (n == end)
+                  break;
+            }
+            cand = prev[cand & (LZ_WINDOW - 1)];
+         }
+      }
+
+      if (best >= LZ_MIN_MATCH) {
+         if (outLen + (best >= 18 ? 3 : 2) > cap)
+            goto full;
+         out[flagPos] |= 1 << (items % 8);
+         out[outLen++] = (bestDist - 1) >> 4;
+         out[outLen] = ((bestDist - 1) & 0xF) << 4;
+         if (best >= 18) {
+            out[outLen++] |= 0xF;
+            out[outLen++] = best - 18;
+         }
+         else
+            out[outLen++] |= best - LZ_MIN_MATCH;
+      }
+      else {
+         best = 1;
+         if (outLen >= cap)
+            goto full;
+         out[outLen++] = in[pos];
+      }
+      items++;
+
+      // Every position covered goes into the chains for later matches
+      for (end = pos + best; pos < end; pos++) {
+         if (pos + LZ_MIN_MATCH > len)
+            continue;
+         h = hash3(in + pos);
+         prev[pos & (LZ_WINDOW - 1)] = head[h];
+         head[h] = pos;
+      }
+   }
+
+   free(head);
+   free(prev);
+   return outLen;
+
+full:
+   free(head);
+   free(prev);
+   return -1;
+}
+
+int lzDecompress(const void *src, int len, void *dst, int cap)
+{
+   const unsigned char *in = (const unsigned char *)src;
+   unsigned char *out = (unsigned char *)dst;
+   int pos = 0, outLen = 0, bit, dist, n;
+   unsigned char flags;
+
+   while (pos < len) {
+      flags = in[pos++];
+      for (bit = 0; bit < 8 && pos < len; bit++) {
+         if (!(flags & (1 << bit))) {
+            if (outLen >= cap)
+               return -1;
+            out[outLen++] = in[pos++];
+            continue;
+         }
+
+         if (pos + 2 > len)
+            return -1;
+         dist = ((in[pos] << 4) | (in[pos + 1] >> 4)) + 1;
+         n = (in[pos + 1] & 0xF) + LZ_MIN_MATCH;
+         pos += 2;
+         if (n == 18) {
+            if (pos >= len)
+               return -1;
+            n += in[pos++];
+         }
+         if (dist > outLen || outLen + n > cap)
+            return -1;
+
+         // Byte by byte, since a match may overlap its own output
+         for (; n > 0; n--, outLen++)
+            out[outLen] = out[outLen - dist];
+      }
+   }
+
+   return outLen;
+}
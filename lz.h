@@ -0,0 +1,48 @@
+#ifndef LZ_H
+#define LZ_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A small LZ77 codec for uplink payloads, sized for the flight side: the
+ *   decoder needs no memory beyond its output, or a LZ_WINDOW byte history
+ *   when decoding a stream.
+ *
+ *   The stream is groups of up to eight items, each group led by a flag
+ *   byte whose bits, LSB first, mark matches.  A literal is one byte.  A
+ *   match is two bytes, the 12-bit distance minus one and the 4-bit length
+ *   minus three.  Length nibble 15 is followed by one more byte, which
+ *   is added to 18.
+ */
+#define LZ_WINDOW 4096
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (18 + 255)
+
+// Largest possible compressed size for len input bytes
+#define LZ_BOUND(len) ((len) + ((len) + 7) / 8 + 1)
+
+/* Compress a buffer.
+ * @param src the bytes to compress.
+ * @param len the number of bytes.
+ * @param dst buffer that receives the compressed stream.
+ * @param cap size of dst; LZ_BOUND(len) always suffices.
+ * @return the compressed size, or -1 if dst is too small or out of memory.
+ */
+int lzCompress(const void *src, int len, void *dst, int cap);
+
+/* Decompress a stream produced by lzCompress.
+ * @param src the compressed stream.
+ * @param len the stream length.
+ * @param dst buffer that receives the original bytes.
+ * @param cap size of dst.
+ * @return the decompressed size, or -1 if the stream is corrupt or does
+ *   not fit in cap.
+ */
+int lzDecompress(const void *src, int len, void *dst, int cap);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,768 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include "netsim.h"
+
+#define NETSIM_FIRST_FD 1000 // Far from real descriptors, and never 0
+#define NETSIM_DEFAULT_SNDBUF (64*1024)
+#define NETSIM_MAX_SPIN 100000 // Dispatches at one instant before giving up
+
+struct simTimer {
+   uint64_t at;
+   uint64_t interval;
+   netSchedCB cb;
+   void *arg;
+   int removed; // Removed from inside its own callback
+   struct simTimer *next;
+};
+
+struct simListener {
+   int port;
+   struct netSimPeer cfg;
+   int refused;  // Connects refused so far
+   int accepted; // Connections accepted so far
+   struct simListener *next;
+};
+
+enum simState {
+   SIM_IDLE = 0,    // Created, not connected
+   SIM_CONNECTING,  // Connect completes at readyAt
+   SIM_FAILED,      // Connect refused; writable with SO_ERROR set
+   SIM_CONNECTED,
+   SIM_RESET,       // Peer sent a reset; reads and writes fail
+};
+
+struct simSock {
+   int fd;
+   enum simState state;
+   int err;          // Pending SO_ERROR
+   int flags;        // F_SETFL flags
+   uint64_t readyAt; // Connect completion time
+   struct simListener *peer;
+   int faulty;       // resetAfter and closeMs apply to this connection
+   uint64_t closeAt; // Peer closes at this time, 0 never
+   int peerClosed;   // Reads return 0 once rx is empty
+   unsigned char *tx; // Written but not yet read by the peer
+   uint32_t txLen;
+   uint32_t txCap;
+   uint64_t lastDrain; // Time the peer last read from tx
+   uint64_t peerRead;  // Bytes the peer has read
+   unsigned char *rx;  // Sent by the peer, not yet read by us
+   uint32_t rxLen;
+   netFdCB readCB, writeCB;
+   void *readArg, *writeArg;
+   struct simSock *next;
+};
+
+struct netSim {
+   struct netOps ops;
+   uint64_t now; // Virtual microseconds since creation
+   struct timeval base;
+   uint64_t limit;
+   int exit;
+   int nextFd;
+   struct simTimer *timers; // Sorted by at, FIFO among equal times
+   struct simTimer *running;
+   struct simListener *listeners;
+   struct simSock *socks; // Sorted by fd
+   FILE *log;
+};
+
+static void simLog(struct netSim *sim, const char *fmt, ...)
+{
+   va_list ap;
+
+   if (!sim->log)
+      return;
+
+   fprintf(sim->log, "[%4llu.%06llu] ",
+         (unsigned long long)sim->now / 1000000,
+         (unsigned long long)sim->now % 1000000);
+   va_start(ap, fmt);
+   vfprintf(sim->log, fmt, ap);
+   va_end(ap);
+   fputc('\n', sim->log);
+}
+
+static struct simSock *findSock(struct netSim *sim, int fd)
+{
+   struct simSock *s;
+
+   for (s = sim->socks; s && s->fd <= fd; s = s->next)
+      if (s->fd == fd)
+         return s;
+
+   return NULL;
+}
+
+static void insertTimer(struct netSim *sim, struct simTimer *t)
+{
+   struct simTimer **pos = &sim->timers;
+
+   while (*pos && (*pos)->at <= t->at)
+      pos = &(*pos)->next;
+   t->next = *pos;
+   *pos = t;
+}
+
+// Bring a socket's peer up to the current virtual time
+static void simAdvance(struct netSim *sim, struct simSock *s)
+{
+   struct netSimPeer *cfg;
+   unsigned char *rx;
+   uint64_t n;
+
+   if (s->state == SIM_CONNECTING && sim->now >= s->readyAt) {
+      s->state = s->err ? SIM_FAILED : SIM_CONNECTED;
+      s->lastDrain = sim->now;
+   }
+   if (s->state != SIM_CONNECTED)
+      return;
+   cfg = &s->peer->cfg;
+
+   // The peer reads at its rate; time is only consumed by whole bytes
+   if (!s->txLen)
+      s->lastDrain = sim->now;
+   else {
+      n = s->txLen;
+      if (cfg->rate) {
+         n = (sim->now - s->lastDrain) * cfg->rate / 1000000;
+         if (n > s->txLen)
+            n = s->txLen;
+         s->lastDrain += n * 1000000 / cfg->rate;
+      }
+      if (n && s->faulty && cfg->resetAfter &&
+            s->peerRead + n >= cfg->resetAfter)
+         n = cfg->resetAfter - s->peerRead;
+
+      if (n && cfg->echo) {
+         rx = realloc(s->rx, s->rxLen + n);
+         if (rx) {
+            memcpy(rx + s->rxLen, s->tx, n);
+            s->rx = rx;
+            s->rxLen += n;
+         }
+      }
+      memmove(s->tx, s->tx + n, s->txLen - n);
+      s->txLen -= n;
+      s->peerRead += n;
+   }
+
+   if (s->faulty && cfg->resetAfter && s->peerRead >= cfg->resetAfter) {
+      simLog(sim, "fd %d: peer reset after reading %llu bytes", s->fd,
+            (unsigned long long)s->peerRead);
+      s->state = SIM_RESET;
+      s->err = ECONNRESET;
+      s->txLen = s->rxLen = 0;
+      return;
+   }
+
+   if (s->closeAt && sim->now >= s->closeAt && !s->peerClosed) {
+      simLog(sim, "fd %d: peer closed", s->fd);
+      s->peerClosed = 1;
+   }
+}
+
+// Earliest future time at which this socket changes on its own
+static uint64_t simNextChange(struct netSim *sim, const struct simSock *s)
+{
+   const struct netSimPeer *cfg;
+   uint64_t next = UINT64_MAX, chunk;
+
+   if (s->state == SIM_CONNECTING)
+      return s->readyAt;
+   if (s->state != SIM_CONNECTED)
+      return next;
+   cfg = &s->peer->cfg;
+
+   if (s->txLen && cfg->rate) {
+      // A quarter of the buffer at a time keeps the step count bounded
+      chunk = s->txCap / 4;
+      if (chunk > s->txLen)
+         chunk = s->txLen;
+      if (!chunk)
+         chunk = 1;
+      next = s->lastDrain + (chunk * 1000000 + cfg->rate - 1) / cfg->rate;
+   }
+   else if (s->txLen)
+      next = sim->now;
+
+   if (s->closeAt && !s->peerClosed && s->closeAt < next)
+      next = s->closeAt;
+
+   return next;
+}
+
+static int readReady(const struct simSock *s)
+{
+   return s->state == SIM_RESET || s->state == SIM_FAILED ||
+      (s->state == SIM_CONNECTED && (s->rxLen || s->peerClosed));
+}
+
+static int writeReady(struct netSim *sim, const struct simSock *s)
+{
+   if (s->state == SIM_CONNECTING)
+      return sim->now >= s->readyAt;
+
+   return s->state == SIM_RESET || s->state == SIM_FAILED ||
+      s->peerClosed || (s->state == SIM_CONNECTED && s->txLen < s->txCap);
+}
+
+static int simSocket(void *ctx, int domain, int type, int protocol)
+{
+   struct netSim *sim = (struct netSim *)ctx;
+   struct simSock *s, **pos;
+
+   s = (struct simSock *)calloc(1, sizeof(*s));
+   if (!s) {
+      errno = ENOMEM;
+      return -1;
+   }
+   s->fd = sim->nextFd++;
+
+   for (pos = &sim->socks; *pos; pos = &(*pos)->next)
+      ;
+   *pos = s;
+
+   return s->fd;
+}
+
+static int simConnect(void *ctx, int fd, const struct sockaddr *addr,
+      socklen_t len)
+{
+   struct netSim *sim = (struct netSim *)ctx;
+   struct simSock *s = findSock(sim, fd);
+   struct simListener *l;
+   int port = 0;
+
+   if (!s) {
+      errno = EBADF;
+      return -1;
+   }
+   if (addr->sa_family == AF_INET)
+      port = ntohs(((const struct sockaddr_in *)addr)->sin_port);
+
+   for (l = sim->listeners; l; l = l->next)
+      if (l->port == port || l->port == 0)
+         break;
+   if (!l) {
+      simLog(sim, "fd %d: nothing listening on port %d", fd, port);
+      errno = ECONNREFUSED;
+      return -1;
+   }
+
+   s->peer = l;
+   s->state = SIM_CONNECTING;
+   s->readyAt = sim->now + (uint64_t)l->cfg.connectMs * 1000;
+   if (l->refused < l->cfg.refuse) {
+      l->refused++;
+      s->err = ECONNREFUSED;
+      simLog(sim, "fd %d: refusing connect %d of %d", fd, l->refused,
+            l->cfg.refuse);
+   }
+   else {
+      l->accepted++;
+      s->faulty = l->cfg.faults < 0 || l->accepted <= l->cfg.faults;
+      s->txCap = l->cfg.sndbuf ? l->cfg.sndbuf : NETSIM_DEFAULT_SNDBUF;
+      s->tx = malloc(s->txCap);
+      if (!s->tx) {
+         errno = ENOMEM;
+         return -1;
+      }
+      if (s->faulty && l->cfg.closeMs)
+         s->closeAt = s->readyAt + (uint64_t)l->cfg.closeMs * 1000;
+      simLog(sim, "fd %d: accepting connection %d", fd, l->accepted);
+   }
+
+   errno = EINPROGRESS;
+   return -1;
+}
+
+static ssize_t simRead(void *ctx, int fd, void *buf, size_t len)
+{
+   struct netSim *sim = (struct netSim *)ctx;
+   struct simSock *s = findSock(sim, fd);
+
+   if (!s) {
+      errno = EBADF;
+      return -1;
+   }
+   simAdvance(sim, s);
+
+   if (s->state == SIM_RESET) {
+      errno = ECONNRESET;
+      return -1;
+   }
+   if (s->state != SIM_CONNECTED) {
+      errno = ENOTCONN;
+      return -1;
+   }
+   if (!s->rxLen) {
+      if (s->peerClosed)
+         return 0;
+      errno = EAGAIN;
+      return -1;
+   }
+
+   if (len > s->rxLen)
+      len = s->rxLen;
+   memcpy(buf, s->rx, len);
+   memmove(s->rx, s->rx + len, s->rxLen - len);
+   s->rxLen -= len;
+
+   return len;
+}
+
+static ssize_t simWrite(void *ctx, int fd, const void *buf, size_t len)
+{
+   struct netSim *sim = (struct netSim *)ctx;
+   struct simSock *s = findSock(sim, fd);
+
+   if (!s) {
+      errno = EBADF;
+      return -1;
+   }
+   simAdvance(sim, s);
+
+   if (s->state == SIM_RESET) {
+      errno = ECONNRESET;
+      return -1;
+   }
+   if (s->state == SIM_CONNECTING) {
+      errno = EAGAIN;
+      return -1;
+   }
+   if (s->state != SIM_CONNECTED) {
+      errno = ENOTCONN;
+      return -1;
+   }
+   if (s->peerClosed) {
+      errno = EPIPE;
+      return -1;
+   }
+   if (s->txLen == s->txCap) {
+      errno = EAGAIN;
+      return -1;
+   }
+
+   if (len > s->txCap - s->txLen)
+      len = s->txCap - s->txLen;
+   memcpy(s->tx + s->txLen, buf, len);
+   s->txLen += len;
+
+   return len;
+}
+
+static int simClose(void *ctx, int fd)
+{
+   struct netSim *sim = (struct netSim *)ctx;
+   struct simSock **pos, *s;
+
+   for (pos = &sim->socks; *pos && (*pos)->fd != fd; pos = &(*pos)->next)
+      ;
+   s = *pos;
+   if (!s) {
+      errno = EBADF;
+      return -1;
+   }
+
+   if (s->state == SIM_CONNECTED)
+      simLog(sim, "fd %d: closed with %u bytes unread by the peer", fd,
+            s->txLen);
+   *pos = s->next;
+   free(s->tx);
+   free(s->rx);
+   free(s);
+
+   return 0;
+}
+
+static int simGetsockopt(void *ctx, int fd, int level, int name, void *val,
+      socklen_t *len)
+{
+   struct netSim *sim = (struct netSim *)ctx;
+   struct simSock *s = findSock(sim, fd);
+
+   if (!s) {
+      errno = EBADF;
+      return -1;
+   }
+   if (level == SOL_SOCKET && name == SO_ERROR && *len >= sizeof(int)) {
+      simAdvance(sim, s);
+      *(int *)val = s->err;
+      s->err = 0;
+      *len = sizeof(int);
+      return 0;
+   }
+
+   memset(val, 0, *len);
+   return 0;
+}
+
+// Options change nothing the simulation models
+static int simSetsockopt(void *ctx, int fd, int level, int name,
+      const void *val, socklen_t len)
+{
+   if (!findSock((struct netSim *)ctx, fd)) {
+      errno = EBADF;
+      return -1;
+   }
+
+   return 0;
+}
+
+static int simFcntl(void *ctx, int fd, int cmd, int arg)
+{
+   struct simSock *s = findSock((struct netSim *)ctx, fd);
+
+   if (!s) {
+      errno = EBADF;
+      return -1;
+   }
+   if (cmd == F_GETFL)
+      return s->flags;
+   if (cmd == F_SETFL)
+      s->flags = arg;
+
+   return 0;
+}
+
+static void simNow(void *ctx, struct timeval *tv)
+{
+   struct netSim *sim = (struct netSim *)ctx;
+   struct timeval elapsed;
+
+   elapsed.tv_sec = sim->now / 1000000;
+   elapsed.tv_usec = sim->now % 1000000;
+   timeradd(&sim->base, &elapsed, tv);
+}
+
+static void *simSchedAdd(void *ctx, struct EventState *evt,
+      struct timeval when, netSchedCB cb, void *arg)
+{
+   struct netSim *sim = (struct netSim *)ctx;
+   struct simTimer *t;
+
+   t = (struct simTimer *)calloc(1, sizeof(*t));
+   if (!t)
+      return NULL;
+   t->interval = (uint64_t)when.tv_sec * 1000000 + when.tv_usec;
+   t->at = sim->now + t->interval;
+   t->cb = cb;
+   t->arg = arg;
+   insertTimer(sim, t);
+
+   return t;
+}
+
+static void simSchedRemove(void *ctx, struct EventState *evt, void *event)
+{
+   struct netSim *sim = (struct netSim *)ctx;
+   struct simTimer **pos;
+
+   if (!event)
+      return;
+   if (event == sim->running) {
+      sim->running->removed = 1;
+      return;
+   }
+
+   for (pos = &sim->timers; *pos; pos = &(*pos)->next)
+      if (*pos == event) {
+         *pos = (*pos)->next;
+         free(event);
+         return;
+      }
+}
+
+static void simFdAdd(void *ctx, struct EventState *evt, int fd, int type,
+      netFdCB cb, void *arg)
+{
+   struct simSock *s = findSock((struct netSim *)ctx, fd);
+
+   if (!s)
+      return;
+   if (type == EVENT_FD_READ) {
+      s->readCB = cb;
+      s->readArg = arg;
+   }
+   else if (type == EVENT_FD_WRITE) {
+      s->writeCB = cb;
+      s->writeArg = arg;
+   }
+}
+
+static void simFdRemove(void *ctx, struct EventState *evt, int fd, int type)
+{
+   struct simSock *s = findSock((struct netSim *)ctx, fd);
+
+   if (!s)
+      return;
+   if (type == EVENT_FD_READ)
+      s->readCB = NULL;
+   else if (type == EVENT_FD_WRITE)
+      s->writeCB = NULL;
+}
+
+static void simExitLoop(void *ctx, struct EventState *evt)
+{
+   ((struct netSim *)ctx)->exit = 1;
+}
+
+// Call one registered handler, dropping it if it asks to be removed
+static void simDispatch(struct netSim *sim, int fd, int type)
+{
+   struct simSock *s = findSock(sim, fd);
+   netFdCB cb;
+   void *arg;
+
+   if (!s)
+      return;
+   cb = type == EVENT_FD_READ ? s->readCB : s->writeCB;
+   arg = type == EVENT_FD_READ ? s->readArg : s->writeArg;
+   if (cb(fd, type, arg) != EVENT_REMOVE)
+      return;
+
+   // The handler may have closed the fd or registered a new handler
+   s = findSock(sim, fd);
+   if (!s)
+      return;
+   if (type == EVENT_FD_READ && s->readCB == cb && s->readArg == arg)
+      s->readCB = NULL;
+   else if (type == EVENT_FD_WRITE && s->writeCB == cb && s->writeArg == arg)
+      s->writeCB = NULL;
+}
+
+// Run every ready fd handler once; returns how many ran
+static int simPollFds(struct netSim *sim)
+{
+   struct simSock *s;
+   int fd = 0, ran = 0;
+
+   // Handlers can close sockets, so walk by fd rather than by pointer
+   for (;;) {
+      for (s = sim->socks; s && s->fd < fd; s = s->next)
+         ;
+      if (!s || sim->exit)
+         break;
+      fd = s->fd + 1;
+
+      simAdvance(sim, s);
+      if (s->readCB && readReady(s)) {
+         simDispatch(sim, s->fd, EVENT_FD_READ);
+         ran++;
+         s = findSock(sim, fd - 1);
+         if (!s || sim->exit)
+            continue;
+      }
+      if (s->writeCB && writeReady(sim, s)) {
+         simDispatch(sim, s->fd, EVENT_FD_WRITE);
+         ran++;
+      }
+   }
+
+   return ran;
+}
+
+// Fire every timer due now; returns how many fired
+static int simFireTimers(struct netSim *sim)
+{
+   struct simTimer *t;
+   int fired = 0;
+
+   while (!sim->exit && (t = sim->timers) && t->at <= sim->now) {
+      sim->timers = t->next;
+      sim->running = t;
+      fired++;
+      if (t->cb(t->arg) == EVENT_KEEP && !t->removed) {
+         t->at = sim->now + t->interval;
+         insertTimer(sim, t);
+      }
+      else
+         free(t);
+      sim->running = NULL;
+   }
+
+   return fired;
+}
+
+static int simRun(void *ctx, struct EventState *evt)
+{
+   struct netSim *sim = (struct netSim *)ctx;
+   struct simSock *s;
+   uint64_t next, change;
+   int spin = 0;
+
+   sim->exit = 0;
+   while (!sim->exit) {
+      if (simFireTimers(sim) + simPollFds(sim)) {
+         if (++spin < NETSIM_MAX_SPIN)
+            continue;
+         simLog(sim, "handlers keep running without progress, stopping");
+         break;
+      }
+      spin = 0;
+
+      // Nothing to do now: jump the clock to the next thing that happens
+      next = sim->timers ? sim->timers->at : UINT64_MAX;
+      for (s = sim->socks; s; s = s->next) {
+         change = simNextChange(sim, s);
+         if (change < next)
+            next = change;
+      }
+      if (next == UINT64_MAX) {
+         simLog(sim, "nothing left to happen");
+         break;
+      }
+      if (sim->limit && next > sim->limit) {
+         sim->now = sim->limit;
+         simLog(sim, "time limit reached");
+         break;
+      }
+      if (next > sim->now)
+         sim->now = next;
+   }
+
+   return 0;
+}
+
+struct netSim *netSimCreate(void)
+{
+   struct netSim *sim;
+
+   sim = (struct netSim *)calloc(1, sizeof(*sim));
+   if (!sim)
+      return NULL;
+
+   sim->ops.socket = &simSocket;
+   sim->ops.connect = &simConnect;
+   sim->ops.read = &simRead;
+   sim->ops.write = &simWrite;
+   sim->ops.close = &simClose;
+   sim->ops.getsockopt = &simGetsockopt;
+   sim->ops.setsockopt = &simSetsockopt;
+   sim->ops.fcntl = &simFcntl;
+   sim->ops.now = &simNow;
+   sim->ops.schedAdd = &simSchedAdd;
+   sim->ops.schedRemove = &simSchedRemove;
+   sim->ops.fdAdd = &simFdAdd;
+   sim->ops.fdRemove = &simFdRemove;
+   sim->ops.run = &simRun;
+   sim->ops.exitLoop = &simExitLoop;
+   sim->ops.ctx = sim;
+
+   gettimeofday(&sim->base, NULL);
+   sim->nextFd = NETSIM_FIRST_FD;
+
+   return sim;
+}
+
+void netSimFree(struct netSim *sim)
+{
+   struct simListener *l;
+   struct simTimer *t;
+
+   if (!sim)
+      return;
+
+   while (sim->socks)
+      simClose(sim, sim->socks->fd);
+   while ((t = sim->timers)) {
+      sim->timers = t->next;
+      free(t);
+   }
+   while ((l = sim->listeners)) {
+      sim->listeners = l->next;
+      free(l);
+   }
+   free(sim);
+}
+
+int netSimAddPeer(struct netSim *sim, int port, const struct netSimPeer *peer)
+{
+   struct simListener *l, **pos;
+
+   l = (struct simListener *)calloc(1, sizeof(*l));
+   if (!l)
+      return -1;
+   l->port = port;
+   l->cfg = *peer;
+
+   // Specific ports are matched before a port 0 wildcard
+   for (pos = &sim->listeners; *pos && (*pos)->port; pos = &(*pos)->next)
+      ;
+   if (port == 0)
+      for (; *pos; pos = &(*pos)->next)
+         ;
+   l->next = *pos;
+   *pos = l;
+
+   return 0;
+}
+
+int netSimParsePeer(const char *spec, struct netSimPeer *peer)
+{
+   char *copy, *tok, *save, *val;
+   int res = 0;
+
+   memset(peer, 0, sizeof(*peer));
+   peer->faults = 1;
+
+   copy = strdup(spec);
+   if (!copy)
+      return -1;
+
+   for (tok = strtok_r(copy, ",", &save); tok && !res;
+         tok = strtok_r(NULL, ",", &save)) {
+      val = strchr(tok, '=');
+      if (val)
+         *val++ = 0;
+
+      if (!strcmp(tok, "echo"))
+         peer->echo = 1;
+      else if (!val)
+         res = -1;
+      else if (!strcmp(tok, "refuse"))
+         peer->refuse = atoi(val);
+      else if (!strcmp(tok, "connect"))
+         peer->connectMs = atoi(val);
+      else if (!strcmp(tok, "reset"))
+         peer->resetAfter = strtoul(val, NULL, 0);
+      else if (!strcmp(tok, "close"))
+         peer->closeMs = atoi(val);
+      else if (!strcmp(tok, "faults"))
+         peer->faults = atoi(val);
+      else if (!strcmp(tok, "rate"))
+         peer->rate = strtoul(val, NULL, 0);
+      else if (!strcmp(tok, "sndbuf"))
+         peer->sndbuf = strtoul(val, NULL, 0);
+      else
+         res = -1;
+   }
+   free(copy);
+
+   return res;
+}
+
+void netSimSetLog(struct netSim *sim, FILE *out)
+{
+   sim->log = out;
+}
+
+void netSimSetLimit(struct netSim *sim, uint64_t ms)
+{
+   sim->limit = ms * 1000;
+}
+
+const struct netOps *netSimOps(struct netSim *sim)
+{
+   return &sim->ops;
+}
+
+uint64_t netSimElapsedUs(const struct netSim *sim)
+{
+   return sim->now;
+}
@@ -0,0 +1,73 @@
+#ifndef NETSIM_H
+#define NETSIM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "netsys.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* How a simulated peer behaves.  Every connection to it goes through the
+ *   same script, except that resetAfter and closeMs only hit the first
+ *   faults connections, so a link can be seen to recover.
+ */
+struct netSimPeer {
+   int refuse;          // Connects refused before one is accepted
+   int connectMs;       // Virtual time a connect takes to complete
+   uint32_t resetAfter; // Reset after the peer reads this many bytes, 0 never
+   int closeMs;         // Peer closes this long after accepting, 0 never
+   int faults;          // Connections resetAfter and closeMs hit, -1 all
+   uint32_t rate;       // Bytes per second the peer reads, 0 for no limit
+   uint32_t sndbuf;     // Send buffer bytes, 0 for 64 KB
+   int echo;            // Send everything read back
+};
+
+struct netSim;
+
+/* Create a simulator.  Its virtual clock starts at the current wall time
+ *   and only moves when nothing is left to do at the current instant.
+ * @return the simulator, or NULL if out of memory.
+ */
+struct netSim *netSimCreate(void);
+
+/* Free the simulator and any sockets still open on it. */
+void netSimFree(struct netSim *sim);
+
+/* Listen on a port.  Connects to ports nobody listens on are refused at
+ *   once.  Port 0 matches every port and unix:// path.
+ * @return -1 if out of memory, 0 on success.
+ */
+int netSimAddPeer(struct netSim *sim, int port, const struct netSimPeer *peer);
+
+/* Fill in a peer from comma separated settings, e.g.
+ *   "refuse=2,reset=4096,rate=1200,echo".  Keys are refuse, connect, reset,
+ *   close, faults, rate, sndbuf and echo; faults defaults to 1.
+ * @return -1 on an unknown key, 0 on success.
+ */
+int netSimParsePeer(const char *spec, struct netSimPeer *peer);
+
+/* Print peer side events, stamped with virtual time, to out.  NULL stops. */
+void netSimSetLog(struct netSim *sim, FILE *out);
+
+/* Stop the run loop once the virtual clock passes this many milliseconds
+ *   from creation.  0, the default, runs until the loop is exited or
+ *   nothing more can happen.
+ */
+void netSimSetLimit(struct netSim *sim, uint64_t ms);
+
+/* The operations to put in serialOptions.netOps.  Event loop calls ignore
+ *   the EventState argument: the simulator is the event loop, and netRun
+ *   drives it.
+ */
+const struct netOps *netSimOps(struct netSim *sim);
+
+/* Virtual microseconds elapsed since the simulator was created. */
+uint64_t netSimElapsedUs(const struct netSim *sim);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,57 @@
+#!/bin/sh
+# Link fault scenarios on the -Z simulator, run by "make test".  Each one
+# runs in virtual time, so the whole set takes well under a second.
+#
+# Usage: netsim_test.sh [program]
+
+PROG=${1:-./endurasat-cmd}
+URL=tcp://127.0.0.1:9000
+OUT=${TMPDIR:-/tmp}/netsim_test.$$
+FAILED=0
+
+trap 'rm -f "$OUT" "$OUT.up"' EXIT
+
+# scenario <name> <exit status> <line the run must print> <args...>
+scenario()
+{
+   name=$1 want=$2 line=$3
+   shift 3
+
+   "$PROG" "$@" > "$OUT" 2>&1
+   rc=$?
+   if [ $rc -ne "$want" ]; then
+      echo "FAIL $name: exit status $rc, expected $want"
+   elif ! grep -q -- "$line" "$OUT"; then
+      echo "FAIL $name: no \"$line\" in the output"
+   else
+      echo "ok   $name"
+      return
+   fi
+   sed 's/^/     /' "$OUT"
+   FAILED=1
+}
+
+# The command is retried past two refusals and echoed by the third connect
+scenario refused-connect 0 "accepting connection 1" \
+   -Z refuse=2,echo $URL 1 2 3
+
+# Reset part way through the command; the reconnect writes it again
+scenario reset 0 "accepting connection 2" \
+   -Z reset=4,echo $URL 1 2 3
+
+# Peer closes after the reply; the run still ends cleanly
+scenario close 0 "peer closed" \
+   -Z close=100,echo $URL 1 2 3
+
+# A 20 KB upload through a 1200 B/s peer with a 4 KB send buffer
+head -c 20000 "$PROG" > "$OUT.up"
+scenario slow-peer 0 "round trip verified" \
+   -Z rate=1200,sndbuf=4096,echo -U "$OUT.up" $URL
+
+# Negative cases: a run that gets nothing back must fail
+scenario no-reply 1 "simulation: no reply" \
+   -Z refuse=2 $URL 1 2 3
+scenario reset-always 1 "simulation: no reply" \
+   -Z reset=4,faults=-1,echo $URL 1 2 3
+
+exit $FAILED
@@ -0,0 +1,104 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include "netsys.h"
+
+// The real system: libc sockets, the wall clock and the libproc event loop
+
+static int sysSocket(void *ctx, int domain, int type, int protocol)
+{
+   return socket(domain, type, protocol);
+}
+
+static int sysConnect(void *ctx, int fd, const struct sockaddr *addr,
+      socklen_t len)
+{
+   return connect(fd, addr, len);
+}
+
+static ssize_t sysRead(void *ctx, int fd, void *buf, size_t len)
+{
+   return read(fd, buf, len);
+}
+
+static ssize_t sysWrite(void *ctx, int fd, const void *buf, size_t len)
+{
+   return write(fd, buf, len);
+}
+
+static int sysClose(void *ctx, int fd)
+{
+   return close(fd);
+}
+
+static int sysGetsockopt(void *ctx, int fd, int level, int name, void *val,
+      socklen_t *len)
+{
+   return getsockopt(fd, level, name, val, len);
+}
+
+static int sysSetsockopt(void *ctx, int fd, int level, int name,
+      const void *val, socklen_t len)
+{
+   return setsockopt(fd, level, name, val, len);
+}
+
+static int sysFcntl(void *ctx, int fd, int cmd, int arg)
+{
+   return fcntl(fd, cmd, arg);
+}
+
+static void sysNow(void *ctx, struct timeval *tv)
+{
+   gettimeofday(tv, NULL);
+}
+
+static void *sysSchedAdd(void *ctx, struct EventState *evt,
+      struct timeval when, netSchedCB cb, void *arg)
+{
+   return EVT_sched_add(evt, when, cb, arg);
+}
+
+static void sysSchedRemove(void *ctx, struct EventState *evt, void *event)
+{
+   EVT_sched_remove(evt, event);
+}
+
+static void sysFdAdd(void *ctx, struct EventState *evt, int fd, int type,
+      netFdCB cb, void *arg)
+{
+   EVT_fd_add(evt, fd, type, cb, arg);
+}
+
+static void sysFdRemove(void *ctx, struct EventState *evt, int fd, int type)
+{
+   EVT_fd_remove(evt, fd, type);
+}
+
+static int sysRun(void *ctx, struct EventState *evt)
+{
+   return EVT_start_loop(evt);
+}
+
+static void sysExitLoop(void *ctx, struct EventState *evt)
+{
+   EVT_exit_loop(evt);
+}
+
+const struct netOps netSysOps = {
+   .socket = &sysSocket,
+   .connect = &sysConnect,
+   .read = &sysRead,
+   .write = &sysWrite,
+   .close = &sysClose,
+   .getsockopt = &sysGetsockopt,
+   .setsockopt = &sysSetsockopt,
+   .fcntl = &sysFcntl,
+   .now = &sysNow,
+   .schedAdd = &sysSchedAdd,
+   .schedRemove = &sysSchedRemove,
+   .fdAdd = &sysFdAdd,
+   .fdRemove = &sysFdRemove,
+   .run = &sysRun,
+   .exitLoop = &sysExitLoop,
+   .ctx = NULL,
+};
@@ -0,0 +1,139 @@
+#ifndef NETSYS_H
+#define NETSYS_H
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <polysat/polysat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef int (*netSchedCB)(void *arg);
+typedef int (*netFdCB)(int fd, char type, void *arg);
+
+/* The system calls, clock and event loop calls the socket links make.
+ *   netSysOps is the real thing: libc and the libproc event loop.  netsim.h
+ *   supplies a virtual clock and simulated peers behind the same table, so
+ *   the connect, retry and close state machine runs without real sockets or
+ *   real time.  Functions follow their libc and EVT_* counterparts, with
+ *   errors reported through errno.
+ */
+struct netOps {
+   int (*socket)(void *ctx, int domain, int type, int protocol);
+   int (*connect)(void *ctx, int fd, const struct sockaddr *addr,
+         socklen_t len);
+   ssize_t (*read)(void *ctx, int fd, void *buf, size_t len);
+   ssize_t (*write)(void *ctx, int fd, const void *buf, size_t len);
+   int (*close)(void *ctx, int fd);
+   int (*getsockopt)(void *ctx, int fd, int level, int name, void *val,
+         socklen_t *len);
+   int (*setsockopt)(void *ctx, int fd, int level, int name,
+         const void *val, socklen_t len);
+   int (*fcntl)(void *ctx, int fd, int cmd, int arg);
+   void (*now)(void *ctx, struct timeval *tv);
+   void *(*schedAdd)(void *ctx, struct EventState *evt, struct timeval when,
+         netSchedCB cb, void *arg);
+   void (*schedRemove)(void *ctx, struct EventState *evt, void *event);
+   void (*fdAdd)(void *ctx, struct EventState *evt, int fd, int type,
+         netFdCB cb, void *arg);
+   void (*fdRemove)(void *ctx, struct EventState *evt, int fd, int type);
+   int (*run)(void *ctx, struct EventState *evt);
+   void (*exitLoop)(void *ctx, struct EventState *evt);
+   void *ctx;
+};
+
+extern const struct netOps netSysOps;
+
+// Call through the table without spelling out the context each time
+static inline int netSocket(const struct netOps *o, int domain, int type,
+      int protocol)
+{
+   return o->socket(o->ctx, domain, type, protocol);
+}
+
+static inline int netConnect(const struct netOps *o, int fd,
+      const struct sockaddr *addr, socklen_t len)
+{
+   return o->connect(o->ctx, fd, addr, len);
+}
+
+static inline ssize_t netRead(const struct netOps *o, int fd, void *buf,
+      size_t len)
+{
+   return o->read(o->ctx, fd, buf, len);
+}
+
+static inline ssize_t netWrite(const struct netOps *o, int fd,
+      const void *buf, size_t len)
+{
+   return o->write(o->ctx, fd, buf, len);
+}
+
+static inline int netClose(const struct netOps *o, int fd)
+{
+   return o->close(o->ctx, fd);
+}
+
+static inline int netGetsockopt(const struct netOps *o, int fd, int level,
+      int name, void *val, socklen_t *len)
+{
+   return o->getsockopt(o->ctx, fd, level, name, val, len);
+}
+
+static inline int netSetsockopt(const struct netOps *o, int fd, int level,
+      int name, const void *val, socklen_t len)
+{
+   return o->setsockopt(o->ctx, fd, level, name, val, len);
+}
+
+static inline int netFcntl(const struct netOps *o, int fd, int cmd, int arg)
+{
+   return o->fcntl(o->ctx, fd, cmd, arg);
+}
+
+static inline void netNow(const struct netOps *o, struct timeval *tv)
+{
+   o->now(o->ctx, tv);
+}
+
+static inline void *netSchedAdd(const struct netOps *o,
+      struct EventState *evt, struct timeval when, netSchedCB cb, void *arg)
+{
+   return o->schedAdd(o->ctx, evt, when, cb, arg);
+}
+
+static inline void netSchedRemove(const struct netOps *o,
+      struct EventState *evt, void *event)
+{
+   o->schedRemove(o->ctx, evt, event);
+}
+
+static inline void netFdAdd(const struct netOps *o, struct EventState *evt,
+      int fd, int type, netFdCB cb, void *arg)
+{
+   o->fdAdd(o->ctx, evt, fd, type, cb, arg);
+}
+
+static inline void netFdRemove(const struct netOps *o,
+      struct EventState *evt, int fd, int type)
+{
+   o->fdRemove(o->ctx, evt, fd, type);
+}
+
+static inline int netRun(const struct netOps *o, struct EventState *evt)
+{
+   return o->run(o->ctx, evt);
+}
+
+static inline void netExitLoop(const struct netOps *o, struct EventState *evt)
+{
+   o->exitLoop(o->ctx, evt);
+}
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
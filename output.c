@@ -0,0 +1,231 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/time.h>
+#include "schema.h"
+#include "output.h"
+
+#define OUTBUFFER_SIZE (64*1024)
+
+static char outBuff[OUTBUFFER_SIZE];
+static int outBytes;
+static const struct schema *outSchema;
+
+// Two ASCII hex digits for every byte value, built on first use
+static char hexTable[256][2];
+static int hexTableReady;
+
+static void buildHexTable(void)
+{
+   static const char digits[] = "0123456789ABCDEF";
+   int i;
+
+   for (i = 0; i < 256; i++) {
+      hexTable[i][0] = digits[i >> 4];
+      hexTable[i][1] = digits[i & 0xF];
+   }
+   hexTableReady = 1;
+}
+
+// Make sure at least len bytes are free, flushing if they are not
+static void reserve(int len)
+{
+   if (outBytes + len > OUTBUFFER_SIZE)
+      outputFlush();
+}
+
+static void append(const void *src, int len)
+{
+   while (len > 0) {
+      int chunk = OUTBUFFER_SIZE - outBytes;
+
+      if (chunk == 0) {
+         outputFlush();
+         chunk = OUTBUFFER_SIZE;
+      }
+      if (chunk > len)
+         chunk = len;
+      memcpy(outBuff + outBytes, src, chunk);
+      outBytes += chunk;
+      src = (const char *)src + chunk;
+      len -= chunk;
+   }
+}
+
+// Append len bytes as hex, each followed by sep when sep is non-zero
+static void appendHex(const unsigned char *b, int len, char sep)
+{
+   int width = sep ? 3 : 2;
+   char *dst;
+   int i;
+
+   if (!hexTableReady)
+      buildHexTable();
+
+   for (i = 0; i < len; i++) {
+      if (outBytes + width > OUTBUFFER_SIZE)
+         outputFlush();
+      dst = outBuff + outBytes;
+      dst[0] = hexTable[b[i]][0];
+      dst[1] = hexTable[b[i]][1];
+      if (sep)
+         dst[2] = sep;
+      outBytes += width;
+   }
+}
+
+int outputParseFormat(const char *name, enum outputFormat *fmt)
+{
+   if (0 == strcasecmp(name, "hex"))
+      *fmt = OUTPUT_HEX;
+   else if (0 == strcasecmp(name, "raw"))
+      *fmt = OUTPUT_RAW;
+   else if (0 == strcasecmp(name, "json"))
+      *fmt = OUTPUT_JSON;
+   else if (0 == strcasecmp(name, "bin"))
+      *fmt = OUTPUT_BIN;
+   else
+      return -1;
+
+   return 0;
+}
+
+void outputChunk(enum outputFormat fmt, const void *buf, int len)
+{
+   if (fmt == OUTPUT_RAW) {
+      append(buf, len);
+      return;
+   }
+
+   append("Recvd: ", 7);
+   appendHex((const unsigned char *)buf, len, ' ');
+   append("\n", 1);
+}
+
+int outputFramed(enum outputFormat fmt)
+{
+   return fmt == OUTPUT_JSON || fmt == OUTPUT_BIN;
+}
+
+void outputSetSchema(const struct schema *s)
+{
+   outSchema = s;
+}
+
+/* The schema message for a frame, or NULL to fall back to the raw bytes.
+ *   Frames are <len> <id> <fields> <crc16 hi> <crc16 lo>; only frames that
+ *   verified and carry every field are decoded.
+ */
+static const struct schemaMsg *frameMsg(const unsigned char *frame, int len,
+      int crcOk)
+{
+   const struct schemaMsg *m;
+
+   if (!outSchema || !crcOk || len < 4)
+      return NULL;
+   m = schemaLookup(outSchema, frame[1]);
+   if (!m || len - 4 < m->minLen)
+      return NULL;
+
+   return m;
+}
+
+static void frameBinary(int port, const unsigned char *frame, int len,
+      int crcOk, const struct timeval *now)
+{
+   static const char pad[8];
+   const struct schemaMsg *m = frameMsg(frame, len, crcOk);
+   struct outputRecord rec;
+   int body;
+
+   if (m && m->outSize > OUTBUFFER_SIZE - sizeof(rec))
+      m = NULL;
+   body = m ? m->outSize : len;
+
+   rec.size = sizeof(rec) + ((body + 7) & ~7);
+   rec.id = len > 1 ? frame[1] : 0;
+   rec.flags = (crcOk ? OUTPUT_REC_CRC_OK : 0) |
+      (m ? OUTPUT_REC_DECODED : 0);
+   rec.port = port;
+   rec.tsUs = (uint64_t)now->tv_sec * 1000000 + now->tv_usec;
+
+   reserve(rec.size);
+   append(&rec, sizeof(rec));
+   if (m) {
+      // Decode in place; the buffer is the only copy
+      schemaDecode(m, frame + 2, len - 4, outBuff + outBytes);
+      outBytes += m->outSize;
+      return;
+   }
+   append(frame, len);
+   append(pad, rec.size - sizeof(rec) - len);
+}
+
+void outputFrame(enum outputFormat fmt, int port, const unsigned char *frame,
+      int len, int crcOk)
+{
+   const struct schemaMsg *m;
+   struct timeval now;
+   char hdr[160];
+   int hdrLen, res;
+
+   gettimeofday(&now, NULL);
+   if (fmt == OUTPUT_BIN) {
+      frameBinary(port, frame, len, crcOk, &now);
+      return;
+   }
+
+   m = frameMsg(frame, len, crcOk);
+   if (m && m->jsonSize + sizeof(hdr) + 3 <= OUTBUFFER_SIZE) {
+      hdrLen = snprintf(hdr, sizeof(hdr),
+            "{\"ts\":%ld.%06ld,\"port\":%d,\"len\":%d,\"crc_ok\":true,"
+            "\"id\":%d,\"msg\":\"%s\",\"fields\":{",
+            (long)now.tv_sec, (long)now.tv_usec, port, len, frame[1],
+            m->name);
+
+      // Fields are formatted straight into the buffer, no staging copy
+      reserve(hdrLen + m->jsonSize + 3);
+      append(hdr, hdrLen);
+      res = schemaFormatJSON(m, frame + 2, len - 4, outBuff + outBytes,
+            OUTBUFFER_SIZE - outBytes);
+      outBytes += res;
+      append("}}\n", 3);
+      return;
+   }
+
+   hdrLen = snprintf(hdr, sizeof(hdr),
+         "{\"ts\":%ld.%06ld,\"port\":%d,\"len\":%d,\"crc_ok\":%s,\"data\":\"",
+         (long)now.tv_sec, (long)now.tv_usec, port, len,
+         crcOk ? "true" : "false");
+
+   reserve(hdrLen + 2 * len + 3);
+   append(hdr, hdrLen);
+   appendHex(frame, len, 0);
+   append("\"}\n", 3);
+}
+
+void outputFlush(void)
+{
+   int off = 0;
+   int res;
+
+   if (outBytes == 0)
+      return;
+
+   // Anything printf'd so far must reach stdout first
+   fflush(stdout);
+
+   while (off < outBytes) {
+      res = write(STDOUT_FILENO, outBuff + off, outBytes - off);
+      if (res < 0) {
+         if (errno == EINTR)
+            continue;
+         break;
+      }
+      off += res;
+   }
+   outBytes = 0;
+}
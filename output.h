@@ -0,0 +1,81 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Receive output formats selectable on the command line
+enum outputFormat {
+   OUTPUT_HEX = 0, // "Recvd: XX XX ..." per received chunk
+   OUTPUT_RAW,     // received bytes copied verbatim
+   OUTPUT_JSON,    // one JSON object per decoded KISS frame
+   OUTPUT_BIN,     // one outputRecord plus body per decoded KISS frame
+};
+
+// outputRecord flags
+#define OUTPUT_REC_CRC_OK  0x01
+#define OUTPUT_REC_DECODED 0x02 // Body is the schema struct, not the frame
+
+/* Header of each binary record, in host byte order.  The body follows:
+ *   the message's struct from schemaWriteHeader when OUTPUT_REC_DECODED is
+ *   set, the raw frame bytes otherwise.  size covers header and body.
+ */
+struct outputRecord {
+   uint32_t size;
+   uint8_t id;    // Response ID, frame[1], 0 if the frame is too short
+   uint8_t flags;
+   uint16_t port;
+   uint64_t tsUs; // Receive time, microseconds since the epoch
+};
+
+struct schema;
+
+/* Map a format name ("hex", "raw", "json" or "bin") to its enum value.
+ * @param name the format name.
+ * @param fmt receives the format on success.
+ * @return -1 on error, 0 on success.
+ */
+int outputParseFormat(const char *name, enum outputFormat *fmt);
+
+/* Format a received chunk of bytes into the output buffer.  Used for the
+ *   hex and raw formats.
+ * @param fmt the output format.
+ * @param buf a pointer to the received bytes.
+ * @param len the number of received bytes.
+ */
+void outputChunk(enum outputFormat fmt, const void *buf, int len);
+
+/* True for formats that KISS decode the stream and call outputFrame. */
+int outputFramed(enum outputFormat fmt);
+
+/* Decode frames with a compiled schema.  Frames whose CRC verifies and
+ *   whose response ID the schema describes get typed fields; others are
+ *   output as before.
+ * @param s the schema, which must outlive its use here. NULL to disable.
+ */
+void outputSetSchema(const struct schema *s);
+
+/* Format one decoded frame into the output buffer, as a JSON line or a
+ *   binary record.
+ * @param fmt OUTPUT_JSON or OUTPUT_BIN.
+ * @param port the KISS port the frame arrived on.
+ * @param frame a pointer to the frame bytes.
+ * @param len the number of frame bytes.
+ * @param crcOk true when the frame's trailing CRC16 verified.
+ */
+void outputFrame(enum outputFormat fmt, int port, const unsigned char *frame,
+      int len, int crcOk);
+
+/* Write everything buffered so far to stdout with a single write.  Call
+ *   once per event rather than once per byte or frame.
+ */
+void outputFlush(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
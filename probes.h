@@ -0,0 +1,50 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/* Static tracepoints on the transport hot paths, provider "endurasat".
+ *   Built by default when sys/sdt.h (systemtap-sdt-dev) is found, HAVE_SDT,
+ *   each probe is a single nop plus an ELF note, which perf and bpftrace
+ *   attach to at run time, e.g.
+ *
+ *     bpftrace -e 'usdt:./endurasat-cmd:endurasat:tcp_tx
+ *           { @[str(arg0)] = hist(arg2); }'
+ *
+ *   Without the header or with SDT=0 the probes compile away and their
+ *   arguments are never evaluated.
+ *
+ *   serial_enqueue  fd, bytes, queued, result   serialWrite
+ *   serial_tx       fd, bytes, queued           writeEvent, io_uring writes
+ *   serial_rx       fd, bytes                   readEvent, io_uring reads
+ *   tcp_enqueue     link, fd, bytes, queued, result   tcpSerialWrite
+ *   tcp_tx          link, fd, bytes, queued     sock_write_callback,
+ *                                               io_uring write chains
+ *   tcp_rx          link, fd, bytes             tcpReadEvent, io_uring reads
+ *   tcp_connect     link, fd                    connect attempt begins
+ *   tcp_connected   link, fd, connect_us        connection established,
+ *                                               or first byte under TFO
+ *   tcp_connect_fail link, errno                connect attempt failed
+ *   tcp_close       link, fd, reconnects        connection torn down
+ *
+ *   link is the host name or unix socket path, queued the bytes still
+ *   waiting to be written and result the SERIAL_WRITE_* code.  bytes is
+ *   -1 in tx and rx when the call failed.
+ */
+#ifdef HAVE_SDT
+#include <sys/sdt.h>
+
+#define PROBE2(name, a, b) DTRACE_PROBE2(endurasat, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(endurasat, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(endurasat, name, a, b, c, d)
+#define PROBE5(name, a, b, c, d, e) \
+   DTRACE_PROBE5(endurasat, name, a, b, c, d, e)
+
+#else
+
+#define PROBE2(name, a, b) do { } while (0)
+#define PROBE3(name, a, b, c) do { } while (0)
+#define PROBE4(name, a, b, c, d) do { } while (0)
+#define PROBE5(name, a, b, c, d, e) do { } while (0)
+
+#endif
+
+#endif
@@ -0,0 +1,201 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <polysat/polysat.h>
+#include "spsc.h"
+#include "rx_worker.h"
+
+#define RX_SLOT_SIZE 4096
+
+struct rxWorker {
+   struct spscRing *ring;
+   pthread_t thread;
+   int efd; // Wakes the worker when it is blocked on an empty ring
+   int spaceFd; // Wakes the I/O thread when it is blocked on a full ring
+   volatile int stop;
+   volatile int exited; // Worker thread has returned
+   uint64_t stalls;
+   rxChunkCB chunkCB;
+   void *opaque;
+};
+
+static void signalFd(int fd)
+{
+   uint64_t val = 1;
+
+   if (write(fd, &val, sizeof(val)) < 0)
+      DBG_print(DBG_LEVEL_WARN, "rx worker wakeup failed: %s\n",
+            strerror(errno));
+}
+
+static void *rxWorkerMain(void *arg)
+{
+   struct rxWorker *w = (struct rxWorker *)arg;
+   uint64_t val;
+   void *buf;
+   int len;
+
+   for (;;) {
+      len = spscPeek(w->ring, &buf);
+      if (len >= 0) {
+         w->chunkCB(buf, len, w->opaque);
+         spscRelease(w->ring);
+         // Pairs with the fence in waitForSlot
+         __atomic_thread_fence(__ATOMIC_SEQ_CST);
+         if (__atomic_load_n(&w->ring->waiting, __ATOMIC_RELAXED))
+            signalFd(w->spaceFd);
+         continue;
+      }
+
+      if (__atomic_load_n(&w->stop, __ATOMIC_ACQUIRE))
+         break;
+
+      // Announce we are going to sleep, then re-check before blocking so a
+      // push racing with us is never missed
+      __atomic_store_n(&w->ring->sleeping, 1, __ATOMIC_SEQ_CST);
+      if (spscDepth(w->ring) == 0 &&
+            !__atomic_load_n(&w->stop, __ATOMIC_SEQ_CST)) {
+         if (read(w->efd, &val, sizeof(val)) < 0 && errno != EINTR)
+            break;
+      }
+      __atomic_store_n(&w->ring->sleeping, 0, __ATOMIC_SEQ_CST);
+   }
+
+   // Never leave the I/O thread waiting on a worker that is gone
+   __atomic_store_n(&w->exited, 1, __ATOMIC_SEQ_CST);
+   signalFd(w->spaceFd);
+
+   return NULL;
+}
+
+static void rxWorkerWake(struct rxWorker *w)
+{
+   signalFd(w->efd);
+}
+
+// Block the I/O thread until the worker frees a slot
+// @return -1 if the worker has exited and never will, 0 once one is free
+static int waitForSlot(struct rxWorker *w)
+{
+   uint64_t val;
+   int stalled = 0;
+
+   for (;;) {
+      // Nothing would ever drain what we queued
+      if (__atomic_load_n(&w->exited, __ATOMIC_SEQ_CST))
+         return -1;
+      if (spscDepth(w->ring) < w->ring->slots)
+         return 0;
+      if (!stalled++)
+         w->stalls++;
+
+      // Announce the wait, then re-check so a release racing with us is
+      // seen either here or by the worker
+      __atomic_store_n(&w->ring->waiting, 1, __ATOMIC_SEQ_CST);
+      __atomic_thread_fence(__ATOMIC_SEQ_CST);
+      if (spscDepth(w->ring) >= w->ring->slots &&
+            !__atomic_load_n(&w->exited, __ATOMIC_SEQ_CST)) {
+         if (read(w->spaceFd, &val, sizeof(val)) < 0 && errno != EINTR) {
+            __atomic_store_n(&w->ring->waiting, 0, __ATOMIC_SEQ_CST);
+            return -1;
+         }
+      }
+      __atomic_store_n(&w->ring->waiting, 0, __ATOMIC_SEQ_CST);
+   }
+}
+
+struct rxWorker *rxWorkerStart(rxChunkCB chunkCB, void *opaque,
+      uint32_t slots)
+{
+   struct rxWorker *w;
+   void *mem;
+
+   w = (struct rxWorker *)malloc(sizeof(*w));
+   if (!w) {
+      DBG_print(DBG_LEVEL_WARN, "Insufficient memory\n");
+      return NULL;
+   }
+   memset(w, 0, sizeof(*w));
+   w->chunkCB = chunkCB;
+   w->opaque = opaque;
+
+   if (posix_memalign(&mem, SPSC_CACHELINE, spscSize(slots, RX_SLOT_SIZE))) {
+      DBG_print(DBG_LEVEL_WARN, "Insufficient memory\n");
+      free(w);
+      return NULL;
+   }
+   w->ring = spscInit(mem, slots, RX_SLOT_SIZE);
+
+   w->efd = eventfd(0, EFD_CLOEXEC);
+   w->spaceFd = eventfd(0, EFD_CLOEXEC);
+   if (w->efd < 0 || w->spaceFd < 0) {
+      DBG_print(DBG_LEVEL_WARN, "eventfd failed: %s\n", strerror(errno));
+      if (w->efd >= 0)
+         close(w->efd);
+      if (w->spaceFd >= 0)
+         close(w->spaceFd);
+      free(mem);
+      free(w);
+      return NULL;
+   }
+
+   if (pthread_create(&w->thread, NULL, &rxWorkerMain, w)) {
+      DBG_print(DBG_LEVEL_WARN, "Unable to start rx worker thread\n");
+      close(w->efd);
+      close(w->spaceFd);
+      free(mem);
+      free(w);
+      return NULL;
+   }
+
+   return w;
+}
+
+int rxWorkerPush(struct rxWorker *w, const void *src, int bytes)
+{
+   const char *s = (const char *)src;
+   int chunk, res = 0;
+
+   while (bytes > 0) {
+      chunk = bytes > RX_SLOT_SIZE ? RX_SLOT_SIZE : bytes;
+      if (waitForSlot(w) < 0) {
+         w->ring->drops++;
+         res = -1;
+      }
+      else if (spscPush(w->ring, s, chunk) < 0)
+         res = -1;
+      s += chunk;
+      bytes -= chunk;
+   }
+
+   if (__atomic_load_n(&w->ring->sleeping, __ATOMIC_SEQ_CST))
+      rxWorkerWake(w);
+
+   return res;
+}
+
+void rxWorkerStop(struct rxWorker *w, struct rxWorkerStats *stats)
+{
+   if (!w)
+      return;
+
+   __atomic_store_n(&w->stop, 1, __ATOMIC_SEQ_CST);
+   rxWorkerWake(w);
+   pthread_join(w->thread, NULL);
+
+   if (stats) {
+      stats->slots = w->ring->slots;
+      stats->highWater = w->ring->highWater;
+      stats->chunks = w->ring->pushes;
+      stats->stalls = w->stalls;
+      stats->drops = w->ring->drops;
+   }
+
+   close(w->efd);
+   close(w->spaceFd);
+   free(w->ring);
+   free(w);
+}
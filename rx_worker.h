@@ -0,0 +1,54 @@
+#ifndef RX_WORKER_H
+#define RX_WORKER_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct rxWorker;
+
+/* Type definition of the callback run on the worker thread for each chunk.
+ * @param buffer a pointer to the received bytes. Only valid during the call.
+ * @param bytes the number of bytes.
+ * @param opaque user supplied argument
+ */
+typedef void (*rxChunkCB)(void *buffer, int bytes, void *opaque);
+
+// Queue statistics reported when the worker stops
+struct rxWorkerStats {
+   uint32_t slots;     // Ring capacity in chunks
+   uint32_t highWater; // Deepest the ring got
+   uint64_t chunks;    // Chunks handed to the worker
+   uint64_t stalls;    // Pushes that waited for the worker to free a slot
+   uint64_t drops;     // Chunks dropped because the worker had stopped
+};
+
+/* Start a worker thread that runs chunkCB for every chunk pushed.
+ * @param chunkCB function run on the worker thread.
+ * @param opaque pointer passed through to chunkCB.
+ * @param slots ring capacity in chunks.
+ * @return the worker, or NULL on error. Check /var/log/syslog on error.
+ */
+struct rxWorker *rxWorkerStart(rxChunkCB chunkCB, void *opaque,
+      uint32_t slots);
+
+/* Hand received bytes to the worker.  Call from the I/O thread only.
+ *   When the ring is full this waits for the worker to free a slot, so the
+ *   caller stops draining its link and the sender is held back instead of
+ *   data being lost.  Bytes are only dropped if the worker thread has died.
+ * @return -1 if any bytes were dropped, 0 on success.
+ */
+int rxWorkerPush(struct rxWorker *w, const void *src, int bytes);
+
+/* Drain the ring, join the worker thread and free it.
+ * @param stats if not NULL, receives the final queue statistics.
+ */
+void rxWorkerStop(struct rxWorker *w, struct rxWorkerStats *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,525 @@
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include "schema.h"
+
+#define SCHEMA_MAX_FIELDS 256
+#define SCHEMA_NUM_LEN 32 // Longest formatted number, with room to spare
+
+struct schema {
+   struct schemaMsg *byId[256];
+   struct schemaMsg *msgs;
+   int count;
+};
+
+static const struct {
+   const char *name;
+   uint8_t type;
+   uint8_t size;
+} typeNames[] = {
+   { "u8", SCHEMA_U8, 1 }, { "i8", SCHEMA_I8, 1 },
+   { "u16", SCHEMA_U16, 2 }, { "u16be", SCHEMA_U16BE, 2 },
+   { "i16", SCHEMA_I16, 2 }, { "i16be", SCHEMA_I16BE, 2 },
+   { "u32", SCHEMA_U32, 4 }, { "u32be", SCHEMA_U32BE, 4 },
+   { "i32", SCHEMA_I32, 4 }, { "i32be", SCHEMA_I32BE, 4 },
+   { "u64", SCHEMA_U64, 8 }, { "u64be", SCHEMA_U64BE, 8 },
+   { "i64", SCHEMA_I64, 8 }, { "i64be", SCHEMA_I64BE, 8 },
+   { "f32", SCHEMA_F32, 4 }, { "f32be", SCHEMA_F32BE, 4 },
+   { "f64", SCHEMA_F64, 8 }, { "f64be", SCHEMA_F64BE, 8 },
+};
+
+static const char *ctypeNames[] = {
+   "uint8_t", "int8_t",
+   "uint16_t", "uint16_t", "int16_t", "int16_t",
+   "uint32_t", "uint32_t", "int32_t", "int32_t",
+   "uint64_t", "uint64_t", "int64_t", "int64_t",
+   "float", "float", "double", "double",
+   "uint8_t",
+};
+
+static int isBigEndian(uint8_t type)
+{
+   return type >= SCHEMA_U16 && type <= SCHEMA_F64BE &&
+      ((type - SCHEMA_U16) & 1);
+}
+
+static int isSigned(uint8_t type)
+{
+   return type == SCHEMA_I8 || (type >= SCHEMA_I16 && type <= SCHEMA_I16BE) ||
+      (type >= SCHEMA_I32 && type <= SCHEMA_I32BE) ||
+      (type >= SCHEMA_I64 && type <= SCHEMA_I64BE);
+}
+
+static int isFloat(uint8_t type)
+{
+   return type >= SCHEMA_F32 && type <= SCHEMA_F64BE;
+}
+
+// Assemble an unsigned wire value of 1, 2, 4 or 8 bytes
+static uint64_t loadRaw(const unsigned char *p, int size, int bigEndian)
+{
+   uint64_t v = 0;
+   int i;
+
+   if (bigEndian)
+      for (i = 0; i < size; i++)
+         v = (v << 8) | p[i];
+   else
+      for (i = size - 1; i >= 0; i--)
+         v = (v << 8) | p[i];
+
+   return v;
+}
+
+static int64_t signExtend(uint64_t v, int size)
+{
+   int shift = 64 - 8 * size;
+
+   return (int64_t)(v << shift) >> shift;
+}
+
+static double loadFloat(uint64_t raw, int size)
+{
+   union { uint32_t u; float f; } f32;
+   union { uint64_t u; double d; } f64;
+
+   if (size == 4) {
+      f32.u = (uint32_t)raw;
+      return f32.f;
+   }
+   f64.u = raw;
+   return f64.d;
+}
+
+// Read a name token, advancing *str.  Returns its length, 0 if none.
+static int parseName(char **str, char *dst)
+{
+   char *s = *str;
+   int len = 0;
+
+   while (*s == ' ' || *s == '\t')
+      s++;
+   while ((isalnum((unsigned char)*s) || *s == '_') &&
+         len < SCHEMA_NAME_LEN - 1)
+      dst[len++] = *s++;
+   dst[len] = 0;
+   *str = s;
+
+   return len;
+}
+
+static int parseType(const char *tok, uint8_t *type, int *size)
+{
+   char *end;
+   long n;
+   int i;
+
+   if (!strncmp(tok, "bytes", 5)) {
+      n = strtol(tok + 5, &end, 10);
+      if (end == tok + 5 || *end || n <= 0 || n > 1024)
+         return -1;
+      *type = SCHEMA_BYTES;
+      *size = n;
+      return 0;
+   }
+
+   for (i = 0; i < sizeof(typeNames) / sizeof(typeNames[0]); i++)
+      if (!strcmp(tok, typeNames[i].name)) {
+         *type = typeNames[i].type;
+         *size = typeNames[i].size;
+         return 0;
+      }
+
+   return -1;
+}
+
+// Lay out the decoded struct once a message's fields are all known
+static void finishMsg(struct schemaMsg *m)
+{
+   struct schemaField *f;
+   int i, off = 0, align;
+
+   for (i = 0; i < m->nfields; i++) {
+      f = &m->fields[i];
+      align = f->type == SCHEMA_BYTES ? 1 : f->size;
+      off = (off + align - 1) & ~(align - 1);
+      f->outOffset = off;
+      off += f->size;
+      m->jsonSize += strlen(f->name) + 4;
+      m->jsonSize += f->type == SCHEMA_BYTES ? 2 * f->size + 2 :
+         SCHEMA_NUM_LEN;
+   }
+   m->outSize = (off + 7) & ~7;
+}
+
+// k when scale is 10^-k for k in 1..9, else 0
+static int scaleDecimals(double scale)
+{
+   double p = 1;
+   int k;
+
+   for (k = 1; k <= 9; k++) {
+      p *= 10;
+      if (scale * p > 0.999999999 && scale * p < 1.000000001)
+         return k;
+   }
+
+   return 0;
+}
+
+static int addField(struct schemaMsg *m, const char *typeTok, char *rest)
+{
+   struct schemaField *f;
+   uint8_t type;
+   char *end;
+   int size;
+
+   if (m->nfields >= SCHEMA_MAX_FIELDS || parseType(typeTok, &type, &size))
+      return -1;
+
+   if (!m->fields) {
+      m->fields = calloc(SCHEMA_MAX_FIELDS, sizeof(*m->fields));
+      if (!m->fields)
+         return -1;
+   }
+
+   f = &m->fields[m->nfields];
+   if (!parseName(&rest, f->name))
+      return -1;
+   f->type = type;
+   f->size = size;
+   f->offset = m->minLen;
+   f->scale = 0;
+
+   while (*rest == ' ' || *rest == '\t')
+      rest++;
+   if (*rest == '*') {
+      if (type == SCHEMA_BYTES)
+         return -1;
+      f->scale = strtod(rest + 1, &end);
+      if (end == rest + 1)
+         return -1;
+      rest = end;
+      // Fixed point printing is for integers; floats keep their own bits
+      if (!isFloat(type))
+         f->decimals = scaleDecimals(f->scale);
+   }
+   while (*rest == ' ' || *rest == '\t')
+      rest++;
+   if (*rest && *rest != '#' && *rest != '\n' && *rest != '\r')
+      return -1;
+
+   m->minLen += size;
+   m->nfields++;
+
+   return 0;
+}
+
+struct schema *schemaLoad(const char *path)
+{
+   struct schema *s;
+   FILE *fp;
+
+   fp = fopen(path, "r");
+   if (!fp) {
+      perror(path);
+      return NULL;
+   }
+   s = schemaLoadFile(fp, path);
+   fclose(fp);
+
+   return s;
+}
+
+struct schema *schemaLoadFile(FILE *fp, const char *path)
+{
+   struct schema *s;
+   struct schemaMsg *m = NULL, *msgs;
+   char *line = NULL, *rest, *end, tok[SCHEMA_NAME_LEN];
+   size_t cap = 0;
+   int lineNo = 0, i;
+   long id;
+
+   s = (struct schema *)calloc(1, sizeof(*s));
+   if (!s)
+      return NULL;
+
+   while (getline(&line, &cap, fp) >= 0) {
+      lineNo++;
+      rest = line;
+      if (!parseName(&rest, tok)) {
+         if (*rest == '#' || *rest == '\n' || *rest == '\r' || !*rest)
+            continue;
+         fprintf(stderr, "%s:%d: syntax error\n", path, lineNo);
+         goto fail;
+      }
+
+      if (strcmp(tok, "msg")) {
+         if (!m || addField(m, tok, rest) < 0) {
+            fprintf(stderr, "%s:%d: bad field\n", path, lineNo);
+            goto fail;
+         }
+         continue;
+      }
+
+      id = strtol(rest, &end, 0);
+      for (i = 0; i < s->count && s->msgs[i].id != id; i++)
+         ;
+      if (end == rest || id < 0 || id > 255 || i < s->count) {
+         fprintf(stderr, "%s:%d: bad or duplicate message id\n",
+               path, lineNo);
+         goto fail;
+      }
+
+      msgs = realloc(s->msgs, (s->count + 1) * sizeof(*msgs));
+      if (!msgs)
+         goto fail;
+      s->msgs = msgs;
+      m = &s->msgs[s->count++];
+      memset(m, 0, sizeof(*m));
+      m->id = id;
+      rest = end;
+      if (!parseName(&rest, m->name))
+         snprintf(m->name, sizeof(m->name), "msg_%02x", (unsigned)id);
+   }
+
+   free(line);
+
+   // byId is filled last since realloc may have moved the messages
+   for (i = 0; i < s->count; i++) {
+      finishMsg(&s->msgs[i]);
+      s->byId[s->msgs[i].id] = &s->msgs[i];
+   }
+
+   return s;
+
+fail:
+   free(line);
+   schemaFree(s);
+   return NULL;
+}
+
+void schemaFree(struct schema *s)
+{
+   int i;
+
+   if (!s)
+      return;
+
+   for (i = 0; i < s->count; i++)
+      free(s->msgs[i].fields);
+   free(s->msgs);
+   free(s);
+}
+
+const struct schemaMsg *schemaLookup(const struct schema *s, uint8_t id)
+{
+   return s->byId[id];
+}
+
+int schemaCount(const struct schema *s)
+{
+   return s->count;
+}
+
+const struct schemaMsg *schemaMsgAt(const struct schema *s, int i)
+{
+   return i >= 0 && i < s->count ? &s->msgs[i] : NULL;
+}
+
+int schemaDecode(const struct schemaMsg *m, const unsigned char *payload,
+      int len, void *out)
+{
+   const struct schemaField *f, *fend = m->fields + m->nfields;
+   unsigned char *dst = (unsigned char *)out;
+   uint64_t raw;
+   uint32_t r32;
+   uint16_t r16;
+
+   if (len < m->minLen)
+      return -1;
+
+   // Padding is zeroed so records are reproducible byte for byte
+   memset(dst, 0, m->outSize);
+   for (f = m->fields; f < fend; f++) {
+      if (f->type == SCHEMA_BYTES) {
+         memcpy(dst + f->outOffset, payload + f->offset, f->size);
+         continue;
+      }
+
+      // Reassembling the integer gives host order whatever the wire order
+      raw = loadRaw(payload + f->offset, f->size, isBigEndian(f->type));
+      switch (f->size) {
+         case 1:
+            dst[f->outOffset] = (uint8_t)raw;
+            break;
+         case 2:
+            r16 = (uint16_t)raw;
+            memcpy(dst + f->outOffset, &r16, 2);
+            break;
+         case 4:
+            r32 = (uint32_t)raw;
+            memcpy(dst + f->outOffset, &r32, 4);
+            break;
+         default:
+            memcpy(dst + f->outOffset, &raw, 8);
+            break;
+      }
+   }
+   return 0;
+}
+
+// Decimal digits of v written backwards from end; returns the start
+static char *formatU64(uint64_t v, char *end)
+{
+   do {
+      *--end = '0' + v % 10;
+      v /= 10;
+   } while (v);
+
+   return end;
+}
+
+/* Integer scaled by 10^-decimals, printed exactly as fixed point.  Telemetry
+ *   scaling is nearly always of this form and this skips printf.
+ */
+static int formatDecimal(uint64_t raw, const struct schemaField *f,
+      char *dst)
+{
+   char num[SCHEMA_NUM_LEN], *start, *end = num + sizeof(num);
+   int64_t sv = 0;
+   int i, neg = 0, len;
+
+   if (isSigned(f->type) && (sv = signExtend(raw, f->size)) < 0) {
+      neg = 1;
+      raw = -(uint64_t)sv;
+   }
+
+   start = end;
+   for (i = 0; i < f->decimals; i++) {
+      *--start = '0' + raw % 10;
+      raw /= 10;
+   }
+   *--start = '.';
+   start = formatU64(raw, start);
+   if (neg)
+      *--start = '-';
+
+   len = end - start;
+   memcpy(dst, start, len);
+
+   return len;
+}
+
+static int formatValue(const struct schemaField *f, const unsigned char *p,
+      char *dst)
+{
+   static const char hex[] = "0123456789ABCDEF";
+   char num[SCHEMA_NUM_LEN], *start, *end = num + sizeof(num);
+   uint64_t raw;
+   int64_t sv;
+   double d;
+   int i, len;
+
+   if (f->type == SCHEMA_BYTES) {
+      dst[0] = '"';
+      for (i = 0; i < f->size; i++) {
+         dst[1 + 2 * i] = hex[p[i] >> 4];
+         dst[2 + 2 * i] = hex[p[i] & 0xF];
+      }
+      dst[1 + 2 * f->size] = '"';
+      return 2 + 2 * f->size;
+   }
+
+   raw = loadRaw(p, f->size, isBigEndian(f->type));
+   if (f->decimals)
+      return formatDecimal(raw, f, dst);
+   if (isFloat(f->type) || f->scale) {
+      if (isFloat(f->type))
+         d = loadFloat(raw, f->size);
+      else if (isSigned(f->type))
+         d = (double)signExtend(raw, f->size);
+      else
+         d = (double)raw;
+      if (f->scale)
+         d *= f->scale;
+      // JSON has no NaN or infinity
+      if (d != d || d - d != 0)
+         len = snprintf(dst, SCHEMA_NUM_LEN, "null");
+      else
+         len = snprintf(dst, SCHEMA_NUM_LEN, "%.9g", d);
+      return len;
+   }
+
+   // Integers are the common case and avoid printf entirely
+   if (isSigned(f->type) && (sv = signExtend(raw, f->size)) < 0) {
+      start = formatU64(-(uint64_t)sv, end);
+      *--start = '-';
+   }
+   else
+      start = formatU64(raw, end);
+   len = end - start;
+   memcpy(dst, start, len);
+
+   return len;
+}
+
+int schemaFormatJSON(const struct schemaMsg *m, const unsigned char *payload,
+      int len, char *dst, int dstLen)
+{
+   const struct schemaField *f, *fend = m->fields + m->nfields;
+   char *out = dst;
+   int nameLen;
+
+   if (len < m->minLen)
+      return -1;
+   if (dstLen < m->jsonSize)
+      return -1;
+
+   for (f = m->fields; f < fend; f++) {
+      if (f != m->fields)
+         *out++ = ',';
+      *out++ = '"';
+      nameLen = strlen(f->name);
+      memcpy(out, f->name, nameLen);
+      out += nameLen;
+      *out++ = '"';
+      *out++ = ':';
+      out += formatValue(f, payload + f->offset, out);
+   }
+
+   return out - dst;
+}
+
+void schemaWriteHeader(const struct schema *s, FILE *out)
+{
+   const struct schemaMsg *m;
+   const struct schemaField *f;
+   int i, j, off;
+
+   fprintf(out, "/* Generated by endurasat-cmd -H.  Decoded records are in "
+         "host byte order. */\n#include <stdint.h>\n\n");
+
+   for (i = 0; i < s->count; i++) {
+      m = &s->msgs[i];
+      fprintf(out, "#define SCHEMA_ID_%s 0x%02x\n\n", m->name, m->id);
+      fprintf(out, "struct %s { // %d bytes\n", m->name, m->outSize);
+      for (j = 0, off = 0; j < m->nfields; j++) {
+         f = &m->fields[j];
+         if (f->outOffset > off)
+            fprintf(out, "   uint8_t _pad%d[%d];\n", j, f->outOffset - off);
+         if (f->type == SCHEMA_BYTES)
+            fprintf(out, "   uint8_t %s[%d];\n", f->name, f->size);
+         else if (f->scale)
+            fprintf(out, "   %s %s; // * %g\n", ctypeNames[f->type], f->name,
+                  f->scale);
+         else
+            fprintf(out, "   %s %s;\n", ctypeNames[f->type], f->name);
+         off = f->outOffset + f->size;
+      }
+      if (m->outSize > off)
+         fprintf(out, "   uint8_t _pad%d[%d];\n", j, m->outSize - off);
+      fprintf(out, "};\n\n");
+   }
+}
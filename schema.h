@@ -0,0 +1,102 @@
+#ifndef SCHEMA_H
+#define SCHEMA_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SCHEMA_NAME_LEN 32
+
+// Field types; the big-endian variants follow their little-endian ones
+enum schemaType {
+   SCHEMA_U8 = 0, SCHEMA_I8,
+   SCHEMA_U16, SCHEMA_U16BE, SCHEMA_I16, SCHEMA_I16BE,
+   SCHEMA_U32, SCHEMA_U32BE, SCHEMA_I32, SCHEMA_I32BE,
+   SCHEMA_U64, SCHEMA_U64BE, SCHEMA_I64, SCHEMA_I64BE,
+   SCHEMA_F32, SCHEMA_F32BE, SCHEMA_F64, SCHEMA_F64BE,
+   SCHEMA_BYTES, // Fixed length byte string, output as hex
+};
+
+struct schemaField {
+   char name[SCHEMA_NAME_LEN];
+   uint8_t type;     // enum schemaType
+   uint16_t size;    // Bytes on the wire, and in the decoded struct
+   uint16_t offset;  // Position in the payload after the ID byte
+   uint16_t outOffset; // Position in the decoded struct
+   double scale;     // JSON value is raw * scale; 0 for unscaled
+   uint8_t decimals; // Non-zero when scale is 10^-decimals
+};
+
+struct schemaMsg {
+   char name[SCHEMA_NAME_LEN];
+   uint8_t id;
+   int nfields;
+   int minLen;  // Payload bytes the fields need, ID byte excluded
+   int outSize; // Size of the decoded struct, a multiple of 8
+   int jsonSize; // Longest schemaFormatJSON output
+   struct schemaField *fields;
+};
+
+struct schema;
+
+/* Compile a schema file.  "msg <id> <name>" starts a message, and each
+ *   following "<type> <name> [*<scale>]" line adds a field in wire order.
+ *   Types are u8, i8, u16, i16, u32, i32, u64, i64, f32 and f64, with a
+ *   "be" suffix for big-endian (little-endian otherwise), and bytes<N>.
+ *   '#' starts a comment.
+ * @param path the file to read.
+ * @return the compiled schema, or NULL on error. Errors go to stderr.
+ */
+struct schema *schemaLoad(const char *path);
+
+/* Compile a schema from an open stream, as schemaLoad does.
+ * @param fp the stream, left open.
+ * @param path the name to report errors against.
+ */
+struct schema *schemaLoadFile(FILE *fp, const char *path);
+
+/* Free a compiled schema. */
+void schemaFree(struct schema *s);
+
+/* Find the message for a response ID.
+ * @return the message, or NULL if the schema does not describe it.
+ */
+const struct schemaMsg *schemaLookup(const struct schema *s, uint8_t id);
+
+/* Number of messages and the i'th message, in file order. */
+int schemaCount(const struct schema *s);
+const struct schemaMsg *schemaMsgAt(const struct schema *s, int i);
+
+/* Decode a payload into the message's struct: host byte order, natural
+ *   alignment, the layout written by schemaWriteHeader.
+ * @param m the message.
+ * @param payload the bytes after the ID byte.
+ * @param len the number of payload bytes.
+ * @param out receives m->outSize bytes.
+ * @return -1 if the payload is shorter than the fields, 0 on success.
+ */
+int schemaDecode(const struct schemaMsg *m, const unsigned char *payload,
+      int len, void *out);
+
+/* Format a payload's fields as the members of a JSON object, e.g.
+ *   "\"mode\":2,\"volts\":3.3".  Decodes straight from the payload.
+ * @param dst buffer that receives the text.
+ * @param dstLen size of dst; m->jsonSize bytes always suffice.
+ * @return the number of bytes written, or -1 if the payload is short.
+ */
+int schemaFormatJSON(const struct schemaMsg *m, const unsigned char *payload,
+      int len, char *dst, int dstLen);
+
+/* Write a C header declaring one struct per message, matching the
+ *   layout schemaDecode produces.
+ */
+void schemaWriteHeader(const struct schema *s, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
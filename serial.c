@@ -4,29 +4,49 @@
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <stdio.h>
+#include <sys/ioctl.h>
 #include "serial.h"
 #include "tcp_serial.h"
+#include "udp_serial.h"
+#include "uring_io.h"
+#include "bufpool.h"
+#include "probes.h"
 
 #define SERIAL_OPEN_FLAGS O_RDWR | O_NOCTTY
-#define READBUFFER_SIZE 4096
-#define WRITEBUFFER_SIZE 4096
+#define SERIAL_DEFAULT_VTIME 1 // Tenths bytes below VMIN wait when vtime is 0
 
 #define PRIV(arg) ((struct serialInterfacePriv *) (arg))
 
 struct serialInterfacePriv {
    int (*cleanup)(struct serialInterfacePriv *self);
    int (*write)(struct serialInterfacePriv *self, void *src, int bytes);
+   struct serialStats *(*stats)(struct serialInterfacePriv *self);
 
    // Private fields
    int fd; // serial device FD
    serialReadCB readCB; // callback up controlling context
    struct EventState *evt_loop; // Pointer to proclib process context
-   char writeBuff[WRITEBUFFER_SIZE]; // Write buffer bytes
-   char readBuff[READBUFFER_SIZE + 1]; // Write buffer bytes
+   char *writeBuff; // Write buffer bytes, borrowed from the pool
+   uint32_t writeCap; // Size of writeBuff
+   uint32_t writeMax; // Largest writeBuff may grow to
+   char *readBuff; // Read buffer bytes, borrowed while holding data
+   uint32_t readSize; // Size of readBuff, its terminator included
+   uint32_t readBase; // readSize to go back to once readBuff is released
    int readBytes;
    uint32_t writeBytes; // Bytes to write field
    void *opaque;
    char *eolMarker;
+   struct uringIO *uring; // io_uring backend, NULL when using fd events
+   struct serialStats st;
+   serialWritableCB writableCB;
+   int writeReg; // Write event handler is registered
+   int blocked; // A write returned SERIAL_WRITE_WOULDBLOCK since last notify
+   int prealloc; // SERIAL_OPT_PREALLOC: buffers come from the reserves below
+   struct bufpoolReserved readRes, writeRes; // This link's alone
+   void *vtimeEvent; // Reads bytes held below VMIN, NULL when not needed
+   void *fallbackEvent; // Moves reads off io_uring after an error
+   uint8_t vmin, vtime; // serialOptions read batching, 0 for off
 };
 
 static int configureSerial(int fd, tcflag_t cflag, speed_t baudrate)
@@ -171,20 +191,64 @@ static speed_t parseBaudrate(uint32_t baudrateInt)
    return baudrate;
 }
 
-static int readEvent(int fd, char type, void *si)
+// Borrow the read buffer from the shared pool, or the link's reserve
+static int acquireReadBuff(struct serialInterface *si)
+{
+   if (PRIV(si)->readBuff)
+      return 0;
+
+   if (PRIV(si)->prealloc)
+      PRIV(si)->readBuff = bufpoolReservedGet(&PRIV(si)->readRes);
+   else
+      PRIV(si)->readBuff = bufpoolGet(PRIV(si)->readSize, NULL);
+   if (!PRIV(si)->readBuff) {
+      DBG_print(DBG_LEVEL_WARN, "Insufficient memory\n");
+      return -1;
+   }
+   PRIV(si)->readBytes = 0;
+
+   return 0;
+}
+
+// Give the read buffer back once it holds no partial line
+static void releaseReadBuff(struct serialInterface *si)
+{
+   if (PRIV(si)->readBuff && PRIV(si)->readBytes == 0) {
+      if (PRIV(si)->prealloc)
+         bufpoolReservedPut(&PRIV(si)->readRes, PRIV(si)->readBuff);
+      else
+         bufpoolPut(PRIV(si)->readBuff, PRIV(si)->readSize);
+      PRIV(si)->readBuff = NULL;
+      // A burst grew it; the next one grows it again if it must
+      PRIV(si)->readSize = PRIV(si)->readBase;
+   }
+}
+
+// Double the read buffer after a read filled it, keeping what it holds
+static int growReadBuff(struct serialInterface *si)
+{
+   char *buff;
+
+   if (PRIV(si)->readSize >= SERIAL_MAX_READ_BUFFER || PRIV(si)->prealloc)
+      return -1;
+
+   buff = bufpoolGet(2 * PRIV(si)->readSize, NULL);
+   if (!buff)
+      return -1;
+   memcpy(buff, PRIV(si)->readBuff, PRIV(si)->readBytes + 1);
+   bufpoolPut(PRIV(si)->readBuff, PRIV(si)->readSize);
+   PRIV(si)->readBuff = buff;
+   PRIV(si)->readSize *= 2;
+
+   return 0;
+}
+
+// Hand bytes newly appended to readBuff to the read callback
+static void deliverRead(struct serialInterface *si, int bytesread)
 {
-   int bytesread;
    char *eol;
    int i;
 
-   // Perform the read
-   bytesread = read(fd, PRIV(si)->readBuff + PRIV(si)->readBytes,
-         READBUFFER_SIZE - PRIV(si)->readBytes);
-   if (bytesread < 0) {
-      DBG_print(DBG_LEVEL_WARN, "Error reading from serial device: %s\n",
-                                 strerror(errno));
-      return EVENT_REMOVE;
-   }
    PRIV(si)->readBytes += bytesread;
    PRIV(si)->readBuff[PRIV(si)->readBytes] = 0;
 
@@ -192,14 +256,16 @@ static int readEvent(int fd, char type, void *si)
    if (PRIV(si)->readCB) {
       // No EOL marker provided, call the callback 
       if (!PRIV(si)->eolMarker) {
+         PRIV(si)->st.framesReceived++;
          PRIV(si)->readCB(PRIV(si)->readBuff, bytesread, PRIV(si)->opaque);
          PRIV(si)->readBytes = 0;
-         return EVENT_KEEP;
+         return;
       }
 
       while ((eol = strstr(PRIV(si)->readBuff, PRIV(si)->eolMarker))) {
          bytesread = eol - PRIV(si)->readBuff;
          *eol = 0;
+         PRIV(si)->st.framesReceived++;
          PRIV(si)->readCB(PRIV(si)->readBuff, bytesread, PRIV(si)->opaque);
          bytesread += strlen(PRIV(si)->eolMarker);
          PRIV(si)->readBytes -= bytesread;
@@ -210,25 +276,287 @@ static int readEvent(int fd, char type, void *si)
    }
    else // Discard all bytes if no read callback
       PRIV(si)->readBytes = 0;
+}
+
+static int readEvent(int fd, char type, void *si)
+{
+   int bytesread, space, avail, reads, limited;
+   char discard[256];
+
+   // Left unread the device stays readable and the loop would spin on it
+   if (acquireReadBuff(si) < 0) {
+      if (read(fd, discard, sizeof(discard)) < 0 && errno != EAGAIN)
+         return EVENT_REMOVE;
+      return EVENT_KEEP;
+   }
+
+   // The first read takes what the wakeup found; after that only bytes
+   // already buffered are read, until none are
+   PRIV(si)->st.readWakeups++;
+   for (reads = 0; reads < SERIAL_MAX_READS_PER_WAKEUP; reads++) {
+      // A line longer than the buffer is discarded if it cannot grow
+      if (PRIV(si)->readBytes == PRIV(si)->readSize - 1 && growReadBuff(si) < 0)
+         PRIV(si)->readBytes = 0;
+      space = PRIV(si)->readSize - 1 - PRIV(si)->readBytes;
+      limited = 0;
+      if (reads > 0) {
+         if (ioctl(fd, FIONREAD, &avail) < 0 || avail <= 0)
+            break;
+         limited = avail < space;
+         if (limited)
+            space = avail;
+      }
+
+      // Perform the read
+      bytesread = read(fd, PRIV(si)->readBuff + PRIV(si)->readBytes, space);
+      PRIV(si)->st.readCalls++;
+      PROBE2(serial_rx, fd, bytesread);
+      if (bytesread < 0 &&
+            (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+         break;
+      if (bytesread < 0) {
+         DBG_print(DBG_LEVEL_WARN, "Error reading from serial device: %s\n",
+                                    strerror(errno));
+         releaseReadBuff(si);
+         return EVENT_REMOVE;
+      }
+      PRIV(si)->st.bytesReceived += bytesread;
+      deliverRead(si, bytesread);
+
+      if (bytesread == 0)
+         break;
+      if (bytesread == space && !limited)
+         growReadBuff(si);
+   }
+   releaseReadBuff(si);
+
+   return EVENT_KEEP;
+}
+
+// Bytes below VMIN never make the device readable; pick them up anyway
+static int vtimeEvent(void *si)
+{
+   int avail;
+
+   if (ioctl(PRIV(si)->fd, FIONREAD, &avail) == 0 && avail > 0)
+      readEvent(PRIV(si)->fd, EVENT_FD_READ, si);
 
    return EVENT_KEEP;
 }
 
+// Batch receive wakeups to VMIN bytes.  io_uring reads block in a kernel
+// worker, where termios VMIN and VTIME apply as they are.  The event loop
+// must not block: there poll waits for VMIN bytes (VTIME 0), the fd is
+// non-blocking, and bytes below VMIN are read off a VTIME loop timer.
+static int setReadBatching(struct serialInterface *si)
+{
+   struct termios tty;
+   int vtime = PRIV(si)->vtime ? PRIV(si)->vtime : SERIAL_DEFAULT_VTIME;
+
+   if (!PRIV(si)->vmin && !PRIV(si)->vtime)
+      return 0;
+   if (0 != tcgetattr(PRIV(si)->fd, &tty))
+      return -1;
+   tty.c_cc[VMIN] = PRIV(si)->vmin ? PRIV(si)->vmin : 1;
+   tty.c_cc[VTIME] = PRIV(si)->uring ? vtime : 0;
+   if (0 != tcsetattr(PRIV(si)->fd, TCSANOW, &tty))
+      return -1;
+
+   if (!PRIV(si)->uring && PRIV(si)->vmin > 1 && !PRIV(si)->vtimeEvent)
+      PRIV(si)->vtimeEvent = EVT_sched_add(PRIV(si)->evt_loop,
+            EVT_ms2tv(vtime * 100), &vtimeEvent, si);
+
+   return 0;
+}
+
+static void uringReadEvent(void *buffer, int bytes, void *si)
+{
+   int chunk;
+
+   PROBE2(serial_rx, PRIV(si)->fd, bytes);
+   PRIV(si)->st.bytesReceived += bytes;
+   PRIV(si)->st.readWakeups++;
+   PRIV(si)->st.readCalls++;
+
+   // Without an EOL marker the completion buffer can go straight up
+   if (!PRIV(si)->eolMarker) {
+      PRIV(si)->st.framesReceived++;
+      if (PRIV(si)->readCB)
+         PRIV(si)->readCB(buffer, bytes, PRIV(si)->opaque);
+      return;
+   }
+
+   if (acquireReadBuff(si) < 0)
+      return;
+
+   while (bytes > 0) {
+      chunk = PRIV(si)->readSize - 1 - PRIV(si)->readBytes;
+      if (chunk == 0) {
+         // Line longer than the buffer, discard what we have so far
+         PRIV(si)->readBytes = 0;
+         chunk = PRIV(si)->readSize - 1;
+      }
+      if (chunk > bytes)
+         chunk = bytes;
+      memcpy(PRIV(si)->readBuff + PRIV(si)->readBytes, buffer, chunk);
+      deliverRead(si, chunk);
+      buffer = (char *)buffer + chunk;
+      bytes -= chunk;
+   }
+   releaseReadBuff(si);
+}
+
+// Return the drained write buffer to the shared pool, or the reserve
+static void releaseWriteBuff(struct serialInterface *si)
+{
+   if (PRIV(si)->prealloc)
+      bufpoolReservedPut(&PRIV(si)->writeRes, PRIV(si)->writeBuff);
+   else
+      bufpoolPut(PRIV(si)->writeBuff, PRIV(si)->writeCap);
+   PRIV(si)->writeBuff = NULL;
+   PRIV(si)->writeCap = 0;
+}
+
+// Make room for need bytes, moving to a larger pooled buffer if required
+static int growWriteBuff(struct serialInterface *si, uint32_t need)
+{
+   char *buff;
+   uint32_t cap;
+
+   if (need <= PRIV(si)->writeCap)
+      return 0;
+   // The one reserved buffer is writeMax bytes, so it never has to grow
+   if (PRIV(si)->prealloc) {
+      PRIV(si)->writeBuff = bufpoolReservedGet(&PRIV(si)->writeRes);
+      PRIV(si)->writeCap = PRIV(si)->writeMax;
+      return PRIV(si)->writeBuff ? 0 : -1;
+   }
+
+   buff = bufpoolGet(need, &cap);
+   if (!buff) {
+      DBG_print(DBG_LEVEL_WARN, "Insufficient memory\n");
+      return -1;
+   }
+   if (cap > PRIV(si)->writeMax)
+      cap = PRIV(si)->writeMax;
+
+   if (PRIV(si)->writeBytes)
+      memcpy(buff, PRIV(si)->writeBuff, PRIV(si)->writeBytes);
+   bufpoolPut(PRIV(si)->writeBuff, PRIV(si)->writeCap);
+   PRIV(si)->writeBuff = buff;
+   PRIV(si)->writeCap = cap;
+
+   return 0;
+}
+
+static void notifyWritable(struct serialInterfacePriv *self)
+{
+   if (!self->writableCB)
+      return;
+   if (self->writeBytes && (!self->blocked ||
+         self->writeBytes > self->writeMax / 2))
+      return;
+
+   self->blocked = 0;
+   self->writableCB(self->writeBytes, self->opaque);
+}
+
+// Read from the device with fd events, as if io_uring had never been used
+static void startFdReads(struct serialInterface *si)
+{
+   fcntl(PRIV(si)->fd, F_SETFL, fcntl(PRIV(si)->fd, F_GETFL) | O_NONBLOCK);
+   EVT_fd_add(PRIV(si)->evt_loop, PRIV(si)->fd, EVENT_FD_READ, readEvent, si);
+   if (setReadBatching(si) < 0)
+      DBG_print(DBG_LEVEL_WARN, "Unable to set VMIN/VTIME: %s\n",
+                                 strerror(errno));
+}
+
+// io_uring stopped reading; carry on with fd events.  Writes it still
+// held are lost, as on any failed write.
+static int uringFallbackEvent(void *si)
+{
+   PRIV(si)->fallbackEvent = NULL;
+   if (uringIOQueued(PRIV(si)->uring) > 0) {
+      PRIV(si)->st.droppedWrites++;
+      serialStatsQueue(&PRIV(si)->st, 0);
+   }
+   uringIODestroy(PRIV(si)->uring);
+   PRIV(si)->uring = NULL;
+   startFdReads(si);
+   notifyWritable(PRIV(si));
+
+   return EVENT_REMOVE;
+}
+
+static void uringErrorEvent(int err, void *si)
+{
+   PROBE2(serial_rx, PRIV(si)->fd, err ? -1 : 0);
+   DBG_print(DBG_LEVEL_WARN, "Error reading from serial device: %s\n",
+                              err ? strerror(err) : "end of file");
+
+   // The context can't be freed from inside its own completion handler.
+   // End of file means the device is gone, which fd events won't change.
+   if (err && !PRIV(si)->fallbackEvent)
+      PRIV(si)->fallbackEvent = EVT_sched_add(PRIV(si)->evt_loop,
+            EVT_ms2tv(0), &uringFallbackEvent, si);
+}
+
+static void uringWritableEvent(int written, int queued, void *si)
+{
+   PROBE3(serial_tx, PRIV(si)->fd, written, queued);
+   // Counted once the device has the bytes, as on the fd path
+   if (written > 0)
+      PRIV(si)->st.bytesSent += written;
+   serialStatsQueue(&PRIV(si)->st, queued);
+   if (PRIV(si)->writableCB && (queued == 0 || PRIV(si)->blocked)) {
+      PRIV(si)->blocked = 0;
+      PRIV(si)->writableCB(queued, PRIV(si)->opaque);
+   }
+}
+
 static int writeEvent(int fd, char type, void *si)
 {
-   if (PRIV(si)->writeBytes == 0)
+   int res;
+
+   if (PRIV(si)->writeBytes == 0) {
+      PRIV(si)->writeReg = 0;
       return EVENT_REMOVE;
+   }
 
    // Perform the write
-   if (-1 == write(PRIV(si)->fd, PRIV(si)->writeBuff, PRIV(si)->writeBytes)) {
+   res = write(PRIV(si)->fd, PRIV(si)->writeBuff, PRIV(si)->writeBytes);
+   PROBE3(serial_tx, PRIV(si)->fd, res,
+         res > 0 ? PRIV(si)->writeBytes - res : PRIV(si)->writeBytes);
+   if (-1 == res && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      return EVENT_KEEP;
+   if (-1 == res) {
       DBG_print(DBG_LEVEL_WARN, "Error writing to serial device: %s\n",
                                  strerror(errno));
+      PRIV(si)->st.droppedWrites++;
       PRIV(si)->writeBytes = 0;
-      return EVENT_REMOVE;
+      serialStatsQueue(&PRIV(si)->st, 0);
+      releaseWriteBuff(si);
+   }
+   else {
+      PRIV(si)->st.bytesSent += res;
+      if (res < PRIV(si)->writeBytes) {
+         // Keep the tail; the device takes it on the next writable event
+         PRIV(si)->st.shortWrites++;
+         memmove(PRIV(si)->writeBuff, PRIV(si)->writeBuff + res,
+               PRIV(si)->writeBytes - res);
+      }
+      PRIV(si)->writeBytes -= res;
+      serialStatsQueue(&PRIV(si)->st, PRIV(si)->writeBytes);
+      if (PRIV(si)->writeBytes == 0)
+         releaseWriteBuff(si);
    }
 
-   PRIV(si)->writeBytes = 0;
+   // The callback may queue more, which must keep this handler alive
+   notifyWritable(PRIV(si));
+   if (PRIV(si)->writeBytes)
+      return EVENT_KEEP;
 
+   PRIV(si)->writeReg = 0;
    return EVENT_REMOVE;
 }
 
@@ -237,6 +565,22 @@ static int serialCleanup(struct serialInterface *si)
    if (PRIV(si)->eolMarker)
       free(PRIV(si)->eolMarker);
 
+   if (PRIV(si)->uring)
+      uringIODestroy(PRIV(si)->uring);
+   if (PRIV(si)->vtimeEvent)
+      EVT_sched_remove(PRIV(si)->evt_loop, PRIV(si)->vtimeEvent);
+   if (PRIV(si)->fallbackEvent)
+      EVT_sched_remove(PRIV(si)->evt_loop, PRIV(si)->fallbackEvent);
+
+   PRIV(si)->readBytes = 0;
+   releaseReadBuff(si);
+   releaseWriteBuff(si);
+
+   if (PRIV(si)->prealloc) {
+      bufpoolUnreserve(&PRIV(si)->readRes);
+      bufpoolUnreserve(&PRIV(si)->writeRes);
+   }
+
    // Close the serial port file
    if (-1 == close(PRIV(si)->fd)) {
       DBG_print(DBG_LEVEL_WARN, "Unable to close serial device: %s\n",
@@ -249,29 +593,122 @@ static int serialCleanup(struct serialInterface *si)
    return 0;
 }
 
-static int serialWrite(struct serialInterface *si, void *src, int bytes)
+static struct serialStats *serialGetStats(struct serialInterface *si)
 {
-   if (bytes > (WRITEBUFFER_SIZE - PRIV(si)->writeBytes) ) {
+   return &PRIV(si)->st;
+}
+
+int serialStatsFormat(const struct serialStats *st, const char *label,
+      char *buf, int len)
+{
+   const char *sep = label ? "." : "";
+   int res;
+
+   if (!label)
+      label = "";
+
+   res = snprintf(buf, len,
+         "%s%sbytes_sent %llu\n"
+         "%s%sbytes_received %llu\n"
+         "%s%sframes_sent %llu\n"
+         "%s%sframes_received %llu\n"
+         "%s%sshort_writes %llu\n"
+         "%s%sdropped_writes %llu\n"
+         "%s%sblocked_writes %llu\n"
+         "%s%scrc_errors %llu\n"
+         "%s%sframing_errors %llu\n"
+         "%s%sreconnects %llu\n"
+         "%s%sconnect_time_us %llu\n"
+         "%s%sfailovers %llu\n"
+         "%s%sfailover_time_us %llu\n"
+         "%s%sread_wakeups %llu\n"
+         "%s%sread_calls %llu\n"
+         "%s%squeue_depth %u\n"
+         "%s%squeue_peak %u\n",
+         label, sep, (unsigned long long)st->bytesSent,
+         label, sep, (unsigned long long)st->bytesReceived,
+         label, sep, (unsigned long long)st->framesSent,
+         label, sep, (unsigned long long)st->framesReceived,
+         label, sep, (unsigned long long)st->shortWrites,
+         label, sep, (unsigned long long)st->droppedWrites,
+         label, sep, (unsigned long long)st->blockedWrites,
+         label, sep, (unsigned long long)st->crcErrors,
+         label, sep, (unsigned long long)st->framingErrors,
+         label, sep, (unsigned long long)st->reconnects,
+         label, sep, (unsigned long long)st->connectTimeUs,
+         label, sep, (unsigned long long)st->failovers,
+         label, sep, (unsigned long long)st->failoverTimeUs,
+         label, sep, (unsigned long long)st->readWakeups,
+         label, sep, (unsigned long long)st->readCalls,
+         label, sep, st->queueDepth,
+         label, sep, st->queuePeak);
+
+   if (res >= len)
+      res = len > 0 ? len - 1 : 0;
+   return res;
+}
+
+static int serialQueue(struct serialInterface *si, void *src, int bytes)
+{
+   if (PRIV(si)->uring) {
+      // writeMax is the high-water mark when one is set
+      if (bytes > PRIV(si)->writeMax || bytes > uringIOCapacity()) {
+         PRIV(si)->st.droppedWrites++;
+         return SERIAL_WRITE_DROPPED;
+      }
+      if (uringIOQueued(PRIV(si)->uring) + bytes > PRIV(si)->writeMax ||
+            uringIOWrite(PRIV(si)->uring, src, bytes) < 0) {
+         PRIV(si)->st.blockedWrites++;
+         PRIV(si)->blocked = 1;
+         return SERIAL_WRITE_WOULDBLOCK;
+      }
+      PRIV(si)->st.framesSent++;
+      return SERIAL_WRITE_QUEUED;
+   }
+
+   if (bytes > PRIV(si)->writeMax) {
       DBG_print(DBG_LEVEL_WARN,
                   "Cannot write %i bytes, write buffer size = %i\n",
-                  bytes, WRITEBUFFER_SIZE - PRIV(si)->writeBytes);
-      return -1;
+                  bytes, PRIV(si)->writeMax);
+      PRIV(si)->st.droppedWrites++;
+      return SERIAL_WRITE_DROPPED;
    }
 
-   int regCallback = 0 == PRIV(si)->writeBytes;
+   if (bytes > (PRIV(si)->writeMax - PRIV(si)->writeBytes) ) {
+      PRIV(si)->st.blockedWrites++;
+      PRIV(si)->blocked = 1;
+      return SERIAL_WRITE_WOULDBLOCK;
+   }
+
+   if (-1 == growWriteBuff(si, PRIV(si)->writeBytes + bytes)) {
+      PRIV(si)->st.droppedWrites++;
+      return SERIAL_WRITE_DROPPED;
+   }
 
    memcpy(&PRIV(si)->writeBuff[PRIV(si)->writeBytes], src, bytes);
    PRIV(si)->writeBytes += bytes;
+   PRIV(si)->st.framesSent++;
+   serialStatsQueue(&PRIV(si)->st, PRIV(si)->writeBytes);
 
    // Register write callback event handler
-   if (regCallback)
+   if (!PRIV(si)->writeReg) {
       EVT_fd_add(PRIV(si)->evt_loop,
                  PRIV(si)->fd,
                  EVENT_FD_WRITE,
                  writeEvent,
                  (void *) si);
+      PRIV(si)->writeReg = 1;
+   }
 
-   return 0;
+   return SERIAL_WRITE_QUEUED;
+}
+
+static int serialWrite(struct serialInterface *si, void *src, int bytes)
+{
+   int res = serialQueue(si, src, bytes);
+
+   PROBE4(serial_enqueue, PRIV(si)->fd, bytes, PRIV(si)->writeBytes, res);
+   return res;
 }
 
 int serialInit(struct serialInterface **si,
@@ -282,13 +719,36 @@ int serialInit(struct serialInterface **si,
                   int baudRate,
                   const char *eolMarker,
                   void *opaque)
+{
+   return serialInitOpts(si, evt_loop, readCallback, connectCallback,
+         devFile, baudRate, eolMarker, opaque, NULL);
+}
+
+int serialInitOpts(struct serialInterface **si,
+                  struct EventState *evt_loop,
+                  serialReadCB readCallback,
+                  serialConnectCB connectCallback,
+                  const char *devFile,
+                  int baudRate,
+                  const char *eolMarker,
+                  void *opaque,
+                  const struct serialOptions *opts)
 {
    tcflag_t cflag;
    speed_t baudrate;
+   int res;
 
    if (devFile && 0 == strncasecmp("tcp://", devFile, 6))
       return tcpSerialInit(si, evt_loop, readCallback, connectCallback,
-            devFile, baudRate, eolMarker, opaque);
+            devFile, baudRate, eolMarker, opaque, opts);
+
+   if (devFile && 0 == strncasecmp("unix://", devFile, 7))
+      return unixSerialInit(si, evt_loop, readCallback, connectCallback,
+            devFile, baudRate, eolMarker, opaque, opts);
+
+   if (devFile && 0 == strncasecmp("udp://", devFile, 6))
+      return udpSerialInit(si, evt_loop, readCallback, connectCallback,
+            devFile, baudRate, eolMarker, opaque, opts);
 
    cflag = parseCFlag("CS8");
    baudrate = parseBaudrate(baudRate);
@@ -324,17 +784,69 @@ int serialInit(struct serialInterface **si,
 
    (*si)->write = serialWrite;
    (*si)->cleanup = serialCleanup;
+   (*si)->stats = serialGetStats;
+   memset(&PRIV(*si)->st, 0, sizeof(PRIV(*si)->st));
    PRIV(*si)->readCB = readCallback;
    PRIV(*si)->evt_loop = evt_loop;
    PRIV(*si)->opaque = opaque;
    PRIV(*si)->readBytes = 0;
+   PRIV(*si)->writeBytes = 0;
+   PRIV(*si)->uring = NULL;
+   PRIV(*si)->readBuff = NULL;
+   PRIV(*si)->writeBuff = NULL;
+   PRIV(*si)->writeCap = 0;
+   PRIV(*si)->readSize = SERIAL_DEFAULT_BUFFER_SIZE;
+   PRIV(*si)->writeMax = SERIAL_DEFAULT_BUFFER_SIZE;
+   PRIV(*si)->writableCB = NULL;
+   PRIV(*si)->writeReg = 0;
+   PRIV(*si)->blocked = 0;
+   PRIV(*si)->vtimeEvent = NULL;
+   PRIV(*si)->fallbackEvent = NULL;
+   PRIV(*si)->vmin = opts ? opts->vmin : 0;
+   PRIV(*si)->vtime = opts ? opts->vtime : 0;
+   // One byte of the buffer holds the terminator
+   if (opts && opts->readBufferSize > 1)
+      PRIV(*si)->readSize = opts->readBufferSize;
+   PRIV(*si)->readBase = PRIV(*si)->readSize;
+   if (opts && opts->writeBufferSize)
+      PRIV(*si)->writeMax = opts->writeBufferSize;
+   // The device buffer is the queue, so a high-water mark overrides its size
+   if (opts && opts->highWater)
+      PRIV(*si)->writeMax = opts->highWater;
+   if (opts)
+      PRIV(*si)->writableCB = opts->writableCallback;
+
+   PRIV(*si)->prealloc = 0;
+   if (opts && (opts->flags & SERIAL_OPT_PREALLOC)) {
+      res = bufpoolReserve(&PRIV(*si)->readRes, PRIV(*si)->readBase, 1);
+      if (res == 0 &&
+            bufpoolReserve(&PRIV(*si)->writeRes, PRIV(*si)->writeMax, 1) < 0) {
+         bufpoolUnreserve(&PRIV(*si)->readRes);
+         res = -1;
+      }
+      if (res < 0) {
+         DBG_print(DBG_LEVEL_WARN, "Insufficient memory\n");
+         close(PRIV(*si)->fd);
+         free(PRIV(*si)->eolMarker);
+         free(*si);
+         *si = NULL;
+         return -1;
+      }
+      PRIV(*si)->prealloc = 1;
+   }
+
+   if (opts && (opts->flags & SERIAL_OPT_URING))
+      PRIV(*si)->uring = uringIOCreate(evt_loop, PRIV(*si)->fd, 0,
+            &uringReadEvent, &uringErrorEvent, *si);
+   if (PRIV(*si)->uring)
+      uringIOSetWritableCB(PRIV(*si)->uring, &uringWritableEvent);
 
    // Register read callback event handler
-   EVT_fd_add(evt_loop,
-                 PRIV(*si)->fd,
-                 EVENT_FD_READ,
-                 readEvent,
-                 (void *) *si);
+   if (!PRIV(*si)->uring)
+      startFdReads(*si);
+   else if (setReadBatching(*si) < 0)
+      DBG_print(DBG_LEVEL_WARN, "Unable to set VMIN/VTIME: %s\n",
+                                 strerror(errno));
 
    if (connectCallback)
       connectCallback(1, opaque);
@@ -1,12 +1,43 @@
 #ifndef SERIAL_H
 #define SERIAL_H
 
+#include <stdint.h>
 #include <polysat/polysat.h>
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// Results returned by serialInterface write
+#define SERIAL_WRITE_QUEUED 0      // Accepted; it will be transmitted
+#define SERIAL_WRITE_DROPPED -1    // Discarded: not connected, error or memory
+#define SERIAL_WRITE_WOULDBLOCK -2 // Queue at its high-water mark; nothing
+                                   //   was queued, retry once writable
+
+// Transmit queue limit for socket links when serialOptions leaves it at 0
+#define SERIAL_DEFAULT_QUEUE_LIMIT (64 * 1024)
+
+// Link statistics counters. Cheap enough to be always on.
+struct serialStats {
+   uint64_t bytesSent;     // Bytes accepted by the kernel
+   uint64_t bytesReceived;
+   uint64_t framesSent;    // Writes accepted by the interface
+   uint64_t framesReceived; // Read callback invocations
+   uint64_t shortWrites;   // Write syscalls that took fewer bytes than asked
+   uint64_t droppedWrites; // Writes discarded instead of queued or sent
+   uint64_t blockedWrites; // Writes refused with SERIAL_WRITE_WOULDBLOCK
+   uint64_t crcErrors;     // Set by the consumer, on the event loop thread
+   uint64_t framingErrors; // Set by the consumer, on the event loop thread
+   uint64_t reconnects;    // Times the link went down and was retried
+   uint64_t connectTimeUs; // Last connect; under TFO to the first byte in
+   uint64_t failovers;     // Times traffic moved to a standby endpoint
+   uint64_t failoverTimeUs; // Failure detection to queue moved, last time
+   uint64_t readWakeups;   // Read events handled
+   uint64_t readCalls;     // read() calls made for them
+   uint32_t queueDepth;    // Bytes waiting to be transmitted
+   uint32_t queuePeak;     // Largest queueDepth seen
+};
+
 // Generic interface for a serial device.
 struct serialInterface {
 
@@ -14,7 +45,8 @@ struct serialInterface {
     * @param self a reference to the serial device being written to.
     * @param src a pointer to the bytes to be written.
     * @param bytes the number of bytes to write.
-    * @return -1 on error, 0 on success. Check /var/log/syslog on error.
+    * @return SERIAL_WRITE_QUEUED, SERIAL_WRITE_DROPPED or
+    *    SERIAL_WRITE_WOULDBLOCK.  The write is all or nothing.
     */
    int (*write)(struct serialInterface *self, void *src, int bytes);
 
@@ -23,8 +55,35 @@ struct serialInterface {
     * @return -1 on error, 0 on success. Check /var/log/syslog on error.
     */
    int (*cleanup)(struct serialInterface *self);
+
+   /* Get the link statistics counters.
+    * @param self a reference to the serial device.
+    * @return counters owned by the interface, valid until cleanup.
+    */
+   struct serialStats *(*stats)(struct serialInterface *self);
 };
 
+/* Format link statistics as "key value" lines.
+ * @param st the counters to format.
+ * @param label prefix for every key, typically the link URL. May be NULL.
+ * @param buf destination buffer.
+ * @param len size of buf.
+ * @return the number of characters written, excluding the terminator.
+ */
+int serialStatsFormat(const struct serialStats *st, const char *label,
+      char *buf, int len);
+
+/* Update queueDepth and queuePeak after the transmit queue changes.
+ * @param st the counters to update.
+ * @param depth the number of bytes now queued.
+ */
+static inline void serialStatsQueue(struct serialStats *st, uint32_t depth)
+{
+   st->queueDepth = depth;
+   if (depth > st->queuePeak)
+      st->queuePeak = depth;
+}
+
 /* Type definition of read callback for serial interface.
  * @param buffer a pointer to the bytes read.
  * @param bytes the number of bytes read.
@@ -38,6 +97,57 @@ typedef void (*serialReadCB)(void *buffer, int bytes, void *opaque);
  */
 typedef void (*serialConnectCB)(int status, void *opaque);
 
+/* Type definition of writable callback for serial interface.  Called when
+ *   the transmit queue empties, and when it falls to half the high-water
+ *   mark after a write returned SERIAL_WRITE_WOULDBLOCK.  Writing from
+ *   inside the callback is allowed.
+ * @param queued the number of bytes still queued.
+ * @param opaque user supplied argument
+ */
+typedef void (*serialWritableCB)(uint32_t queued, void *opaque);
+
+// Use the io_uring transport backend when the kernel supports it
+#define SERIAL_OPT_URING 0x0001
+// Use SOCK_SEQPACKET for unix:// links so frame boundaries are kept
+#define SERIAL_OPT_SEQPACKET 0x0002
+/* Use TCP Fast Open for tcp:// links so the first write rides in the SYN,
+ *   connect from inside the constructor, and notify and write without
+ *   waiting on the event loop.  Falls back to a plain connect. */
+#define SERIAL_OPT_FASTOPEN 0x0004
+/* Reserve the link's own read and write buffers when it is created, so
+ *   steady state traffic makes no malloc or free calls.  Socket links
+ *   queue at most SERIAL_PREALLOC_NODES writes of up to
+ *   SERIAL_PREALLOC_NODE_SIZE bytes each; more are refused with
+ *   SERIAL_WRITE_WOULDBLOCK, and a larger write with SERIAL_WRITE_DROPPED.
+ *   Read buffers no longer grow. */
+#define SERIAL_OPT_PREALLOC 0x0008
+#define SERIAL_PREALLOC_NODES 64
+#define SERIAL_PREALLOC_NODE_SIZE 1024 // Write node bytes, header included
+
+struct netOps;
+
+// Optional settings for serialInitOpts. A NULL pointer selects the defaults.
+struct serialOptions {
+   uint32_t flags; // Bitwise OR of SERIAL_OPT_* values
+   uint32_t readBufferSize; // Receive buffer bytes, 0 for the default
+   uint32_t writeBufferSize; // Serial device transmit buffer, 0 for default
+   uint32_t highWater; // Most bytes queued for transmit, 0 for the default
+   serialWritableCB writableCallback; // Gets the constructor's opaque
+   const char *standby; // Space separated host:port hot standbys for tcp://
+   const struct netOps *netOps; // Socket link system layer, NULL for real
+   uint32_t rcvLowat; // Socket links: SO_RCVLOWAT, bytes before a wakeup
+   uint32_t busyPollUs; // Socket links: SO_BUSY_POLL, 0 for off
+   uint8_t vmin, vtime; // Serial devices: wake for VMIN bytes, read fewer
+                        //   after VTIME tenths (0 for 1); both 0 for off
+};
+
+// Buffer sizes used when serialOptions leaves them at 0
+#define SERIAL_DEFAULT_BUFFER_SIZE 4096
+// A read buffer that a burst fills is doubled, up to this size
+#define SERIAL_MAX_READ_BUFFER (64 * 1024)
+// Reads per wakeup while draining, so one busy link cannot starve others
+#define SERIAL_MAX_READS_PER_WAKEUP 64
+
 /* Constructor for serial interface
  * @param si double pointer to the serial interface struct that will be
  *             allocated on a succesful call to serialInit.
@@ -57,6 +167,21 @@ int serialInit(struct serialInterface **si,
                   const char *eolMarker,
                   void *opaque);
 
+/* Constructor for serial interface with optional settings.  Parameters are
+ *   the same as serialInit.
+ * @param opts optional settings, or NULL for the defaults.
+ * @return -1 on error, 0 on success. Check /var/log/syslog on error.
+ */
+int serialInitOpts(struct serialInterface **si,
+                  struct EventState *evl_loop,
+                  serialReadCB readCallback,
+                  serialConnectCB connectCallback,
+                  const char *deviceFile,
+                  int baudRate,
+                  const char *eolMarker,
+                  void *opaque,
+                  const struct serialOptions *opts);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,443 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "spsc.h"
+#include "shard.h"
+
+#define SHARD_QUEUE_SLOTS 1024
+#define SHARD_SLOT_SIZE 4096
+#define SHARD_MAX_PENDING 256
+
+// Queue record handed from the submitting thread to a shard
+struct shardCmd {
+   uint32_t link;
+   uint32_t len;
+   uint64_t submitNs;
+   char data[];
+};
+
+// Command held by a shard until its link connects or has room
+struct pendingCmd {
+   struct pendingCmd *next;
+   uint64_t submitNs;
+   int len;
+   char data[];
+};
+
+struct shard {
+   struct shardPool *pool;
+   EVTHandler *evt;
+   pthread_t thread;
+   int started;
+   int efd; // Signalled when the queue goes from empty to non-empty
+   volatile int stop;
+   struct spscRing *ring;
+   struct shardStats st;
+};
+
+struct shardLink {
+   struct shard *shard;
+   struct serialInterface *si;
+   int connected;
+   serialReadCB readCB;
+   serialConnectCB connectCB;
+   serialWritableCB writableCB;
+   void *opaque;
+   struct pendingCmd *pending, *pendingTail;
+   int pendingCount;
+};
+
+struct shardPool {
+   int nshards;
+   struct shard *shards;
+   struct shardLink **links;
+   int nlinks;
+   int running;
+};
+
+static uint64_t nowNs(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Returns SERIAL_WRITE_WOULDBLOCK when the caller should hold the command
+static int shardWrite(struct shardLink *link, const void *data, int len,
+      uint64_t submitNs)
+{
+   struct shardStats *st = &link->shard->st;
+   uint64_t lat;
+   int res;
+
+   res = link->si->write(link->si, (void *)data, len);
+   if (res == SERIAL_WRITE_WOULDBLOCK)
+      return res;
+   if (res < 0) {
+      __atomic_fetch_add(&st->dropped, 1, __ATOMIC_RELAXED);
+      return res;
+   }
+
+   lat = nowNs() - submitNs;
+   __atomic_fetch_add(&st->commands, 1, __ATOMIC_RELAXED);
+   __atomic_fetch_add(&st->latencySumNs, lat, __ATOMIC_RELAXED);
+   if (lat > st->latencyMaxNs)
+      __atomic_store_n(&st->latencyMaxNs, lat, __ATOMIC_RELAXED);
+
+   return SERIAL_WRITE_QUEUED;
+}
+
+static void shardHold(struct shardLink *link, const struct shardCmd *cmd)
+{
+   struct pendingCmd *pc;
+
+   if (link->pendingCount >= SHARD_MAX_PENDING ||
+         !(pc = malloc(sizeof(*pc) + cmd->len))) {
+      __atomic_fetch_add(&link->shard->st.dropped, 1, __ATOMIC_RELAXED);
+      return;
+   }
+
+   pc->next = NULL;
+   pc->submitNs = cmd->submitNs;
+   pc->len = cmd->len;
+   memcpy(pc->data, cmd->data, cmd->len);
+   if (link->pendingTail)
+      link->pendingTail->next = pc;
+   else
+      link->pending = pc;
+   link->pendingTail = pc;
+   link->pendingCount++;
+}
+
+static void shardFlushPending(struct shardLink *link)
+{
+   struct pendingCmd *pc;
+
+   while (link->connected && (pc = link->pending)) {
+      // Stays at the head until the link's writable callback fires
+      if (shardWrite(link, pc->data, pc->len, pc->submitNs) ==
+            SERIAL_WRITE_WOULDBLOCK)
+         break;
+      link->pending = pc->next;
+      if (!link->pending)
+         link->pendingTail = NULL;
+      link->pendingCount--;
+      free(pc);
+   }
+}
+
+static void shardWritableCB(uint32_t queued, void *arg)
+{
+   struct shardLink *link = (struct shardLink *)arg;
+
+   shardFlushPending(link);
+   if (link->writableCB)
+      link->writableCB(queued, link->opaque);
+}
+
+static void shardReadCB(void *buffer, int bytes, void *arg)
+{
+   struct shardLink *link = (struct shardLink *)arg;
+
+   if (link->readCB)
+      link->readCB(buffer, bytes, link->opaque);
+}
+
+static void shardConnectCB(int status, void *arg)
+{
+   struct shardLink *link = (struct shardLink *)arg;
+
+   link->connected = status;
+   if (link->connectCB)
+      link->connectCB(status, link->opaque);
+   if (status && link->si)
+      shardFlushPending(link);
+}
+
+static int shardQueueEvent(int fd, char type, void *arg)
+{
+   struct shard *sh = (struct shard *)arg;
+   struct shardCmd *cmd;
+   struct shardLink *link;
+   uint64_t val;
+   void *buf;
+
+   if (read(sh->efd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+      return EVENT_KEEP;
+
+   for (;;) {
+      if (spscPeek(sh->ring, &buf) < 0) {
+         // Publish our tail before the final look so a racing submit
+         // either sees the ring empty and signals, or we see its record
+         __atomic_thread_fence(__ATOMIC_SEQ_CST);
+         if (spscPeek(sh->ring, &buf) < 0)
+            break;
+      }
+
+      cmd = (struct shardCmd *)buf;
+      link = sh->pool->links[cmd->link];
+      if (!link->connected || link->pending ||
+            shardWrite(link, cmd->data, cmd->len, cmd->submitNs) ==
+            SERIAL_WRITE_WOULDBLOCK)
+         shardHold(link, cmd);
+      spscRelease(sh->ring);
+   }
+
+   if (__atomic_load_n(&sh->stop, __ATOMIC_ACQUIRE))
+      EVT_exit_loop(sh->evt);
+
+   return EVENT_KEEP;
+}
+
+static void *shardMain(void *arg)
+{
+   struct shard *sh = (struct shard *)arg;
+
+   EVT_start_loop(sh->evt);
+
+   return NULL;
+}
+
+struct shardPool *shardPoolCreate(int shards)
+{
+   struct shardPool *pool;
+   struct shard *sh;
+   void *mem;
+   int i;
+
+   if (shards < 1)
+      return NULL;
+
+   pool = (struct shardPool *)calloc(1, sizeof(*pool));
+   if (!pool) {
+      DBG_print(DBG_LEVEL_WARN, "Insufficient memory\n");
+      return NULL;
+   }
+   pool->shards = (struct shard *)calloc(shards, sizeof(struct shard));
+   if (!pool->shards) {
+      DBG_print(DBG_LEVEL_WARN, "Insufficient memory\n");
+      free(pool);
+      return NULL;
+   }
+
+   for (i = 0; i < shards; i++, pool->nshards++) {
+      sh = &pool->shards[i];
+      sh->pool = pool;
+      sh->efd = -1;
+
+      if (posix_memalign(&mem, SPSC_CACHELINE,
+               spscSize(SHARD_QUEUE_SLOTS, SHARD_SLOT_SIZE))) {
+         DBG_print(DBG_LEVEL_WARN, "Insufficient memory\n");
+         break;
+      }
+      sh->ring = spscInit(mem, SHARD_QUEUE_SLOTS, SHARD_SLOT_SIZE);
+
+      sh->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+      sh->evt = EVT_create_handler();
+      if (sh->efd < 0 || !sh->evt) {
+         DBG_print(DBG_LEVEL_WARN, "Unable to create shard event loop\n");
+         break;
+      }
+      EVT_fd_add(sh->evt, sh->efd, EVENT_FD_READ, &shardQueueEvent, sh);
+   }
+
+   if (pool->nshards < shards) {
+      // Include the partially built shard in the teardown
+      pool->nshards++;
+      shardPoolStop(pool);
+      return NULL;
+   }
+
+   return pool;
+}
+
+int shardPoolAddLink(struct shardPool *pool,
+                  serialReadCB readCallback,
+                  serialConnectCB connectCallback,
+                  const char *devFile,
+                  int baudRate,
+                  const char *eolMarker,
+                  void *opaque,
+                  const struct serialOptions *opts)
+{
+   struct shardLink *link, **links;
+   struct serialOptions linkOpts;
+   struct shard *sh;
+   int i;
+
+   if (pool->running)
+      return -1;
+
+   // Least loaded by link count
+   sh = &pool->shards[0];
+   for (i = 1; i < pool->nshards; i++)
+      if (pool->shards[i].st.links < sh->st.links)
+         sh = &pool->shards[i];
+
+   links = realloc(pool->links, (pool->nlinks + 1) * sizeof(*links));
+   link = (struct shardLink *)calloc(1, sizeof(*link));
+   if (!links || !link) {
+      DBG_print(DBG_LEVEL_WARN, "Insufficient memory\n");
+      if (links)
+         pool->links = links;
+      free(link);
+      return -1;
+   }
+   pool->links = links;
+
+   link->shard = sh;
+   link->readCB = readCallback;
+   link->connectCB = connectCallback;
+   link->opaque = opaque;
+
+   // Commands refused for backpressure are retried from the link's
+   // writable callback before the caller's own is chained
+   memset(&linkOpts, 0, sizeof(linkOpts));
+   if (opts)
+      linkOpts = *opts;
+   link->writableCB = linkOpts.writableCallback;
+   linkOpts.writableCallback = &shardWritableCB;
+
+   // The loop isn't running yet, so this thread may use it
+   if (serialInitOpts(&link->si, sh->evt, &shardReadCB, &shardConnectCB,
+            devFile, baudRate, eolMarker, link, &linkOpts) < 0 ||
+         !link->si) {
+      free(link);
+      return -1;
+   }
+
+   sh->st.links++;
+   pool->links[pool->nlinks] = link;
+   return pool->nlinks++;
+}
+
+int shardPoolStart(struct shardPool *pool)
+{
+   int i;
+
+   pool->running = 1;
+   for (i = 0; i < pool->nshards; i++) {
+      if (pthread_create(&pool->shards[i].thread, NULL, &shardMain,
+               &pool->shards[i])) {
+         DBG_print(DBG_LEVEL_WARN, "Unable to start shard thread\n");
+         return -1;
+      }
+      pool->shards[i].started = 1;
+   }
+
+   return 0;
+}
+
+static void shardWake(struct shard *sh)
+{
+   uint64_t val = 1;
+
+   if (write(sh->efd, &val, sizeof(val)) < 0)
+      DBG_print(DBG_LEVEL_WARN, "shard wakeup failed: %s\n", strerror(errno));
+}
+
+int shardPoolSend(struct shardPool *pool, int link, const void *src,
+      int bytes)
+{
+   struct shardCmd *cmd;
+   struct shard *sh;
+
+   if (link < 0 || link >= pool->nlinks)
+      return -1;
+   sh = pool->links[link]->shard;
+
+   if (sizeof(*cmd) + bytes > SHARD_SLOT_SIZE ||
+         !(cmd = (struct shardCmd *)spscReserve(sh->ring))) {
+      __atomic_fetch_add(&sh->st.dropped, 1, __ATOMIC_RELAXED);
+      return -1;
+   }
+
+   cmd->link = link;
+   cmd->len = bytes;
+   cmd->submitNs = nowNs();
+   memcpy(cmd->data, src, bytes);
+   spscCommit(sh->ring, sizeof(*cmd) + bytes);
+
+   // Only the empty to non-empty transition needs a wakeup
+   __atomic_thread_fence(__ATOMIC_SEQ_CST);
+   if (spscDepth(sh->ring) == 1)
+      shardWake(sh);
+
+   return 0;
+}
+
+int shardPoolShards(const struct shardPool *pool)
+{
+   return pool->nshards;
+}
+
+void shardPoolStats(struct shardPool *pool, int shard,
+      struct shardStats *stats)
+{
+   struct shard *sh = &pool->shards[shard];
+   struct timespec ts;
+   clockid_t cid;
+
+   stats->links = sh->st.links;
+   stats->commands = __atomic_load_n(&sh->st.commands, __ATOMIC_RELAXED);
+   stats->dropped = __atomic_load_n(&sh->st.dropped, __ATOMIC_RELAXED);
+   stats->latencySumNs = __atomic_load_n(&sh->st.latencySumNs,
+         __ATOMIC_RELAXED);
+   stats->latencyMaxNs = __atomic_load_n(&sh->st.latencyMaxNs,
+         __ATOMIC_RELAXED);
+   stats->cpuNs = 0;
+   if (sh->started && 0 == pthread_getcpuclockid(sh->thread, &cid) &&
+         0 == clock_gettime(cid, &ts))
+      stats->cpuNs = (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void shardPoolStop(struct shardPool *pool)
+{
+   struct pendingCmd *pc;
+   struct shard *sh;
+   int i;
+
+   if (!pool)
+      return;
+
+   for (i = 0; i < pool->nshards; i++) {
+      sh = &pool->shards[i];
+      if (!sh->started)
+         continue;
+      __atomic_store_n(&sh->stop, 1, __ATOMIC_RELEASE);
+      shardWake(sh);
+      pthread_join(sh->thread, NULL);
+      sh->started = 0;
+   }
+
+   // Every loop has exited, so links can be torn down from this thread
+   for (i = 0; i < pool->nlinks; i++) {
+      if (pool->links[i]->si && pool->links[i]->si->cleanup)
+         pool->links[i]->si->cleanup(pool->links[i]->si);
+      while ((pc = pool->links[i]->pending)) {
+         pool->links[i]->pending = pc->next;
+         free(pc);
+      }
+      free(pool->links[i]);
+   }
+   free(pool->links);
+
+   for (i = 0; i < pool->nshards; i++) {
+      sh = &pool->shards[i];
+      if (sh->evt) {
+         if (sh->efd >= 0)
+            EVT_fd_remove(sh->evt, sh->efd, EVENT_FD_READ);
+         EVT_free_handler(sh->evt);
+      }
+      if (sh->efd >= 0)
+         close(sh->efd);
+      free(sh->ring);
+   }
+   free(pool->shards);
+   free(pool);
+}
@@ -0,0 +1,71 @@
+#ifndef SHARD_H
+#define SHARD_H
+
+#include <stdint.h>
+#include "serial.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct shardPool;
+
+// Per-shard load and latency figures
+struct shardStats {
+   int links;              // Links owned by the shard
+   uint64_t commands;      // Commands written to a link
+   uint64_t dropped;       // Commands dropped (queue full, write error)
+   uint64_t latencySumNs;  // Sum of submit-to-write latency
+   uint64_t latencyMaxNs;  // Worst submit-to-write latency
+   uint64_t cpuNs;         // CPU time consumed by the shard thread
+};
+
+/* Create a pool of event loops, one per shard.  Links are added with
+ *   shardPoolAddLink, then shardPoolStart runs every loop on its own thread.
+ * @param shards number of worker threads / event loops.
+ * @return the pool, or NULL on error. Check /var/log/syslog on error.
+ */
+struct shardPool *shardPoolCreate(int shards);
+
+/* Open a link on the least loaded shard.  Only valid before shardPoolStart.
+ *   The callbacks run on the owning shard's thread.  Parameters match
+ *   serialInitOpts.
+ * @return the link number used with shardPoolSend, or -1 on error.
+ */
+int shardPoolAddLink(struct shardPool *pool,
+                  serialReadCB readCallback,
+                  serialConnectCB connectCallback,
+                  const char *deviceFile,
+                  int baudRate,
+                  const char *eolMarker,
+                  void *opaque,
+                  const struct serialOptions *opts);
+
+/* Start one thread per shard. */
+int shardPoolStart(struct shardPool *pool);
+
+/* Route a command to the shard that owns the link.  The bytes are copied
+ *   into that shard's lock-free queue, so this never blocks.  Commands for
+ *   a link that is not connected yet are held until it connects.  Only one
+ *   thread may submit commands.
+ * @return -1 if the shard's queue is full or the command too large, 0 on
+ *   success.
+ */
+int shardPoolSend(struct shardPool *pool, int link, const void *src,
+      int bytes);
+
+/* Number of shards in the pool. */
+int shardPoolShards(const struct shardPool *pool);
+
+/* Snapshot the statistics of one shard.  Safe while the pool runs. */
+void shardPoolStats(struct shardPool *pool, int shard,
+      struct shardStats *stats);
+
+/* Stop every shard, clean up its links and free the pool. */
+void shardPoolStop(struct shardPool *pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
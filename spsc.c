@@ -0,0 +1,100 @@
+#include <string.h>
+#include "spsc.h"
+
+#define SLOT_HDR SPSC_SLOT_HDR
+#define SLOT_STRIDE(r) SPSC_STRIDE((r)->slotSize)
+#define SLOT(r, i) ((r)->data + (size_t)((i) & ((r)->slots - 1)) * SLOT_STRIDE(r))
+
+static uint32_t roundPow2(uint32_t v)
+{
+   uint32_t p = 1;
+
+   while (p < v)
+      p <<= 1;
+   return p;
+}
+
+size_t spscSize(uint32_t slots, uint32_t slotSize)
+{
+   return sizeof(struct spscRing) +
+      (size_t)roundPow2(slots) * SPSC_STRIDE(slotSize);
+}
+
+struct spscRing *spscInit(void *mem, uint32_t slots, uint32_t slotSize)
+{
+   struct spscRing *r = (struct spscRing *)mem;
+
+   if (!mem || slots == 0 || slotSize == 0)
+      return NULL;
+
+   memset(r, 0, sizeof(*r));
+   r->slots = roundPow2(slots);
+   r->slotSize = slotSize;
+
+   return r;
+}
+
+uint32_t spscDepth(const struct spscRing *r)
+{
+   return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) -
+      __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+}
+
+void *spscReserve(struct spscRing *r)
+{
+   uint32_t head = r->head;
+
+   if (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= r->slots) {
+      r->drops++;
+      return NULL;
+   }
+
+   return SLOT(r, head) + SLOT_HDR;
+}
+
+void spscCommit(struct spscRing *r, uint32_t len)
+{
+   uint32_t head = r->head;
+   uint32_t depth;
+
+   *(uint32_t *)SLOT(r, head) = len;
+   __atomic_store_n(&r->head, head + 1, __ATOMIC_SEQ_CST);
+   r->pushes++;
+
+   depth = head + 1 - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+   if (depth > r->highWater)
+      r->highWater = depth;
+}
+
+int spscPush(struct spscRing *r, const void *src, uint32_t len)
+{
+   void *slot;
+
+   if (len > r->slotSize)
+      return -1;
+
+   slot = spscReserve(r);
+   if (!slot)
+      return -1;
+
+   memcpy(slot, src, len);
+   spscCommit(r, len);
+
+   return 0;
+}
+
+int spscPeek(struct spscRing *r, void **buf)
+{
+   uint32_t tail = r->tail;
+
+   if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail)
+      return -1;
+
+   *buf = SLOT(r, tail) + SLOT_HDR;
+   return *(uint32_t *)SLOT(r, tail);
+}
+
+void spscRelease(struct spscRing *r)
+{
+   __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+}
@@ -0,0 +1,85 @@
+#ifndef SPSC_H
+#define SPSC_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SPSC_CACHELINE 64
+
+// Every slot is a length word followed by slotSize payload bytes
+#define SPSC_SLOT_HDR sizeof(uint32_t)
+#define SPSC_STRIDE(slotSize) (((slotSize) + SPSC_SLOT_HDR + 7) & ~7u)
+
+/* Lock-free single-producer/single-consumer ring of fixed size slots.
+ *   The ring header and slot storage are one contiguous block with no
+ *   pointers, so the same layout works in private or shared memory.
+ *   Exactly one thread may push and exactly one thread may pop.
+ */
+struct spscRing {
+   // Written by the producer only
+   volatile uint32_t head __attribute__((aligned(SPSC_CACHELINE)));
+   uint32_t highWater; // Deepest queue observed after a push
+   uint64_t drops;     // Pushes rejected because the ring was full
+   uint64_t pushes;
+   volatile uint32_t waiting; // Producer is about to block for a free slot
+
+   // Written by the consumer only
+   volatile uint32_t tail __attribute__((aligned(SPSC_CACHELINE)));
+   volatile uint32_t sleeping; // Consumer is about to block for more data
+
+   // Fixed at init
+   uint32_t slots __attribute__((aligned(SPSC_CACHELINE))); // power of two
+   uint32_t slotSize; // Payload bytes per slot
+   char data[] __attribute__((aligned(SPSC_CACHELINE)));
+};
+
+/* Number of bytes needed for a ring with the given geometry.
+ * @param slots number of slots, rounded up to a power of two.
+ * @param slotSize the largest payload a single slot holds.
+ */
+size_t spscSize(uint32_t slots, uint32_t slotSize);
+
+/* Initialize a ring in caller supplied memory of at least spscSize bytes.
+ * @return the ring, or NULL if the geometry is invalid.
+ */
+struct spscRing *spscInit(void *mem, uint32_t slots, uint32_t slotSize);
+
+/* Producer: copy a record into the next free slot.
+ * @return -1 if the ring is full or len exceeds the slot size, 0 on success.
+ */
+int spscPush(struct spscRing *r, const void *src, uint32_t len);
+
+/* Producer: reserve the next free slot for in-place writing.  Finish with
+ *   spscCommit.
+ * @return a pointer to slotSize bytes, or NULL if the ring is full.
+ */
+void *spscReserve(struct spscRing *r);
+
+/* Producer: publish the slot returned by spscReserve.
+ * @param len the number of bytes written into the slot.
+ */
+void spscCommit(struct spscRing *r, uint32_t len);
+
+/* Consumer: look at the oldest record without copying it.  Indexes with
+ *   the geometry stored in the ring, so only for rings the producer can't
+ *   rewrite; see inject.c for a consumer of untrusted shared memory.
+ * @param buf receives a pointer to the record bytes.
+ * @return the record length, or -1 if the ring is empty.
+ */
+int spscPeek(struct spscRing *r, void **buf);
+
+/* Consumer: release the record returned by spscPeek. */
+void spscRelease(struct spscRing *r);
+
+/* Number of records currently queued. Safe to call from either side. */
+uint32_t spscDepth(const struct spscRing *r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,424 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "kiss.h"
+#include "kiss_server.h"
+#include "stress.h"
+
+#define STRESS_OP 0x7E // Command ID of the timestamped stress commands
+#define STRESS_HDR 13  // Op, sequence number and send time
+#define STRESS_TICK_MS 10
+#define STRESS_LINGER_MS 500 // Wait for replies still in flight at the end
+#define STRESS_MAX_SAMPLES (4 * 1024 * 1024)
+#define STRESS_DEFAULT_RECOVER 30
+
+#define PHASE_TRAFFIC 0
+#define PHASE_RECOVER 1 // Traffic and kills over, waiting for reconnects
+#define PHASE_LINGER 2
+#define PHASE_DONE 3
+
+struct stressLink {
+   struct stressState *st;
+   struct serialInterface *si;
+   struct kissDecoder dec;
+   int up;
+   uint64_t downSinceUs; // Set while down after having been up
+   uint32_t seq;
+   uint32_t credit; // Commands owed, in thousandths
+};
+
+struct samples {
+   uint32_t *v;
+   int n, cap;
+};
+
+struct stressState {
+   const struct stressConfig *cfg;
+   EVTHandler *evt;
+   struct kissServer *srv;
+   struct stressLink *links;
+   int phase;
+   int linksUp;
+   uint64_t startUs, allUpUs, trafficEndUs, phaseEndUs;
+   uint64_t sent, blocked, dropped, replies, bytesOut, bytesIn;
+   uint64_t disconnects, recovered;
+   struct samples latency, recovery;
+};
+
+static uint64_t nowUs(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return (uint64_t)ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+static void sampleAdd(struct samples *s, uint64_t v)
+{
+   uint32_t *tmp;
+   int cap;
+
+   if (s->n == s->cap) {
+      if (s->cap >= STRESS_MAX_SAMPLES)
+         return;
+      cap = s->cap ? 2 * s->cap : 4096;
+      tmp = realloc(s->v, cap * sizeof(*s->v));
+      if (!tmp)
+         return;
+      s->v = tmp;
+      s->cap = cap;
+   }
+   s->v[s->n++] = v > UINT32_MAX ? UINT32_MAX : v;
+}
+
+static int cmpU32(const void *a, const void *b)
+{
+   uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+   return x < y ? -1 : x > y;
+}
+
+// Samples must be sorted; pct from 0 to 100
+static uint32_t samplePct(const struct samples *s, int pct)
+{
+   if (!s->n)
+      return 0;
+
+   return s->v[(int64_t)(s->n - 1) * pct / 100];
+}
+
+// Replies are an echo of the command, or an ack quoting its first bytes
+static void replyEvent(int port, unsigned char *frame, int len, void *arg)
+{
+   struct stressLink *l = (struct stressLink *)arg;
+   struct stressState *st = l->st;
+   const unsigned char *cmd = frame + 1;
+   uint64_t sentUs;
+   uint16_t crc;
+
+   if (len < 3)
+      return;
+   crc = crc16(frame, len - 2);
+   if (frame[len - 2] != (crc >> 8) || frame[len - 1] != (crc & 0xFF))
+      return;
+
+   if (cmd[0] == KISS_SERVER_ACK)
+      cmd++;
+   if (cmd + STRESS_HDR > frame + len - 2 || cmd[0] != STRESS_OP)
+      return;
+
+   memcpy(&sentUs, cmd + 5, sizeof(sentUs));
+   sampleAdd(&st->latency, nowUs() - sentUs);
+   st->replies++;
+}
+
+static void readEvent(void *buffer, int bytes, void *arg)
+{
+   struct stressLink *l = (struct stressLink *)arg;
+
+   l->st->bytesIn += bytes;
+   kissDecode(&l->dec, buffer, bytes);
+}
+
+static void connectEvent(int status, void *arg)
+{
+   struct stressLink *l = (struct stressLink *)arg;
+   struct stressState *st = l->st;
+   uint64_t now;
+
+   // Cleanup reports every link down; that is not an outage
+   if (st->phase == PHASE_DONE || status == l->up)
+      return;
+
+   now = nowUs();
+   l->up = status;
+   if (!status) {
+      l->downSinceUs = now;
+      st->linksUp--;
+      st->disconnects++;
+      return;
+   }
+
+   st->linksUp++;
+   if (st->linksUp == st->cfg->links && !st->allUpUs)
+      st->allUpUs = now;
+   if (l->downSinceUs) {
+      sampleAdd(&st->recovery, now - l->downSinceUs);
+      st->recovered++;
+      l->downSinceUs = 0;
+   }
+}
+
+static void sendCommands(struct stressState *st, struct stressLink *l)
+{
+   unsigned char body[256], kiss[2 * sizeof(body) + 9];
+   uint64_t now;
+   int len, res;
+
+   l->credit += st->cfg->rate * STRESS_TICK_MS;
+   for (; l->credit >= 1000 && l->up; l->credit -= 1000) {
+      memset(body, 0, st->cfg->size);
+      body[0] = STRESS_OP;
+      body[1] = l->seq >> 24;
+      body[2] = l->seq >> 16;
+      body[3] = l->seq >> 8;
+      body[4] = l->seq;
+      now = nowUs();
+      memcpy(body + 5, &now, sizeof(now));
+      len = kissCommand(kiss, sizeof(kiss), body, st->cfg->size);
+
+      res = l->si->write(l->si, kiss, len);
+      if (res == SERIAL_WRITE_WOULDBLOCK) {
+         st->blocked++;
+         break;
+      }
+      if (res == SERIAL_WRITE_DROPPED) {
+         st->dropped++;
+         continue;
+      }
+      st->sent++;
+      st->bytesOut += len;
+      l->seq++;
+   }
+   // Owed commands do not pile up while a link is down or blocked
+   if (l->credit > 1000)
+      l->credit = 1000;
+}
+
+static int tickEvent(void *arg)
+{
+   struct stressState *st = (struct stressState *)arg;
+   uint64_t now = nowUs();
+   int i;
+
+   switch (st->phase) {
+      case PHASE_TRAFFIC:
+         if (now < st->trafficEndUs) {
+            for (i = 0; i < st->cfg->links; i++)
+               sendCommands(st, &st->links[i]);
+            break;
+         }
+         st->phase = PHASE_RECOVER;
+         st->phaseEndUs = now + st->cfg->recoverSecs * 1000000ull;
+         // Fall through
+
+      case PHASE_RECOVER:
+         if (st->linksUp < st->cfg->links && now < st->phaseEndUs)
+            break;
+         st->phase = PHASE_LINGER;
+         st->phaseEndUs = now + STRESS_LINGER_MS * 1000ull;
+         break;
+
+      case PHASE_LINGER:
+         if (now >= st->phaseEndUs) {
+            st->phase = PHASE_DONE;
+            EVT_exit_loop(st->evt);
+            return EVENT_REMOVE;
+         }
+         break;
+   }
+
+   return EVENT_KEEP;
+}
+
+static int killEvent(void *arg)
+{
+   struct stressState *st = (struct stressState *)arg;
+
+   if (st->phase != PHASE_TRAFFIC)
+      return EVENT_REMOVE;
+   kissServerKill(st->srv);
+
+   return EVENT_KEEP;
+}
+
+// Two sockets per link live in this one process
+static void raiseFdLimit(int links)
+{
+   struct rlimit rl;
+   rlim_t need = 2 * (rlim_t)links + 64;
+
+   if (getrlimit(RLIMIT_NOFILE, &rl) < 0 || rl.rlim_cur >= need)
+      return;
+   rl.rlim_cur = rl.rlim_max == RLIM_INFINITY || rl.rlim_max > need ?
+      need : rl.rlim_max;
+   setrlimit(RLIMIT_NOFILE, &rl);
+}
+
+// Print the results; returns -1 if the run failed
+static int report(struct stressState *st, FILE *out)
+{
+   const struct stressConfig *cfg = st->cfg;
+   struct kissServerStats ks;
+   struct serialStats *ls;
+   double secs = cfg->secs;
+   uint64_t wakeups = 0, reads = 0;
+   int i;
+
+   kissServerStats(st->srv, &ks);
+   for (i = 0; i < cfg->links; i++) {
+      ls = st->links[i].si->stats(st->links[i].si);
+      wakeups += ls->readWakeups;
+      reads += ls->readCalls;
+   }
+   qsort(st->latency.v, st->latency.n, sizeof(uint32_t), &cmpU32);
+   qsort(st->recovery.v, st->recovery.n, sizeof(uint32_t), &cmpU32);
+
+   fprintf(out, "stress: %d links, %d s at %d/s each, %d byte commands, "
+         "script %s\n", cfg->links, cfg->secs, cfg->rate, cfg->size,
+         cfg->script ? cfg->script : "echo");
+   if (st->allUpUs)
+      fprintf(out, "stress: all links up in %.1f ms\n",
+            (st->allUpUs - st->startUs) / 1000.0);
+   fprintf(out, "stress: %llu sent, %llu replies, %llu blocked, "
+         "%llu dropped, %llu unanswered\n", (unsigned long long)st->sent,
+         (unsigned long long)st->replies, (unsigned long long)st->blocked,
+         (unsigned long long)st->dropped,
+         (unsigned long long)(st->sent > st->replies + ks.dropped ?
+            st->sent - st->replies - ks.dropped : 0));
+   fprintf(out, "stress: throughput %.0f commands/s, %.1f kB/s out, "
+         "%.1f kB/s in\n", st->sent / secs, st->bytesOut / secs / 1000,
+         st->bytesIn / secs / 1000);
+   fprintf(out, "stress: %.2f reads per wakeup, %.1f bytes per read\n",
+         wakeups ? (double)reads / wakeups : 0.0,
+         reads ? (double)st->bytesIn / reads : 0.0);
+   fprintf(out, "stress: latency p50 %u us, p99 %u us, max %u us\n",
+         samplePct(&st->latency, 50), samplePct(&st->latency, 99),
+         samplePct(&st->latency, 100));
+   fprintf(out, "stress: %llu kills, %llu disconnects, %llu recovered, "
+         "recovery p50 %.1f ms, max %.1f ms\n", (unsigned long long)ks.kills,
+         (unsigned long long)st->disconnects,
+         (unsigned long long)st->recovered,
+         samplePct(&st->recovery, 50) / 1000.0,
+         samplePct(&st->recovery, 100) / 1000.0);
+   fprintf(out, "stress: server %llu frames, %llu bad, %llu echoed, "
+         "%llu acked, %llu dropped, %llu delayed, %llu overflows\n",
+         (unsigned long long)ks.frames, (unsigned long long)ks.badFrames,
+         (unsigned long long)ks.echoed, (unsigned long long)ks.acked,
+         (unsigned long long)ks.dropped, (unsigned long long)ks.delayed,
+         (unsigned long long)ks.overflows);
+
+   if (st->linksUp < cfg->links) {
+      fprintf(out, "stress: FAIL, %d links did not recover\n",
+            cfg->links - st->linksUp);
+      return -1;
+   }
+   if ((st->sent && !ks.frames) || (ks.echoed + ks.acked && !st->replies)) {
+      fprintf(out, "stress: FAIL, no traffic got through\n");
+      return -1;
+   }
+   fprintf(out, "stress: PASS\n");
+
+   return 0;
+}
+
+void stressDefaults(struct stressConfig *cfg)
+{
+   memset(cfg, 0, sizeof(*cfg));
+   cfg->links = STRESS_DEFAULT_LINKS;
+   cfg->secs = STRESS_DEFAULT_SECS;
+   cfg->rate = STRESS_DEFAULT_RATE;
+   cfg->size = STRESS_DEFAULT_SIZE;
+   cfg->recoverSecs = STRESS_DEFAULT_RECOVER;
+}
+
+int stressParse(struct stressConfig *cfg, const char *spec)
+{
+   char *copy, *tok, *save, *val;
+   int res = 0;
+
+   copy = strdup(spec);
+   if (!copy)
+      return -1;
+
+   for (tok = strtok_r(copy, ",", &save); tok && !res;
+         tok = strtok_r(NULL, ",", &save)) {
+      val = strchr(tok, '=');
+      if (!val) {
+         res = -1;
+         break;
+      }
+      *val++ = 0;
+
+      if (!strcmp(tok, "links"))
+         cfg->links = atoi(val);
+      else if (!strcmp(tok, "secs"))
+         cfg->secs = atoi(val);
+      else if (!strcmp(tok, "rate"))
+         cfg->rate = atoi(val);
+      else if (!strcmp(tok, "size"))
+         cfg->size = atoi(val);
+      else if (!strcmp(tok, "kill"))
+         cfg->killMs = atoi(val);
+      else if (!strcmp(tok, "recover"))
+         cfg->recoverSecs = atoi(val);
+      else
+         res = -1;
+   }
+   free(copy);
+
+   if (cfg->links < 1 || cfg->secs < 1 || cfg->rate < 0 ||
+         cfg->size < STRESS_HDR || cfg->size > 256 - 3 || cfg->killMs < 0 ||
+         cfg->recoverSecs < 0)
+      res = -1;
+
+   return res;
+}
+
+int stressRun(const struct stressConfig *cfg, FILE *out)
+{
+   struct stressState st;
+   char url[64];
+   int i, res = 0;
+
+   memset(&st, 0, sizeof(st));
+   st.cfg = cfg;
+   raiseFdLimit(cfg->links);
+
+   st.links = (struct stressLink *)calloc(cfg->links, sizeof(*st.links));
+   st.evt = EVT_create_handler();
+   if (st.evt)
+      st.srv = kissServerStart(st.evt, 0, cfg->script);
+   if (!st.links || !st.srv) {
+      if (st.evt)
+         EVT_free_handler(st.evt);
+      free(st.links);
+      return -1;
+   }
+   snprintf(url, sizeof(url), "tcp://127.0.0.1:%d", kissServerPort(st.srv));
+
+   st.startUs = nowUs();
+   st.trafficEndUs = st.startUs + cfg->secs * 1000000ull;
+   for (i = 0; i < cfg->links; i++) {
+      st.links[i].st = &st;
+      kissDecoderInit(&st.links[i].dec, &replyEvent, &st.links[i]);
+      if (serialInitOpts(&st.links[i].si, st.evt, &readEvent, &connectEvent,
+               url, 0, NULL, &st.links[i], &cfg->opts) < 0 ||
+            !st.links[i].si) {
+         fprintf(out, "stress: unable to open link %d\n", i);
+         res = -1;
+         break;
+      }
+   }
+
+   if (!res) {
+      EVT_sched_add(st.evt, EVT_ms2tv(STRESS_TICK_MS), &tickEvent, &st);
+      if (cfg->killMs)
+         EVT_sched_add(st.evt, EVT_ms2tv(cfg->killMs), &killEvent, &st);
+      EVT_start_loop(st.evt);
+      res = report(&st, out);
+   }
+
+   st.phase = PHASE_DONE;
+   for (i = 0; i < cfg->links; i++)
+      if (st.links[i].si && st.links[i].si->cleanup)
+         st.links[i].si->cleanup(st.links[i].si);
+   kissServerStop(st.srv);
+   EVT_free_handler(st.evt);
+   free(st.links);
+   free(st.latency.v);
+   free(st.recovery.v);
+
+   return res;
+}
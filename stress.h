@@ -0,0 +1,55 @@
+#ifndef STRESS_H
+#define STRESS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "serial.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Transport stress harness.  Opens many tcp:// serialInterfaces against a
+ *   bundled kiss_server.h server on loopback in the same event loop, sends
+ *   timestamped commands at a steady rate on each, closes server side
+ *   connections at random and reports throughput, reply latency and how
+ *   long links took to come back.
+ *
+ *   After the traffic period kills stop and the harness waits for every
+ *   link to reconnect, so a link that never recovers fails the run.
+ */
+#define STRESS_DEFAULT_LINKS 100
+#define STRESS_DEFAULT_SECS 10
+#define STRESS_DEFAULT_RATE 20 // Commands per second per link
+#define STRESS_DEFAULT_SIZE 32 // Command bytes, timestamp included
+
+struct stressConfig {
+   int links;
+   int secs;       // Traffic period
+   int rate;       // Commands per second per link
+   int size;       // Command bytes, at least 13
+   int killMs;     // Close a random connection this often, 0 for never
+   int recoverSecs; // Longest to wait for links to reconnect at the end
+   const char *script; // kiss_server.h reply script, NULL for "echo"
+   struct serialOptions opts; // Applied to every link
+};
+
+/* Fill in the defaults. */
+void stressDefaults(struct stressConfig *cfg);
+
+/* Parse "links=200,secs=20,rate=50,size=64,kill=100,recover=30" into cfg.
+ *   Unnamed settings keep their values.
+ * @return 0 on success, -1 on an unknown setting.
+ */
+int stressParse(struct stressConfig *cfg, const char *spec);
+
+/* Run the harness and print the report.
+ * @return 0 if every link recovered and replies came back, -1 otherwise.
+ */
+int stressRun(const struct stressConfig *cfg, FILE *out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
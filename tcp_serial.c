@@ -4,20 +4,35 @@
 #include <string.h>
 #include <errno.h>
 #include "tcp_serial.h"
+#include "uring_io.h"
+#include "bufpool.h"
+#include "netsys.h"
+#include "probes.h"
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <sys/un.h>
 #include <netinet/tcp.h>
 #include <stdio.h>
 #include <netdb.h>
+#include <sys/time.h>
 
 #define CONNECT_RETRY_TIME EVT_ms2tv(10*1000)
 
-#define READBUFFER_SIZE 4096
-#define WRITEBUFFER_SIZE 4096
+// Hot standby groups: dead peers must be noticed in a few seconds
+#define FAILOVER_MAX_ENDPOINTS 8
+#define FAILOVER_KEEPIDLE_S 1
+#define FAILOVER_KEEPINTVL_S 1
+#define FAILOVER_KEEPCNT 3
+#define FAILOVER_USER_TIMEOUT_MS 3000
+#define FAILOVER_CHECK_MS 250
+#define FAILOVER_STALL_MS 2000
 
 #define PRIV(arg) ((struct tcpSerialInterfacePriv *) (arg))
+// Link identity for the tracepoints in probes.h
+#define TCP_LINK(self) ((self)->family == AF_UNIX ? \
+      (self)->unix_addr.sun_path : (self)->server_name)
 
 static int initiate_remote_connection_event(void *arg);
 static int sock_write_callback(int fd, char type, void *arg);
@@ -25,6 +40,8 @@ static int close_connection_event(void *arg);
 
 struct WriteNode {
    int data_len;
+   int offset; // Bytes of data already accepted by the socket
+   struct bufpoolReserved *reserve; // Where it goes back, NULL for the pool
    struct WriteNode *next;
    char data[1];
 };
@@ -32,64 +49,201 @@ struct WriteNode {
 struct tcpSerialInterfacePriv {
    int (*cleanup)(struct tcpSerialInterfacePriv *self);
    int (*write)(struct tcpSerialInterfacePriv *self, void *src, int bytes);
+   struct serialStats *(*stats)(struct tcpSerialInterfacePriv *self);
 
    // Private fields
    int sockfd; // serial device FD
+   int family; // AF_INET for tcp://, AF_UNIX for unix://
+   int socktype; // SOCK_STREAM, or SOCK_SEQPACKET for packet mode unix://
    struct sockaddr_in server_addr;
+   struct sockaddr_un unix_addr;
    char *server_name;
    void *connect_event, *close_event;
+   void *register_event; // Fast Open: registers leftover writes after connect
 
    serialConnectCB connectCallback;
    serialReadCB readCB; // callback up controlling context
    struct EventState *evt_loop; // Pointer to proclib process context
-   char writeBuff[WRITEBUFFER_SIZE]; // Write buffer bytes
-   char readBuff[READBUFFER_SIZE + 1]; // Write buffer bytes
+   char *readBuff; // Read buffer bytes, borrowed while holding data
+   uint32_t readSize; // Size of readBuff, its terminator included
+   uint32_t readBase; // readSize to go back to once readBuff is released
    int readBytes;
-   uint32_t writeBytes; // Bytes to write field
    void *opaque;
    char *eolMarker;
    int write_reg, read_reg, connect_reg;
    struct WriteNode *writes;
    struct WriteNode *writes_tail;
+   uint32_t flags; // SERIAL_OPT_* flags from serialInitOpts
+   struct uringIO *uring; // io_uring backend, NULL when using fd events
+   struct serialStats st;
+   uint32_t queuedBytes; // Bytes held in the writes list
+   uint32_t highWater; // queuedBytes limit before writes would block
+   int blocked; // A write returned SERIAL_WRITE_WOULDBLOCK since last notify
+   serialWritableCB writableCB;
+   struct timeval connectStart; // When the current connect attempt began
+   int tfoPending; // TFO connect; connectTimeUs waits for the first read
+   int fastFail; // Member of a hot standby group, detect failures quickly
+   const struct netOps *ops; // Sockets, clock and event loop in use
+   uint32_t rcvLowat; // SO_RCVLOWAT, 0 for the kernel default
+   uint32_t busyPollUs; // SO_BUSY_POLL, 0 for off
+   int prealloc; // SERIAL_OPT_PREALLOC: buffers come from the reserves below
+   struct bufpoolReserved readRes; // The read buffer, this link's alone
+   struct bufpoolReserved nodeRes; // SERIAL_PREALLOC_NODES write nodes
 };
 
-static int tcpReadEvent(int fd, char type, void *si)
+// Tell the owner there is room again: when the queue drains, or once it
+// is down to half the high-water mark after a write was refused
+static void sockNotifyWritable(struct tcpSerialInterfacePriv *self,
+      uint32_t queued)
 {
-   struct tcpSerialInterfacePriv *self = PRIV(si);
-   int bytesread;
-   char *eol;
-   int i;
+   if (!self->writableCB)
+      return;
+   if (queued && (!self->blocked || queued > self->highWater / 2))
+      return;
 
-   // Perform the read
-   bytesread = read(self->sockfd, self->readBuff + self->readBytes,
-         READBUFFER_SIZE - self->readBytes);
-   if (bytesread < 0) {
-      if (errno == EAGAIN)
-         return EVENT_KEEP;
+   self->blocked = 0;
+   self->writableCB(queued, self->opaque);
+}
 
-      perror ("Read error");
-      self->read_reg = 0;
-      if (!self->close_event)
-         self->close_event = EVT_sched_add(self->evt_loop,
-            EVT_ms2tv(0), &close_connection_event, self);
+static void tcpUringWritable(int written, int queued, void *arg)
+{
+   struct tcpSerialInterfacePriv *self = PRIV(arg);
 
-      if (self->connectCallback)
-         (*self->connectCallback)(0, self->opaque);
+   PROBE4(tcp_tx, TCP_LINK(self), self->sockfd, written, queued);
+   // Counted here, not when queued, so the failover watchdog sees progress
+   if (written > 0)
+      self->st.bytesSent += written;
 
-      return EVENT_REMOVE;
+   // Registered buffers were released, which is room for a blocked writer
+   serialStatsQueue(&self->st, queued);
+   if (self->writableCB && (queued == 0 || self->blocked)) {
+      self->blocked = 0;
+      self->writableCB(queued, self->opaque);
    }
-   else if (bytesread == 0) {
-      printf("Remote end closed connection\n");
-      self->read_reg = 0;
-      if (!self->close_event)
-         self->close_event = EVT_sched_add(self->evt_loop,
-            EVT_ms2tv(0), &close_connection_event, self);
+}
 
-      if (self->connectCallback)
-         (*self->connectCallback)(0, self->opaque);
+// Tear the connection down after a read error or remote close
+static void tcpReadFailed(struct tcpSerialInterfacePriv *self)
+{
+   self->read_reg = 0;
+   if (!self->close_event)
+      self->close_event = netSchedAdd(self->ops, self->evt_loop,
+         EVT_ms2tv(0), &close_connection_event, self);
 
-      return EVENT_REMOVE;
+   if (self->connectCallback)
+      (*self->connectCallback)(0, self->opaque);
+}
+
+// Record how long the connect took
+static void tcpConnectDone(struct tcpSerialInterfacePriv *self)
+{
+   struct timeval now, diff;
+
+   netNow(self->ops, &now);
+   timersub(&now, &self->connectStart, &diff);
+   self->st.connectTimeUs = (uint64_t)diff.tv_sec * 1000000 + diff.tv_usec;
+   self->tfoPending = 0;
+   PROBE3(tcp_connected, TCP_LINK(self), self->sockfd, self->st.connectTimeUs);
+}
+
+#define WRITENODE_SIZE(bytes) (sizeof(struct WriteNode) + (bytes))
+
+// A preallocated link takes write nodes from its own reserve
+static struct WriteNode *nodeGet(struct tcpSerialInterfacePriv *self,
+      int bytes)
+{
+   struct WriteNode *wr;
+
+   if (self->prealloc)
+      wr = bufpoolReservedGet(&self->nodeRes);
+   else
+      wr = bufpoolGet(WRITENODE_SIZE(bytes), NULL);
+   if (wr)
+      wr->reserve = self->prealloc ? &self->nodeRes : NULL;
+
+   return wr;
+}
+
+// After a failover the node may belong to another member's reserve
+static void nodePut(struct WriteNode *wr)
+{
+   if (wr->reserve)
+      bufpoolReservedPut(wr->reserve, wr);
+   else
+      bufpoolPut(wr, WRITENODE_SIZE(wr->data_len));
+}
+
+// Borrow the read buffer from the shared pool, or the link's reserve
+static int tcpAcquireReadBuff(struct tcpSerialInterfacePriv *self)
+{
+   if (self->readBuff)
+      return 0;
+
+   if (self->prealloc)
+      self->readBuff = bufpoolReservedGet(&self->readRes);
+   else
+      self->readBuff = bufpoolGet(self->readSize, NULL);
+   if (!self->readBuff) {
+      DBG_print(DBG_LEVEL_WARN, "Insufficient memory\n");
+      return -1;
    }
+   self->readBytes = 0;
+
+   return 0;
+}
+
+// Give the read buffer back once it holds no partial line
+static void tcpReleaseReadBuff(struct tcpSerialInterfacePriv *self)
+{
+   if (self->readBuff && self->readBytes == 0) {
+      if (self->prealloc)
+         bufpoolReservedPut(&self->readRes, self->readBuff);
+      else
+         bufpoolPut(self->readBuff, self->readSize);
+      self->readBuff = NULL;
+      // A burst grew it; the next one grows it again if it must
+      self->readSize = self->readBase;
+   }
+}
+
+// Double the read buffer after a read filled it, keeping what it holds
+static int tcpGrowReadBuff(struct tcpSerialInterfacePriv *self)
+{
+   char *buff;
+
+   if (self->readSize >= SERIAL_MAX_READ_BUFFER || self->prealloc)
+      return -1;
+
+   buff = bufpoolGet(2 * self->readSize, NULL);
+   if (!buff)
+      return -1;
+   memcpy(buff, self->readBuff, self->readBytes + 1);
+   bufpoolPut(self->readBuff, self->readSize);
+   self->readBuff = buff;
+   self->readSize *= 2;
+
+   return 0;
+}
+
+static void freeWrites(struct tcpSerialInterfacePriv *self)
+{
+   struct WriteNode *wr;
+
+   while ((wr = self->writes)) {
+      self->writes = wr->next;
+      self->st.droppedWrites++;
+      nodePut(wr);
+   }
+   self->writes_tail = NULL;
+   self->queuedBytes = 0;
+   serialStatsQueue(&self->st, 0);
+}
+
+// Hand bytes newly appended to readBuff to the read callback
+static void tcpDeliverRead(struct tcpSerialInterfacePriv *self, int bytesread)
+{
+   char *eol;
+   int i;
 
    self->readBytes += bytesread;
    self->readBuff[self->readBytes] = 0;
@@ -98,14 +252,16 @@ static int tcpReadEvent(int fd, char type, void *si)
    if (self->readCB) {
       // No EOL marker provided, call the callback 
       if (!self->eolMarker) {
-         self->readCB(PRIV(si)->readBuff, bytesread, self->opaque);
+         self->st.framesReceived++;
+         self->readCB(self->readBuff, bytesread, self->opaque);
          self->readBytes = 0;
-         return EVENT_KEEP;
+         return;
       }
 
       while ((eol = strstr(self->readBuff, self->eolMarker))) {
          bytesread = eol - self->readBuff;
          *eol = 0;
+         self->st.framesReceived++;
          self->readCB(self->readBuff, bytesread, self->opaque);
          bytesread += strlen(self->eolMarker);
          self->readBytes -= bytesread;
@@ -116,10 +272,151 @@ static int tcpReadEvent(int fd, char type, void *si)
    }
    else // Discard all bytes if no read callback
       self->readBytes = 0;
+}
+
+static int tcpReadEvent(int fd, char type, void *si)
+{
+   struct tcpSerialInterfacePriv *self = PRIV(si);
+   int bytesread, space, reads;
+
+   // Left unread the socket stays readable and the loop would spin on it;
+   // the reconnect retry waits out the memory shortage instead
+   if (tcpAcquireReadBuff(self) < 0) {
+      tcpReadFailed(self);
+      return EVENT_REMOVE;
+   }
+
+   // Drain the socket so a burst costs one wakeup, not one per buffer
+   self->st.readWakeups++;
+   for (reads = 0; reads < SERIAL_MAX_READS_PER_WAKEUP; reads++) {
+      // A line longer than the buffer is discarded if it cannot grow
+      if (self->readBytes == self->readSize - 1 && tcpGrowReadBuff(self) < 0)
+         self->readBytes = 0;
+      space = self->readSize - 1 - self->readBytes;
+
+      bytesread = netRead(self->ops, self->sockfd,
+            self->readBuff + self->readBytes, space);
+      self->st.readCalls++;
+      PROBE3(tcp_rx, TCP_LINK(self), self->sockfd, bytesread);
+      if (bytesread < 0) {
+         tcpReleaseReadBuff(self);
+         if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return EVENT_KEEP;
+
+         perror ("Read error");
+         tcpReadFailed(self);
+         return EVENT_REMOVE;
+      }
+      else if (bytesread == 0) {
+         tcpReleaseReadBuff(self);
+         printf("Remote end closed connection\n");
+         tcpReadFailed(self);
+         return EVENT_REMOVE;
+      }
+
+      self->st.bytesReceived += bytesread;
+      if (self->tfoPending)
+         tcpConnectDone(self);
+      tcpDeliverRead(self, bytesread);
+
+      // A short read empties a byte stream, which saves the EAGAIN call;
+      // SOCK_SEQPACKET returns one packet per read so it keeps going
+      if (bytesread < space && self->socktype == SOCK_STREAM)
+         break;
+      if (bytesread == space)
+         tcpGrowReadBuff(self);
+   }
+   tcpReleaseReadBuff(self);
 
    return EVENT_KEEP;
 }
 
+static void tcpUringRead(void *buffer, int bytes, void *arg)
+{
+   struct tcpSerialInterfacePriv *self = PRIV(arg);
+   int chunk;
+
+   PROBE3(tcp_rx, TCP_LINK(self), self->sockfd, bytes);
+   self->st.bytesReceived += bytes;
+   self->st.readWakeups++;
+   self->st.readCalls++;
+   if (self->tfoPending)
+      tcpConnectDone(self);
+
+   // Without an EOL marker the completion buffer can go straight up
+   if (!self->eolMarker) {
+      self->st.framesReceived++;
+      if (self->readCB)
+         self->readCB(buffer, bytes, self->opaque);
+      return;
+   }
+
+   if (tcpAcquireReadBuff(self) < 0)
+      return;
+
+   while (bytes > 0) {
+      chunk = self->readSize - 1 - self->readBytes;
+      if (chunk == 0) {
+         // Line longer than the buffer, discard what we have so far
+         self->readBytes = 0;
+         chunk = self->readSize - 1;
+      }
+      if (chunk > bytes)
+         chunk = bytes;
+      memcpy(self->readBuff + self->readBytes, buffer, chunk);
+      tcpDeliverRead(self, chunk);
+      buffer = (char *)buffer + chunk;
+      bytes -= chunk;
+   }
+   tcpReleaseReadBuff(self);
+}
+
+static void tcpUringError(int err, void *arg)
+{
+   PROBE3(tcp_rx, TCP_LINK(PRIV(arg)), PRIV(arg)->sockfd, err ? -1 : 0);
+   if (err)
+      printf("Read error: %s\n", strerror(err));
+   else
+      printf("Remote end closed connection\n");
+   tcpReadFailed(PRIV(arg));
+}
+
+// Start receiving on a freshly connected socket
+static void sock_start_reading(struct tcpSerialInterfacePriv *self)
+{
+   // A TFO connect() returns before the SYN is sent, so the first bytes
+   // back are the earliest sign the handshake finished
+   if (self->tfoPending)
+      self->st.connectTimeUs = 0;
+   else
+      tcpConnectDone(self);
+
+   if (self->flags & SERIAL_OPT_URING)
+      self->uring = uringIOCreate(self->evt_loop, self->sockfd, 1,
+            &tcpUringRead, &tcpUringError, self);
+   if (self->uring)
+      uringIOSetWritableCB(self->uring, &tcpUringWritable);
+
+   if (!self->uring)
+      netFdAdd(self->ops, self->evt_loop, self->sockfd, EVENT_FD_READ,
+         &tcpReadEvent, self);
+
+   self->read_reg = 1;
+}
+
+// Stop receiving, whichever backend is in use
+static void sock_stop_reading(struct tcpSerialInterfacePriv *self)
+{
+   if (self->uring) {
+      uringIODestroy(self->uring);
+      self->uring = NULL;
+   }
+   else if (self->read_reg)
+      netFdRemove(self->ops, self->evt_loop, self->sockfd, EVENT_FD_READ);
+
+   self->read_reg = 0;
+}
+
 static int tcpSerialCleanup(struct serialInterface *si)
 {
    struct tcpSerialInterfacePriv *self = PRIV(si);
@@ -128,19 +425,16 @@ static int tcpSerialCleanup(struct serialInterface *si)
       free(self->eolMarker);
 
    if (self->write_reg) {
-      EVT_fd_remove(self->evt_loop, self->sockfd, EVENT_FD_WRITE);
+      netFdRemove(self->ops, self->evt_loop, self->sockfd, EVENT_FD_WRITE);
       self->write_reg = 0;
    }
 
    if (self->connect_reg) {
-      EVT_fd_remove(self->evt_loop, self->sockfd, EVENT_FD_WRITE);
+      netFdRemove(self->ops, self->evt_loop, self->sockfd, EVENT_FD_WRITE);
       self->connect_reg = 0;
    }
 
-   if (self->read_reg) {
-      EVT_fd_remove(self->evt_loop, self->sockfd, EVENT_FD_READ);
-      self->read_reg = 0;
-   }
+   sock_stop_reading(self);
 
    if (self->server_name) {
       free(self->server_name);
@@ -148,39 +442,118 @@ static int tcpSerialCleanup(struct serialInterface *si)
    }
 
    if (self->close_event)
-      EVT_sched_remove(self->evt_loop, self->close_event);
+      netSchedRemove(self->ops, self->evt_loop, self->close_event);
    self->close_event = NULL;
 
    if (self->connect_event)
-      EVT_sched_remove(self->evt_loop, self->connect_event);
+      netSchedRemove(self->ops, self->evt_loop, self->connect_event);
    self->connect_event = NULL;
 
+   if (self->register_event)
+      netSchedRemove(self->ops, self->evt_loop, self->register_event);
+   self->register_event = NULL;
+
    if (self->sockfd) {
-      close(self->sockfd);
+      netClose(self->ops, self->sockfd);
       self->sockfd = 0;
    }
 
    if (self->connectCallback)
       (*self->connectCallback)(0, self->opaque);
 
+   freeWrites(self);
+   self->readBytes = 0;
+   tcpReleaseReadBuff(self);
+
+   if (self->prealloc) {
+      bufpoolUnreserve(&self->readRes);
+      bufpoolUnreserve(&self->nodeRes);
+   }
+
    free(si);
 
    return 0;
 }
 
-static int tcpSerialWrite(struct serialInterface *si, void *src, int bytes)
+static struct serialStats *tcpSerialStats(struct serialInterface *si)
+{
+   return &PRIV(si)->st;
+}
+
+static int tcpSerialQueue(struct serialInterface *si, void *src, int bytes)
 {
    struct tcpSerialInterfacePriv *self = PRIV(si);
    struct WriteNode *wr;
+   int res;
 
-   if (!self->read_reg)
-      return 0;
+   if (!self->read_reg) {
+      self->st.droppedWrites++;
+      return SERIAL_WRITE_DROPPED;
+   }
 
-   wr = malloc(sizeof(*wr) + bytes);
-   if (!wr)
-      return 0;
+   // Same limits as the WriteNode queue, plus the registered buffer space
+   if (self->uring) {
+      if (bytes > uringIOCapacity()) {
+         self->st.droppedWrites++;
+         return SERIAL_WRITE_DROPPED;
+      }
+      res = uringIOQueued(self->uring);
+      if ((res && res + bytes > self->highWater) ||
+            uringIOWrite(self->uring, src, bytes) < 0) {
+         self->st.blockedWrites++;
+         self->blocked = 1;
+         return SERIAL_WRITE_WOULDBLOCK;
+      }
+      self->st.framesSent++;
+      return SERIAL_WRITE_QUEUED;
+   }
+
+   // A reserved node is the most one write can ever take
+   if (self->prealloc && WRITENODE_SIZE(bytes) > SERIAL_PREALLOC_NODE_SIZE) {
+      self->st.droppedWrites++;
+      return SERIAL_WRITE_DROPPED;
+   }
+
+   // An oversized write is still taken when nothing else is queued
+   if (self->queuedBytes && self->queuedBytes + bytes > self->highWater) {
+      self->st.blockedWrites++;
+      self->blocked = 1;
+      return SERIAL_WRITE_WOULDBLOCK;
+   }
+
+   // Fast path: with nothing queued, try the socket before the event loop
+   if ((self->flags & SERIAL_OPT_FASTOPEN) && !self->writes) {
+      res = netWrite(self->ops, self->sockfd, src, bytes);
+      if (res > 0)
+         self->st.bytesSent += res;
+      if (res == bytes) {
+         self->st.framesSent++;
+         return SERIAL_WRITE_QUEUED;
+      }
+      if (res > 0) {
+         self->st.shortWrites++;
+         src = (char *)src + res;
+         bytes -= res;
+      }
+      else if (res < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+            errno != EINPROGRESS)
+         perror("write");
+   }
+
+   wr = nodeGet(self, bytes);
+   // The reserved nodes are all queued, wait for some to be sent
+   if (!wr && self->prealloc && self->writes) {
+      self->st.blockedWrites++;
+      self->blocked = 1;
+      return SERIAL_WRITE_WOULDBLOCK;
+   }
+   if (!wr) {
+      self->st.droppedWrites++;
+      return SERIAL_WRITE_DROPPED;
+   }
 
    wr->data_len = bytes;
+   wr->offset = 0;
    wr->next = NULL;
    memcpy(wr->data, src, bytes);
 
@@ -190,14 +563,27 @@ static int tcpSerialWrite(struct serialInterface *si, void *src, int bytes)
       self->writes_tail->next = wr;
       self->writes_tail = wr;
    }
+   self->st.framesSent++;
+   self->queuedBytes += bytes;
+   serialStatsQueue(&self->st, self->queuedBytes);
 
-   if (!self->write_reg) {
-      EVT_fd_add(self->evt_loop, self->sockfd, EVENT_FD_WRITE,
+   // Inside sock_connect_callback the write handler can't be added yet
+   if (!self->write_reg && !self->connect_reg) {
+      netFdAdd(self->ops, self->evt_loop, self->sockfd, EVENT_FD_WRITE,
          &sock_write_callback, self);
       self->write_reg = 1;
    }
 
-   return 0;
+   return SERIAL_WRITE_QUEUED;
+}
+
+static int tcpSerialWrite(struct serialInterface *si, void *src, int bytes)
+{
+   int res = tcpSerialQueue(si, src, bytes);
+
+   PROBE5(tcp_enqueue, TCP_LINK(PRIV(si)), PRIV(si)->sockfd, bytes,
+         PRIV(si)->queuedBytes, res);
+   return res;
 }
 
 static int close_connection_event(void *arg)
@@ -205,30 +591,38 @@ static int close_connection_event(void *arg)
    struct tcpSerialInterfacePriv *self = PRIV(arg);
 
    if (self->write_reg) {
-      EVT_fd_remove(self->evt_loop, self->sockfd, EVENT_FD_WRITE);
+      netFdRemove(self->ops, self->evt_loop, self->sockfd, EVENT_FD_WRITE);
       self->write_reg = 0;
    }
 
    if (self->connect_reg) {
-      EVT_fd_remove(self->evt_loop, self->sockfd, EVENT_FD_WRITE);
+      netFdRemove(self->ops, self->evt_loop, self->sockfd, EVENT_FD_WRITE);
       self->connect_reg = 0;
    }
 
-   if (self->read_reg) {
-      EVT_fd_remove(self->evt_loop, self->sockfd, EVENT_FD_READ);
-      self->read_reg = 0;
-   }
+   sock_stop_reading(self);
 
    if (self->connect_event)
-      EVT_sched_remove(self->evt_loop, self->connect_event);
+      netSchedRemove(self->ops, self->evt_loop, self->connect_event);
    self->connect_event = NULL;
 
+   if (self->register_event)
+      netSchedRemove(self->ops, self->evt_loop, self->register_event);
+   self->register_event = NULL;
+
+   PROBE3(tcp_close, TCP_LINK(self), self->sockfd, self->st.reconnects + 1);
    if (self->sockfd) {
-      close(self->sockfd);
+      netClose(self->ops, self->sockfd);
       self->sockfd = 0;
    }
 
-   self->connect_event = EVT_sched_add(self->evt_loop,
+   self->st.reconnects++;
+
+   // A partial line from the old connection is meaningless on the next one
+   self->readBytes = 0;
+   tcpReleaseReadBuff(self);
+
+   self->connect_event = netSchedAdd(self->ops, self->evt_loop,
      CONNECT_RETRY_TIME, &initiate_remote_connection_event, self);
 
    self->close_event = NULL;
@@ -243,16 +637,43 @@ static int sock_write_callback(int fd, char type, void *arg)
 {
    struct tcpSerialInterfacePriv *self = PRIV(arg);
    struct WriteNode *wr;
+   int len;
 
    wr = self->writes;
    if (wr) {
-      self->writes = wr->next;
-      if (!self->writes)
-         self->writes_tail = NULL;
-
-      write(self->sockfd, wr->data, wr->data_len);
+      len = netWrite(self->ops, self->sockfd, wr->data + wr->offset,
+            wr->data_len - wr->offset);
+      PROBE4(tcp_tx, TCP_LINK(self), self->sockfd, len,
+            len > 0 ? self->queuedBytes - len : self->queuedBytes);
       //printf("TX Packet length %d / %d\n", len, wr->data_len);
-      free(wr);
+      if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+               errno == EINTR))
+         return EVENT_KEEP;
+
+      if (len < 0) {
+         perror("write");
+         self->st.droppedWrites++;
+         len = wr->data_len - wr->offset;
+      }
+      else {
+         self->st.bytesSent += len;
+         if (len < wr->data_len - wr->offset)
+            self->st.shortWrites++;
+      }
+
+      // The unsent tail stays at the head of the queue for the next event
+      wr->offset += len;
+      self->queuedBytes -= len;
+      serialStatsQueue(&self->st, self->queuedBytes);
+      if (wr->offset >= wr->data_len) {
+         self->writes = wr->next;
+         if (!self->writes)
+            self->writes_tail = NULL;
+         nodePut(wr);
+      }
+
+      // May queue more; write_reg is still set so nothing is registered
+      sockNotifyWritable(self, self->queuedBytes);
    }
 
    if (!self->writes) {
@@ -274,20 +695,34 @@ int sock_notify_connect(void *arg)
    return EVENT_REMOVE;
 }
 
+static int sock_register_write(void *arg)
+{
+   struct tcpSerialInterfacePriv *self = PRIV(arg);
+
+   self->register_event = NULL;
+   if (self->writes && !self->write_reg && self->read_reg) {
+      netFdAdd(self->ops, self->evt_loop, self->sockfd, EVENT_FD_WRITE,
+         &sock_write_callback, self);
+      self->write_reg = 1;
+   }
+
+   return EVENT_REMOVE;
+}
+
 static int sock_connect_callback(int fd, char type, void *arg)
 {
    struct tcpSerialInterfacePriv *self = PRIV(arg);
    int sockerr;
    socklen_t len = sizeof(sockerr);
-   if (getsockopt (self->sockfd, SOL_SOCKET, SO_ERROR, &sockerr,
+   if (netGetsockopt(self->ops, self->sockfd, SOL_SOCKET, SO_ERROR, &sockerr,
             &len) < 0) {
       perror("Error reading sockopt, fatal!");
 
       self->connect_reg = 0;
-      close(self->sockfd);
+      netClose(self->ops, self->sockfd);
       self->sockfd = 0;
       if (!self->connect_event)
-         self->connect_event = EVT_sched_add(self->evt_loop,
+         self->connect_event = netSchedAdd(self->ops, self->evt_loop,
             CONNECT_RETRY_TIME, &initiate_remote_connection_event, self);
 
       if (self->connectCallback)
@@ -298,12 +733,13 @@ static int sock_connect_callback(int fd, char type, void *arg)
 
    if (sockerr != 0) {
       printf("sockerr %d\n", sockerr);
+      PROBE2(tcp_connect_fail, TCP_LINK(self), sockerr);
 
       self->connect_reg = 0;
-      close(self->sockfd);
+      netClose(self->ops, self->sockfd);
       self->sockfd = 0;
       if (!self->connect_event)
-         self->connect_event = EVT_sched_add(self->evt_loop,
+         self->connect_event = netSchedAdd(self->ops, self->evt_loop,
             CONNECT_RETRY_TIME, &initiate_remote_connection_event, self);
 
       if (self->connectCallback)
@@ -312,20 +748,134 @@ static int sock_connect_callback(int fd, char type, void *arg)
       return EVENT_REMOVE;
    }
 
-   EVT_fd_add(self->evt_loop, self->sockfd, EVENT_FD_READ,
-      &tcpReadEvent, self);
+   // Writable after EINPROGRESS means the handshake did complete
+   self->tfoPending = 0;
+   sock_start_reading(self);
+
+   if (self->flags & SERIAL_OPT_FASTOPEN) {
+      // Notify without a timer hop. Writes made from the callback go
+      // straight to the socket; any remainder is registered afterwards
+      // because this handler's own removal would cancel it here.
+      if (self->connectCallback)
+         (*self->connectCallback)(1, self->opaque);
+      self->connect_reg = 0;
+      if (self->writes && !self->write_reg && !self->register_event)
+         self->register_event = netSchedAdd(self->ops, self->evt_loop,
+               EVT_ms2tv(0), &sock_register_write, self);
+      return EVENT_REMOVE;
+   }
 
-   self->read_reg = 1;
    self->connect_reg = 0;
 
    if (self->connectCallback) {
-      EVT_sched_add(self->evt_loop,
+      netSchedAdd(self->ops, self->evt_loop,
             EVT_ms2tv(0), &sock_notify_connect, self);
    }
 
    return EVENT_REMOVE;
 }
 
+// Low latency and keepalive settings, only meaningful for TCP
+static int configure_tcp_options(const struct netOps *ops, int sockfd,
+      int fastFail)
+{
+   int res;
+   int flags;
+
+   flags = 1;
+   res = netSetsockopt(ops, sockfd,   /* socket affected */
+                       IPPROTO_TCP,     /* set option at TCP level */
+                       TCP_NODELAY,     /* name of option */
+                       (char *) &flags,  /* the cast is historical cruft */
+                       sizeof(flags));    /* length of option value */
+   if (res < 0) {
+      perror("setsockopt");
+      return -1;
+   }
+
+   flags = 1;
+   res = netSetsockopt(ops, sockfd,   /* socket affected */
+                       SOL_SOCKET,     /* set option at TCP level */
+                       SO_KEEPALIVE,     /* name of option */
+                       (char *) &flags,  /* the cast is historical cruft */
+                       sizeof(flags));    /* length of option value */
+   if (res < 0) {
+      perror("setsockopt SO_KEEPALIVE");
+      return -1;
+   }
+
+#ifndef __APPLE__
+   flags = fastFail ? FAILOVER_KEEPCNT : 6;
+   res = netSetsockopt(ops, sockfd,   /* socket affected */
+                       SOL_TCP,     /* set option at TCP level */
+                       TCP_KEEPCNT,     /* name of option */
+                       (char *) &flags,  /* the cast is historical cruft */
+                       sizeof(flags));    /* length of option value */
+   if (res < 0) {
+      perror("setsockopt TCP_KEEPCNT");
+      return -1;
+   }
+
+   flags = fastFail ? FAILOVER_KEEPIDLE_S : 5;
+   res = netSetsockopt(ops, sockfd,   /* socket affected */
+                       SOL_TCP,     /* set option at TCP level */
+                       TCP_KEEPIDLE,     /* name of option */
+                       (char *) &flags,  /* the cast is historical cruft */
+                       sizeof(flags));    /* length of option value */
+   if (res < 0) {
+      perror("setsockopt TCP_KEEPIDLE");
+      return -1;
+   }
+
+   flags = fastFail ? FAILOVER_KEEPINTVL_S : 5;
+   res = netSetsockopt(ops, sockfd,   /* socket affected */
+                       SOL_TCP,     /* set option at TCP level */
+                       TCP_KEEPINTVL,     /* name of option */
+                       (char *) &flags,  /* the cast is historical cruft */
+                       sizeof(flags));    /* length of option value */
+   if (res < 0) {
+      perror("setsockopt TCP_KEEPINTVL");
+      return -1;
+   }
+
+#ifdef TCP_USER_TIMEOUT
+   // Unacknowledged data older than this errors the socket, which covers
+   // a peer that stopped acking while we still have bytes in flight
+   if (fastFail) {
+      flags = FAILOVER_USER_TIMEOUT_MS;
+      if (netSetsockopt(ops, sockfd, SOL_TCP, TCP_USER_TIMEOUT, (char *) &flags,
+               sizeof(flags)) < 0)
+         perror("setsockopt TCP_USER_TIMEOUT");
+   }
+#endif
+#endif
+
+   return 0;
+}
+
+// Receive wakeup tuning, for TCP and unix:// sockets alike
+static void configure_rx_options(struct tcpSerialInterfacePriv *self)
+{
+   int val;
+
+   if (self->rcvLowat) {
+      val = self->rcvLowat;
+      if (netSetsockopt(self->ops, self->sockfd, SOL_SOCKET, SO_RCVLOWAT,
+               (char *) &val, sizeof(val)) < 0)
+         perror("setsockopt SO_RCVLOWAT");
+   }
+
+#ifdef SO_BUSY_POLL
+   // Values above net.core.busy_read need CAP_NET_ADMIN
+   if (self->busyPollUs) {
+      val = self->busyPollUs;
+      if (netSetsockopt(self->ops, self->sockfd, SOL_SOCKET, SO_BUSY_POLL,
+               (char *) &val, sizeof(val)) < 0)
+         perror("setsockopt SO_BUSY_POLL");
+   }
+#endif
+}
+
 static int initiate_remote_connection_event(void *arg)
 {
    struct tcpSerialInterfacePriv *self = PRIV(arg);
@@ -333,139 +883,95 @@ static int initiate_remote_connection_event(void *arg)
    int flags;
 
    self->connect_event = NULL;
-   if (!self->server_addr.sin_addr.s_addr || !self->server_addr.sin_port) {
-      return EVENT_REMOVE;
+   if (self->family == AF_UNIX) {
+      if (!self->unix_addr.sun_path[0])
+         return EVENT_REMOVE;
+
+      printf("Connecting to server %s\n", self->unix_addr.sun_path);
    }
+   else {
+      if (!self->server_addr.sin_addr.s_addr || !self->server_addr.sin_port) {
+         return EVENT_REMOVE;
+      }
 
-   printf("Connecting to server %s:%d\n", inet_ntoa(self->server_addr.sin_addr),
-      ntohs(self->server_addr.sin_port));
+      printf("Connecting to server %s:%d\n",
+         inet_ntoa(self->server_addr.sin_addr),
+         ntohs(self->server_addr.sin_port));
+   }
 
-   if ((self->sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+   netNow(self->ops, &self->connectStart);
+   self->tfoPending = 0;
+
+   if ((self->sockfd = netSocket(self->ops, self->family, self->socktype, 0)) < 0) {
       perror("Failed to allocate socket");
-      self->connect_event = EVT_sched_add(self->evt_loop,
+      self->connect_event = netSchedAdd(self->ops, self->evt_loop,
         CONNECT_RETRY_TIME, &initiate_remote_connection_event, self);
       if (self->connectCallback)
          (*self->connectCallback)(0, self->opaque);
       return EVENT_REMOVE;
    }
 
-   flags = fcntl(self->sockfd, F_GETFL, 0);
+   flags = netFcntl(self->ops, self->sockfd, F_GETFL, 0);
    if (flags < 0) {
       perror("nonblock");
-      close(self->sockfd);
+      netClose(self->ops, self->sockfd);
       self->sockfd = 0;
-      self->connect_event = EVT_sched_add(self->evt_loop,
+      self->connect_event = netSchedAdd(self->ops, self->evt_loop,
         CONNECT_RETRY_TIME, &initiate_remote_connection_event, self);
       if (self->connectCallback)
          (*self->connectCallback)(0, self->opaque);
       return EVENT_REMOVE;
    }
 
-   if (fcntl(self->sockfd, F_SETFL, flags | O_NONBLOCK) < 0) {
+   if (netFcntl(self->ops, self->sockfd, F_SETFL, flags | O_NONBLOCK) < 0) {
       perror("nonblock2");
-      close(self->sockfd);
-      self->sockfd = 0;
-      self->connect_event = EVT_sched_add(self->evt_loop,
-        CONNECT_RETRY_TIME, &initiate_remote_connection_event, self);
-      if (self->connectCallback)
-         (*self->connectCallback)(0, self->opaque);
-      return EVENT_REMOVE;
-   }
-
-   flags = 1;
-   res = setsockopt(self->sockfd,            /* socket affected */
-                    IPPROTO_TCP,     /* set option at TCP level */
-                    TCP_NODELAY,     /* name of option */
-                    (char *) &flags,  /* the cast is historical cruft */
-                    sizeof(flags));    /* length of option value */
-   if (res < 0) {
-      perror("setsockopt");
-      close(self->sockfd);
-      self->sockfd = 0;
-      self->connect_event = EVT_sched_add(self->evt_loop,
-        CONNECT_RETRY_TIME, &initiate_remote_connection_event, self);
-      if (self->connectCallback)
-         (*self->connectCallback)(0, self->opaque);
-      return EVENT_REMOVE;
-   }
-
-   flags = 1;
-   res = setsockopt(self->sockfd,            /* socket affected */
-                    SOL_SOCKET,     /* set option at TCP level */
-                    SO_KEEPALIVE,     /* name of option */
-                    (char *) &flags,  /* the cast is historical cruft */
-                    sizeof(flags));    /* length of option value */
-   if (res < 0) {
-      perror("setsockopt SO_KEEPALIVE");
-      close(self->sockfd);
-      self->sockfd = 0;
-      self->connect_event = EVT_sched_add(self->evt_loop,
-        CONNECT_RETRY_TIME, &initiate_remote_connection_event, self);
-      if (self->connectCallback)
-         (*self->connectCallback)(0, self->opaque);
-      return EVENT_REMOVE;
-   }
-
-#ifndef __APPLE__
-   flags = 6;
-   res = setsockopt(self->sockfd,            /* socket affected */
-                    SOL_TCP,     /* set option at TCP level */
-                    TCP_KEEPCNT,     /* name of option */
-                    (char *) &flags,  /* the cast is historical cruft */
-                    sizeof(flags));    /* length of option value */
-   if (res < 0) {
-      perror("setsockopt TCP_KEEPCNT");
-      close(self->sockfd);
+      netClose(self->ops, self->sockfd);
       self->sockfd = 0;
-      self->connect_event = EVT_sched_add(self->evt_loop,
+      self->connect_event = netSchedAdd(self->ops, self->evt_loop,
         CONNECT_RETRY_TIME, &initiate_remote_connection_event, self);
       if (self->connectCallback)
          (*self->connectCallback)(0, self->opaque);
       return EVENT_REMOVE;
    }
 
-   flags = 5;
-   res = setsockopt(self->sockfd,            /* socket affected */
-                    SOL_TCP,     /* set option at TCP level */
-                    TCP_KEEPIDLE,     /* name of option */
-                    (char *) &flags,  /* the cast is historical cruft */
-                    sizeof(flags));    /* length of option value */
-   if (res < 0) {
-      perror("setsockopt TCP_KEEPIDLE");
-      close(self->sockfd);
+   if (self->family == AF_INET && configure_tcp_options(self->ops,
+            self->sockfd, self->fastFail) < 0) {
+      netClose(self->ops, self->sockfd);
       self->sockfd = 0;
-      self->connect_event = EVT_sched_add(self->evt_loop,
+      self->connect_event = netSchedAdd(self->ops, self->evt_loop,
         CONNECT_RETRY_TIME, &initiate_remote_connection_event, self);
       if (self->connectCallback)
          (*self->connectCallback)(0, self->opaque);
       return EVENT_REMOVE;
    }
 
-   flags = 5;
-   res = setsockopt(self->sockfd,            /* socket affected */
-                    SOL_TCP,     /* set option at TCP level */
-                    TCP_KEEPINTVL,     /* name of option */
-                    (char *) &flags,  /* the cast is historical cruft */
-                    sizeof(flags));    /* length of option value */
-   if (res < 0) {
-      perror("setsockopt TCP_KEEPINTVL");
-      close(self->sockfd);
-      self->sockfd = 0;
-      self->connect_event = EVT_sched_add(self->evt_loop,
-        CONNECT_RETRY_TIME, &initiate_remote_connection_event, self);
-      if (self->connectCallback)
-         (*self->connectCallback)(0, self->opaque);
-      return EVENT_REMOVE;
+   configure_rx_options(self);
+
+#ifdef TCP_FASTOPEN_CONNECT
+   // connect() returns at once and the SYN leaves with the first write
+   if (self->family == AF_INET && (self->flags & SERIAL_OPT_FASTOPEN)) {
+      flags = 1;
+      if (netSetsockopt(self->ops, self->sockfd, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+               (char *) &flags, sizeof(flags)) < 0)
+         perror("setsockopt TCP_FASTOPEN_CONNECT, using plain connect");
+      else
+         self->tfoPending = 1;
    }
 #endif
 
-   res = connect(self->sockfd, (struct sockaddr *)&self->server_addr,
-         sizeof(self->server_addr));
+   PROBE2(tcp_connect, TCP_LINK(self), self->sockfd);
+   if (self->family == AF_UNIX)
+      res = netConnect(self->ops, self->sockfd, (struct sockaddr *)&self->unix_addr,
+            sizeof(self->unix_addr));
+   else
+      res = netConnect(self->ops, self->sockfd, (struct sockaddr *)&self->server_addr,
+            sizeof(self->server_addr));
    if (res < 0 && errno != EINPROGRESS) {
       perror("connect");
-      close(self->sockfd);
+      PROBE2(tcp_connect_fail, TCP_LINK(self), errno);
+      netClose(self->ops, self->sockfd);
       self->sockfd = 0;
-      self->connect_event = EVT_sched_add(self->evt_loop,
+      self->connect_event = netSchedAdd(self->ops, self->evt_loop,
         CONNECT_RETRY_TIME, &initiate_remote_connection_event, self);
       if (self->connectCallback)
          (*self->connectCallback)(0, self->opaque);
@@ -473,18 +979,19 @@ static int initiate_remote_connection_event(void *arg)
    }
 
    if (res == 0) {
-      EVT_fd_add(self->evt_loop, self->sockfd, EVENT_FD_READ,
-         &tcpReadEvent, self);
+      sock_start_reading(self);
 
-      self->read_reg = 1;
-
-      if (self->connectCallback) {
-         EVT_sched_add(self->evt_loop,
+      if (self->flags & SERIAL_OPT_FASTOPEN) {
+         if (self->connectCallback)
+            (*self->connectCallback)(1, self->opaque);
+      }
+      else if (self->connectCallback) {
+         netSchedAdd(self->ops, self->evt_loop,
                EVT_ms2tv(0), &sock_notify_connect, self);
       }
    }
    else {
-      EVT_fd_add(self->evt_loop, self->sockfd, EVENT_FD_WRITE,
+      netFdAdd(self->ops, self->evt_loop, self->sockfd, EVENT_FD_WRITE,
          &sock_connect_callback, self);
 
       self->connect_reg = 1;
@@ -493,29 +1000,24 @@ static int initiate_remote_connection_event(void *arg)
    return EVENT_REMOVE;
 }
 
-int tcpSerialInit(struct serialInterface **si,
+// Allocate and fill in everything common to tcp:// and unix:// links
+static struct tcpSerialInterfacePriv *sockSerialAlloc(
+                  struct serialInterface **si,
                   struct EventState *evt_loop,
                   serialReadCB readCallback,
                   serialConnectCB connectCallback,
-                  const char *devFile,
-                  int baudRate,
                   const char *eolMarker,
-                  void *opaque)
+                  void *opaque,
+                  const struct serialOptions *opts)
 {
-   struct hostent *hp;
-
-   if (!devFile && 0 != strncasecmp("tcp://", devFile, 6))
-      return 0;
-
    // Allocate memory for serial struct
    *si = (struct serialInterface *) malloc(
                sizeof(struct tcpSerialInterfacePriv));
    if (*si == NULL) {
       DBG_print(DBG_LEVEL_WARN, "Insufficient memory\n");
-      return -1;
+      return NULL;
    }
    memset(*si, 0, sizeof(struct tcpSerialInterfacePriv));
-   struct tcpSerialInterfacePriv *self = PRIV(*si);
 
    // Copy the end-of-line marker
    if (eolMarker)
@@ -525,16 +1027,80 @@ int tcpSerialInit(struct serialInterface **si,
 
    (*si)->write = tcpSerialWrite;
    (*si)->cleanup = tcpSerialCleanup;
+   (*si)->stats = tcpSerialStats;
    PRIV(*si)->readCB = readCallback;
    PRIV(*si)->evt_loop = evt_loop;
    PRIV(*si)->opaque = opaque;
    PRIV(*si)->readBytes = 0;
-   PRIV(*si)->server_name = strdup(&devFile[6]);
    PRIV(*si)->connectCallback = connectCallback;
+   PRIV(*si)->flags = opts ? opts->flags : 0;
+   PRIV(*si)->readSize = SERIAL_DEFAULT_BUFFER_SIZE;
+   // One byte of the buffer holds the terminator
+   if (opts && opts->readBufferSize > 1)
+      PRIV(*si)->readSize = opts->readBufferSize;
+   PRIV(*si)->readBase = PRIV(*si)->readSize;
+   PRIV(*si)->highWater = SERIAL_DEFAULT_QUEUE_LIMIT;
+   if (opts && opts->highWater)
+      PRIV(*si)->highWater = opts->highWater;
+   PRIV(*si)->writableCB = opts ? opts->writableCallback : NULL;
+   PRIV(*si)->socktype = SOCK_STREAM;
+   PRIV(*si)->ops = opts && opts->netOps ? opts->netOps : &netSysOps;
+   PRIV(*si)->rcvLowat = opts ? opts->rcvLowat : 0;
+   PRIV(*si)->busyPollUs = opts ? opts->busyPollUs : 0;
+
+   // io_uring needs real sockets
+   if (PRIV(*si)->ops != &netSysOps)
+      PRIV(*si)->flags &= ~SERIAL_OPT_URING;
+
+   if (PRIV(*si)->flags & SERIAL_OPT_PREALLOC) {
+      if (bufpoolReserve(&PRIV(*si)->readRes, PRIV(*si)->readBase, 1) < 0) {
+         DBG_print(DBG_LEVEL_WARN, "Insufficient memory\n");
+         free(PRIV(*si)->eolMarker);
+         free(*si);
+         return NULL;
+      }
+      if (bufpoolReserve(&PRIV(*si)->nodeRes, SERIAL_PREALLOC_NODE_SIZE,
+            SERIAL_PREALLOC_NODES) < 0) {
+         DBG_print(DBG_LEVEL_WARN, "Insufficient memory\n");
+         bufpoolUnreserve(&PRIV(*si)->readRes);
+         free(PRIV(*si)->eolMarker);
+         free(*si);
+         return NULL;
+      }
+      PRIV(*si)->prealloc = 1;
+   }
+
+   return PRIV(*si);
+}
+
+static int tcpSerialOpen(struct serialInterface **si,
+                  struct EventState *evt_loop,
+                  serialReadCB readCallback,
+                  serialConnectCB connectCallback,
+                  const char *devFile,
+                  const char *eolMarker,
+                  void *opaque,
+                  const struct serialOptions *opts,
+                  int fastFail)
+{
+   struct tcpSerialInterfacePriv *self;
+   struct hostent *hp;
+
+   if (!devFile && 0 != strncasecmp("tcp://", devFile, 6))
+      return 0;
+
+   self = sockSerialAlloc(si, evt_loop, readCallback, connectCallback,
+         eolMarker, opaque, opts);
+   if (!self)
+      return -1;
+
+   self->fastFail = fastFail;
+   self->family = AF_INET;
+   self->server_name = strdup(&devFile[6]);
 
    char *split = strchr(self->server_name, ':');
    if (split) {
-      PRIV(*si)->server_addr.sin_port = htons(atol(split + 1));
+      self->server_addr.sin_port = htons(atol(split + 1));
       *split = 0;
    }
 
@@ -545,7 +1111,425 @@ int tcpSerialInit(struct serialInterface **si,
 
 
    self->evt_loop = evt_loop;
-   PRIV(self)->connect_event = EVT_sched_add(self->evt_loop,
+   if (self->flags & SERIAL_OPT_FASTOPEN)
+      initiate_remote_connection_event(self);
+   else
+      PRIV(self)->connect_event = netSchedAdd(self->ops, self->evt_loop,
+                     EVT_ms2tv(1), &initiate_remote_connection_event, self);
+
+   return 0;
+}
+
+/* Hot standby groups.  Every endpoint of a tcp:// link with standbys gets
+ * its own connection, kept open.  Writes go to the active member.  When it
+ * fails, its unsent WriteNodes move to the next connected member in order.
+ * Bytes the dead socket already passed to its kernel are not tracked, so
+ * frames it had fully sent are delivered at most once.
+ */
+struct failoverMember {
+   struct failoverPriv *group;
+   struct serialInterface *si;
+   int up;
+};
+
+struct failoverPriv {
+   int (*cleanup)(struct failoverPriv *self);
+   int (*write)(struct failoverPriv *self, void *src, int bytes);
+   struct serialStats *(*stats)(struct failoverPriv *self);
+
+   // Private fields
+   struct EventState *evt_loop;
+   const struct netOps *ops;
+   struct failoverMember members[FAILOVER_MAX_ENDPOINTS];
+   int count;
+   struct failoverMember *active; // Member carrying traffic, NULL if none
+   struct failoverMember *orphan; // Failed member whose queue needs a home
+   struct timeval failStart; // When the orphan was detected as failed
+   int reportedUp; // Owner was last told the link is up
+   int closing;
+   void *watchdog; // Write stall check
+   uint64_t stallBytes; // Active member's bytesSent at the last check
+   int stallMs; // How long the active member has made no progress
+   uint64_t dropped; // Writes dropped while no member was connected
+   serialReadCB readCB;
+   serialConnectCB connectCallback;
+   serialWritableCB writableCB;
+   void *opaque;
+   struct serialStats st;
+};
+
+#define FAILOVER(arg) ((struct failoverPriv *) (arg))
+
+// Hand a failed member's unsent nodes to the new active member, oldest
+// first, behind any node it is part way through.  A node the dead peer
+// only got part of is resent whole.
+static void failoverMoveQueue(struct tcpSerialInterfacePriv *from,
+      struct tcpSerialInterfacePriv *to)
+{
+   struct WriteNode *wr;
+   uint32_t moved = 0;
+
+   if (from->writes)
+      from->writes->offset = 0;
+
+   // The failed member may be the first one back, keeping its own queue
+   if (from != to && from->writes) {
+      if (from->write_reg) {
+         netFdRemove(from->ops, from->evt_loop, from->sockfd, EVENT_FD_WRITE);
+         from->write_reg = 0;
+      }
+
+      for (wr = from->writes; wr; wr = wr->next)
+         moved += wr->data_len;
+
+      // Anything in front of a partly written node would land inside it
+      if (to->writes && to->writes->offset) {
+         from->writes_tail->next = to->writes->next;
+         if (to->writes_tail == to->writes)
+            to->writes_tail = from->writes_tail;
+         to->writes->next = from->writes;
+      }
+      else {
+         from->writes_tail->next = to->writes;
+         if (!to->writes)
+            to->writes_tail = from->writes_tail;
+         to->writes = from->writes;
+      }
+      from->writes = from->writes_tail = NULL;
+
+      from->queuedBytes = 0;
+      serialStatsQueue(&from->st, 0);
+      to->queuedBytes += moved;
+   }
+   else if (from == to) {
+      to->queuedBytes = 0;
+      for (wr = to->writes; wr; wr = wr->next)
+         to->queuedBytes += wr->data_len - wr->offset;
+   }
+   serialStatsQueue(&to->st, to->queuedBytes);
+
+   if (to->writes && !to->write_reg && !to->connect_reg && to->read_reg) {
+      netFdAdd(to->ops, to->evt_loop, to->sockfd, EVENT_FD_WRITE,
+         &sock_write_callback, to);
+      to->write_reg = 1;
+   }
+}
+
+static void failoverActivate(struct failoverPriv *self,
+      struct failoverMember *m)
+{
+   struct timeval now, diff;
+
+   self->active = m;
+   self->stallBytes = PRIV(m->si)->st.bytesSent;
+   self->stallMs = 0;
+
+   if (self->orphan) {
+      failoverMoveQueue(PRIV(self->orphan->si), PRIV(m->si));
+      self->orphan = NULL;
+
+      netNow(self->ops, &now);
+      timersub(&now, &self->failStart, &diff);
+      self->st.failovers++;
+      self->st.failoverTimeUs = (uint64_t)diff.tv_sec * 1000000 +
+         diff.tv_usec;
+      printf("Failed over to %s:%d in %llu us\n",
+            inet_ntoa(PRIV(m->si)->server_addr.sin_addr),
+            ntohs(PRIV(m->si)->server_addr.sin_port),
+            (unsigned long long)self->st.failoverTimeUs);
+   }
+
+   if (!self->reportedUp) {
+      self->reportedUp = 1;
+      if (self->connectCallback)
+         (*self->connectCallback)(1, self->opaque);
+   }
+}
+
+static void failoverMemberRead(void *buffer, int bytes, void *arg)
+{
+   struct failoverMember *m = (struct failoverMember *)arg;
+
+   if (m->group->readCB)
+      m->group->readCB(buffer, bytes, m->group->opaque);
+}
+
+static void failoverMemberWritable(uint32_t queued, void *arg)
+{
+   struct failoverMember *m = (struct failoverMember *)arg;
+
+   if (m == m->group->active && m->group->writableCB)
+      m->group->writableCB(queued, m->group->opaque);
+}
+
+static void failoverMemberConnect(int status, void *arg)
+{
+   struct failoverMember *m = (struct failoverMember *)arg;
+   struct failoverPriv *self = m->group;
+   int i;
+
+   if (self->closing)
+      return;
+
+   if (status) {
+      m->up = 1;
+      if (!self->active)
+         failoverActivate(self, m);
+      return;
+   }
+
+   // Member connect callbacks can report the same loss more than once
+   m->up = 0;
+   if (m != self->active)
+      return;
+
+   self->active = NULL;
+   if (!self->orphan) {
+      self->orphan = m;
+      netNow(self->ops, &self->failStart);
+   }
+
+   for (i = 0; i < self->count; i++)
+      if (self->members[i].up) {
+         failoverActivate(self, &self->members[i]);
+         return;
+      }
+
+   if (self->reportedUp) {
+      self->reportedUp = 0;
+      if (self->connectCallback)
+         (*self->connectCallback)(0, self->opaque);
+   }
+}
+
+// Fail the active member if it holds queued data but sends nothing
+static int failoverWatchdog(void *arg)
+{
+   struct failoverPriv *self = FAILOVER(arg);
+   struct tcpSerialInterfacePriv *link;
+
+   if (!self->active)
+      return EVENT_KEEP;
+
+   link = PRIV(self->active->si);
+   if (!link->queuedBytes || link->st.bytesSent != self->stallBytes) {
+      self->stallBytes = link->st.bytesSent;
+      self->stallMs = 0;
+      return EVENT_KEEP;
+   }
+
+   self->stallMs += FAILOVER_CHECK_MS;
+   if (self->stallMs >= FAILOVER_STALL_MS && link->read_reg) {
+      printf("Write stall on %s:%d\n", inet_ntoa(link->server_addr.sin_addr),
+            ntohs(link->server_addr.sin_port));
+      sock_stop_reading(link);
+      tcpReadFailed(link);
+   }
+
+   return EVENT_KEEP;
+}
+
+static int failoverWrite(struct serialInterface *si, void *src, int bytes)
+{
+   struct failoverPriv *self = FAILOVER(si);
+
+   if (!self->active) {
+      self->dropped++;
+      return SERIAL_WRITE_DROPPED;
+   }
+
+   return self->active->si->write(self->active->si, src, bytes);
+}
+
+static struct serialStats *failoverStats(struct serialInterface *si)
+{
+   struct failoverPriv *self = FAILOVER(si);
+   struct serialStats *st = &self->st, *ms;
+   int i;
+
+   // Transport counters are summed; CRC and framing belong to the owner
+   st->bytesSent = st->bytesReceived = 0;
+   st->framesSent = st->framesReceived = 0;
+   st->shortWrites = st->blockedWrites = st->reconnects = 0;
+   st->readWakeups = st->readCalls = 0;
+   st->droppedWrites = self->dropped;
+   for (i = 0; i < self->count; i++) {
+      ms = &PRIV(self->members[i].si)->st;
+      st->bytesSent += ms->bytesSent;
+      st->bytesReceived += ms->bytesReceived;
+      st->framesSent += ms->framesSent;
+      st->framesReceived += ms->framesReceived;
+      st->shortWrites += ms->shortWrites;
+      st->droppedWrites += ms->droppedWrites;
+      st->blockedWrites += ms->blockedWrites;
+      st->reconnects += ms->reconnects;
+      st->readWakeups += ms->readWakeups;
+      st->readCalls += ms->readCalls;
+      if (ms->queuePeak > st->queuePeak)
+         st->queuePeak = ms->queuePeak;
+   }
+
+   if (self->active) {
+      ms = &PRIV(self->active->si)->st;
+      st->connectTimeUs = ms->connectTimeUs;
+      st->queueDepth = ms->queueDepth;
+   }
+
+   return st;
+}
+
+static int failoverCleanup(struct serialInterface *si)
+{
+   struct failoverPriv *self = FAILOVER(si);
+   int i;
+
+   self->closing = 1;
+   if (self->watchdog)
+      netSchedRemove(self->ops, self->evt_loop, self->watchdog);
+
+   // Queues hold nodes from each other's reserves after a failover, so
+   // empty them all before any member frees its reserve
+   for (i = 0; i < self->count; i++)
+      freeWrites(PRIV(self->members[i].si));
+   for (i = 0; i < self->count; i++)
+      self->members[i].si->cleanup(self->members[i].si);
+
+   if (self->connectCallback)
+      (*self->connectCallback)(0, self->opaque);
+
+   free(si);
+
+   return 0;
+}
+
+static void failoverAddMember(struct failoverPriv *self,
+      const char *endpoint, const char *eolMarker,
+      const struct serialOptions *memberOpts)
+{
+   struct failoverMember *m = &self->members[self->count];
+   char url[256];
+
+   if (strncasecmp("tcp://", endpoint, 6) == 0)
+      endpoint += 6;
+   if (!*endpoint)
+      return;
+   if (self->count == FAILOVER_MAX_ENDPOINTS) {
+      DBG_print(DBG_LEVEL_WARN, "Ignoring standby %s\n", endpoint);
+      return;
+   }
+
+   snprintf(url, sizeof(url), "tcp://%s", endpoint);
+   m->group = self;
+   if (tcpSerialOpen(&m->si, self->evt_loop, &failoverMemberRead,
+            &failoverMemberConnect, url, eolMarker, m, memberOpts, 1) < 0 ||
+         !m->si)
+      return;
+   self->count++;
+}
+
+// Open the primary and every standby, each with its own connection
+static int failoverInit(struct serialInterface **si,
+                  struct EventState *evt_loop,
+                  serialReadCB readCallback,
+                  serialConnectCB connectCallback,
+                  const char *devFile,
+                  const char *eolMarker,
+                  void *opaque,
+                  const struct serialOptions *opts)
+{
+   struct failoverPriv *self;
+   struct serialOptions memberOpts = *opts;
+   char *list, *endpoint, *save;
+
+   self = (struct failoverPriv *)calloc(1, sizeof(*self));
+   list = strdup(opts->standby);
+   if (!self || !list) {
+      DBG_print(DBG_LEVEL_WARN, "Insufficient memory\n");
+      free(self);
+      free(list);
+      return -1;
+   }
+
+   *si = (struct serialInterface *)self;
+   (*si)->write = failoverWrite;
+   (*si)->cleanup = failoverCleanup;
+   (*si)->stats = failoverStats;
+   self->evt_loop = evt_loop;
+   self->ops = opts->netOps ? opts->netOps : &netSysOps;
+   self->readCB = readCallback;
+   self->connectCallback = connectCallback;
+   self->writableCB = opts->writableCallback;
+   self->opaque = opaque;
+
+   // Queued nodes can only move between fd-event members
+   memberOpts.standby = NULL;
+   memberOpts.writableCallback = &failoverMemberWritable;
+   memberOpts.flags &= ~(SERIAL_OPT_URING | SERIAL_OPT_FASTOPEN);
+
+   failoverAddMember(self, devFile, eolMarker, &memberOpts);
+   for (endpoint = strtok_r(list, " \t", &save); endpoint;
+         endpoint = strtok_r(NULL, " \t", &save))
+      failoverAddMember(self, endpoint, eolMarker, &memberOpts);
+   free(list);
+
+   self->watchdog = netSchedAdd(self->ops, evt_loop,
+         EVT_ms2tv(FAILOVER_CHECK_MS), &failoverWatchdog, self);
+
+   return 0;
+}
+
+int tcpSerialInit(struct serialInterface **si,
+                  struct EventState *evt_loop,
+                  serialReadCB readCallback,
+                  serialConnectCB connectCallback,
+                  const char *devFile,
+                  int baudRate,
+                  const char *eolMarker,
+                  void *opaque,
+                  const struct serialOptions *opts)
+{
+   if (opts && opts->standby && *opts->standby)
+      return failoverInit(si, evt_loop, readCallback, connectCallback,
+            devFile, eolMarker, opaque, opts);
+
+   return tcpSerialOpen(si, evt_loop, readCallback, connectCallback,
+         devFile, eolMarker, opaque, opts, 0);
+}
+
+int unixSerialInit(struct serialInterface **si,
+                  struct EventState *evt_loop,
+                  serialReadCB readCallback,
+                  serialConnectCB connectCallback,
+                  const char *devFile,
+                  int baudRate,
+                  const char *eolMarker,
+                  void *opaque,
+                  const struct serialOptions *opts)
+{
+   struct tcpSerialInterfacePriv *self;
+   const char *path;
+
+   if (!devFile || 0 != strncasecmp("unix://", devFile, 7))
+      return -1;
+
+   path = &devFile[7];
+   if (!*path || strlen(path) >= sizeof(self->unix_addr.sun_path)) {
+      DBG_print(DBG_LEVEL_WARN, "Invalid UNIX socket path %s\n", devFile);
+      return -1;
+   }
+
+   self = sockSerialAlloc(si, evt_loop, readCallback, connectCallback,
+         eolMarker, opaque, opts);
+   if (!self)
+      return -1;
+
+   self->family = AF_UNIX;
+   if (self->flags & SERIAL_OPT_SEQPACKET)
+      self->socktype = SOCK_SEQPACKET;
+   self->unix_addr.sun_family = AF_UNIX;
+   strcpy(self->unix_addr.sun_path, path);
+
+   self->connect_event = netSchedAdd(self->ops, self->evt_loop,
                      EVT_ms2tv(1), &initiate_remote_connection_event, self);
 
    return 0;
@@ -15,6 +15,7 @@ extern "C" {
  * @param readCallback function pointer to callback function that handles reads.
  * @param readCallback function pointer to callback function that handles reads.
  * @param opaque pointer to whatever developer desires. Passed to read callback.
+ * @param opts optional settings, or NULL for the defaults.
  * @return -1 on error, 0 on success. Check /var/log/syslog on error.
  */
 int tcpSerialInit(struct serialInterface **si,
@@ -24,7 +25,25 @@ int tcpSerialInit(struct serialInterface **si,
                   const char *deviceFile,
                   int baudRate,
                   const char *eolMarker,
-                  void *opaque);
+                  void *opaque,
+                  const struct serialOptions *opts);
+
+/* Constructor for UNIX-domain socket serial interface.  Takes a
+ *   unix:///path URL and shares the TCP reconnect behavior.  With
+ *   SERIAL_OPT_SEQPACKET each write is sent as one packet and each packet
+ *   is read whole, so frame boundaries survive without re-framing.
+ *   Parameters are the same as tcpSerialInit.
+ * @return -1 on error, 0 on success. Check /var/log/syslog on error.
+ */
+int unixSerialInit(struct serialInterface **si,
+                  struct EventState *evl_loop,
+                  serialReadCB readCallback,
+                  serialConnectCB connectCallback,
+                  const char *deviceFile,
+                  int baudRate,
+                  const char *eolMarker,
+                  void *opaque,
+                  const struct serialOptions *opts);
 
 #ifdef __cplusplus
 }
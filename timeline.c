@@ -0,0 +1,372 @@
+#define _GNU_SOURCE // strptime, timegm
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdint.h>
+#include <sys/timerfd.h>
+#include <sys/prctl.h>
+#include "kiss.h"
+#include "timeline.h"
+
+#define TIMELINE_MAX_CMD 1021
+
+struct timeline {
+   struct timelineEntry *entries;
+   int count;
+   int next; // First entry not yet fired
+   int tfd;
+   int registered; // tfd is on the event loop
+   struct EventState *evt_loop;
+   struct serialInterface *si;
+   timelineDoneCB doneCB;
+   void *opaque;
+};
+
+static int64_t tsDiffNs(const struct timespec *a, const struct timespec *b)
+{
+   return (int64_t)(a->tv_sec - b->tv_sec) * 1000000000LL +
+      (a->tv_nsec - b->tv_nsec);
+}
+
+static int tsCompare(const void *a, const void *b)
+{
+   int64_t d = tsDiffNs(&((const struct timelineEntry *)a)->at,
+         &((const struct timelineEntry *)b)->at);
+
+   return d < 0 ? -1 : d > 0;
+}
+
+// Parse the fractional part that follows a '.', advancing *str
+static long parseFraction(const char **str)
+{
+   long ns = 0, scale = 100000000;
+   const char *s = *str;
+
+   if (*s != '.')
+      return 0;
+   for (s++; *s >= '0' && *s <= '9'; s++, scale /= 10)
+      ns += (*s - '0') * scale;
+   *str = s;
+
+   return ns;
+}
+
+// Release time at the start of a line; returns the rest of the line
+static const char *parseTime(const char *s, const struct timespec *base,
+      struct timespec *at)
+{
+   struct tm tm;
+   const char *end;
+   char *num;
+
+   if (*s == '+') {
+      at->tv_sec = strtol(s + 1, &num, 10);
+      end = num;
+      at->tv_nsec = parseFraction(&end);
+      at->tv_sec += base->tv_sec;
+      at->tv_nsec += base->tv_nsec;
+      if (at->tv_nsec >= 1000000000) {
+         at->tv_nsec -= 1000000000;
+         at->tv_sec++;
+      }
+      return end == s + 1 ? NULL : end;
+   }
+
+   memset(&tm, 0, sizeof(tm));
+   end = strptime(s, "%Y-%m-%dT%H:%M:%S", &tm);
+   if (end) {
+      at->tv_nsec = parseFraction(&end);
+      if (*end == 'Z')
+         end++;
+      at->tv_sec = timegm(&tm);
+      return end;
+   }
+
+   at->tv_sec = strtol(s, &num, 10);
+   if (num == s)
+      return NULL;
+   end = num;
+   at->tv_nsec = parseFraction(&end);
+
+   return end;
+}
+
+static int addEntry(struct timeline *tl, const struct timespec *at,
+      const unsigned char *cmd, int cmdLen)
+{
+   unsigned char kiss[2 * TIMELINE_MAX_CMD + 9];
+   struct timelineEntry *entries, *e;
+   int len;
+
+   len = kissCommand(kiss, sizeof(kiss), cmd, cmdLen);
+   if (len < 0)
+      return -1;
+
+   entries = realloc(tl->entries, (tl->count + 1) * sizeof(*entries));
+   if (!entries)
+      return -1;
+   tl->entries = entries;
+
+   e = &tl->entries[tl->count];
+   memset(e, 0, sizeof(*e));
+   e->frame = malloc(len);
+   if (!e->frame)
+      return -1;
+   memcpy(e->frame, kiss, len);
+   e->len = len;
+   e->at = *at;
+   tl->count++;
+
+   return 0;
+}
+
+struct timeline *timelineLoad(const char *path)
+{
+   unsigned char cmd[TIMELINE_MAX_CMD];
+   struct timeline *tl;
+   struct timespec base, at;
+   const char *s;
+   char *line = NULL, *end;
+   size_t cap = 0;
+   int lineNo = 0, cmdLen;
+   FILE *fp;
+
+   fp = fopen(path, "r");
+   if (!fp) {
+      perror(path);
+      return NULL;
+   }
+
+   tl = (struct timeline *)calloc(1, sizeof(*tl));
+   if (!tl) {
+      fclose(fp);
+      return NULL;
+   }
+   tl->tfd = -1;
+
+   clock_gettime(CLOCK_REALTIME, &base);
+   while (getline(&line, &cap, fp) >= 0) {
+      lineNo++;
+      for (s = line; *s == ' ' || *s == '\t'; s++)
+         ;
+      if (*s == '#' || *s == '\n' || *s == '\r' || !*s)
+         continue;
+
+      s = parseTime(s, &base, &at);
+      if (!s) {
+         fprintf(stderr, "%s:%d: bad release time\n", path, lineNo);
+         goto fail;
+      }
+
+      for (cmdLen = 0; cmdLen < sizeof(cmd); cmdLen++) {
+         long val = strtol(s, &end, 0);
+
+         if (end == s)
+            break;
+         cmd[cmdLen] = val;
+         s = end;
+      }
+      if (cmdLen == 0 || addEntry(tl, &at, cmd, cmdLen) < 0) {
+         fprintf(stderr, "%s:%d: bad command\n", path, lineNo);
+         goto fail;
+      }
+   }
+
+   free(line);
+   fclose(fp);
+
+   qsort(tl->entries, tl->count, sizeof(*tl->entries), &tsCompare);
+
+   return tl;
+
+fail:
+   free(line);
+   fclose(fp);
+   timelineFree(tl);
+   return NULL;
+}
+
+int timelineCount(const struct timeline *tl)
+{
+   return tl->count;
+}
+
+static int armTimer(struct timeline *tl)
+{
+   struct itimerspec its;
+
+   memset(&its, 0, sizeof(its));
+   its.it_value = tl->entries[tl->next].at;
+   // A zero it_value would disarm, so round an epoch-0 entry up
+   if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+      its.it_value.tv_nsec = 1;
+
+   // CANCEL_ON_SET wakes us if the wall clock is stepped, e.g. by NTP
+   return timerfd_settime(tl->tfd,
+         TFD_TIMER_ABSTIME | TFD_TIMER_CANCEL_ON_SET, &its, NULL);
+}
+
+// Bytes the link has handed to the socket or tty so far
+static uint64_t bytesSent(struct serialInterface *si)
+{
+   struct serialStats *st = si->stats ? si->stats(si) : NULL;
+
+   return st ? st->bytesSent : 0;
+}
+
+static int timerEvent(int fd, char type, void *arg)
+{
+   struct timeline *tl = (struct timeline *)arg;
+   struct timelineEntry *e;
+   struct timespec now;
+   uint64_t expirations, sent;
+
+   // ECANCELED means the clock was stepped; re-arm against the new clock
+   if (read(tl->tfd, &expirations, sizeof(expirations)) < 0 &&
+         errno != EAGAIN && errno != ECANCELED)
+      return EVENT_KEEP;
+
+   clock_gettime(CLOCK_REALTIME, &now);
+   while (tl->next < tl->count &&
+         tsDiffNs(&tl->entries[tl->next].at, &now) <= 0) {
+      e = &tl->entries[tl->next++];
+      sent = bytesSent(tl->si);
+      e->result = tl->si->write(tl->si, e->frame, e->len);
+      clock_gettime(CLOCK_REALTIME, &now);
+      // Queued frames are stamped when they reach the socket or tty
+      if (e->result == SERIAL_WRITE_QUEUED &&
+            bytesSent(tl->si) - sent < e->len)
+         e->queued = 1;
+      else
+         e->sent = now;
+   }
+
+   if (tl->next < tl->count) {
+      armTimer(tl);
+      return EVENT_KEEP;
+   }
+
+   tl->registered = 0;
+   if (tl->doneCB)
+      tl->doneCB(tl->opaque);
+
+   return EVENT_REMOVE;
+}
+
+int timelineStart(struct timeline *tl, struct EventState *evt_loop,
+      struct serialInterface *si, timelineDoneCB doneCB, void *opaque)
+{
+   tl->evt_loop = evt_loop;
+   tl->si = si;
+   tl->doneCB = doneCB;
+   tl->opaque = opaque;
+   tl->next = 0;
+
+   if (!tl->count) {
+      if (doneCB)
+         doneCB(opaque);
+      return 0;
+   }
+
+   tl->tfd = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+   if (tl->tfd < 0) {
+      perror("timerfd_create");
+      return -1;
+   }
+
+   // The default 50us timer slack is most of our error budget
+   prctl(PR_SET_TIMERSLACK, 1UL, 0, 0, 0);
+
+   if (armTimer(tl) < 0) {
+      perror("timerfd_settime");
+      close(tl->tfd);
+      tl->tfd = -1;
+      return -1;
+   }
+   EVT_fd_add(evt_loop, tl->tfd, EVENT_FD_READ, &timerEvent, tl);
+   tl->registered = 1;
+
+   return 0;
+}
+
+void timelineWritable(struct timeline *tl, uint32_t queued)
+{
+   struct timespec now;
+   int i;
+
+   if (queued)
+      return;
+
+   clock_gettime(CLOCK_REALTIME, &now);
+   for (i = 0; i < tl->next; i++) {
+      if (tl->entries[i].queued) {
+         tl->entries[i].sent = now;
+         tl->entries[i].queued = 0;
+      }
+   }
+}
+
+static const char *resultName(int result)
+{
+   switch (result) {
+      case SERIAL_WRITE_QUEUED:
+         return "sent";
+      case SERIAL_WRITE_WOULDBLOCK:
+         return "queue-full";
+      default:
+         return "dropped";
+   }
+}
+
+void timelineReport(const struct timeline *tl, FILE *out)
+{
+   const struct timelineEntry *e;
+   int64_t err, maxErr = 0, sumErr = 0;
+   struct tm tm;
+   char when[32];
+   int i, fired = 0;
+
+   for (i = 0; i < tl->count; i++) {
+      e = &tl->entries[i];
+      gmtime_r(&e->at.tv_sec, &tm);
+      strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm);
+
+      if (!e->sent.tv_sec) {
+         fprintf(out, "%3d %s.%06ldZ %s\n", i, when, e->at.tv_nsec / 1000,
+               e->queued ? "still queued" : "not sent");
+         continue;
+      }
+
+      err = tsDiffNs(&e->sent, &e->at) / 1000;
+      fprintf(out, "%3d %s.%06ldZ error %+lld us %s\n", i, when,
+            e->at.tv_nsec / 1000, (long long)err, resultName(e->result));
+      fired++;
+      if (err < 0)
+         err = -err;
+      sumErr += err;
+      if (err > maxErr)
+         maxErr = err;
+   }
+
+   fprintf(out, "timeline: %d of %d fired, mean |error| %lld us, "
+         "max %lld us\n", fired, tl->count,
+         (long long)(fired ? sumErr / fired : 0), (long long)maxErr);
+}
+
+void timelineFree(struct timeline *tl)
+{
+   int i;
+
+   if (!tl)
+      return;
+
+   if (tl->registered)
+      EVT_fd_remove(tl->evt_loop, tl->tfd, EVENT_FD_READ);
+   if (tl->tfd >= 0)
+      close(tl->tfd);
+   for (i = 0; i < tl->count; i++)
+      free(tl->entries[i].frame);
+   free(tl->entries);
+   free(tl);
+}
@@ -0,0 +1,76 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <stdio.h>
+#include <time.h>
+#include <polysat/polysat.h>
+#include "serial.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// One scheduled command, KISS encoded when the timeline is loaded
+struct timelineEntry {
+   struct timespec at;   // Scheduled CLOCK_REALTIME release time
+   struct timespec sent; // When the frame left the link's queue, or the
+                         //   write was refused; zero if neither happened
+   int result;           // SERIAL_WRITE_* value returned by write
+   int queued;           // Written and waiting on the link's queue
+   int len;
+   unsigned char *frame;
+};
+
+struct timeline;
+
+/* Type definition of the callback invoked after the last entry fires.
+ * @param opaque user supplied argument
+ */
+typedef void (*timelineDoneCB)(void *opaque);
+
+/* Load a timeline file.  Each line is a release time followed by the
+ *   command bytes, e.g. "2026-10-18T14:03:07.250Z 0x01 0x02".  Times are
+ *   UTC ISO 8601 with optional fractional seconds, seconds since the epoch,
+ *   or "+seconds" relative to the moment the file is loaded.  Blank lines
+ *   and lines starting with '#' are ignored.  Entries are sorted by time.
+ * @param path the file to read.
+ * @return the timeline, or NULL on error. Errors are printed to stderr.
+ */
+struct timeline *timelineLoad(const char *path);
+
+/* Number of entries in the timeline. */
+int timelineCount(const struct timeline *tl);
+
+/* Arm a CLOCK_REALTIME timerfd on the event loop and write each entry to
+ *   si at its release time.  The link should be opened first so connect
+ *   time is not paid at release.  Entries already due fire immediately.
+ * @param tl the timeline.
+ * @param evt_loop the event loop si runs on.
+ * @param si the link to write to.
+ * @param doneCB function called once every entry has fired, may be NULL.
+ * @param opaque pointer passed through to doneCB.
+ * @return -1 on error, 0 on success.
+ */
+int timelineStart(struct timeline *tl, struct EventState *evt_loop,
+      struct serialInterface *si, timelineDoneCB doneCB, void *opaque);
+
+/* Stamp the entries still on the link's queue once it empties.  Call from
+ *   the link's serialWritableCB while the timeline runs.
+ * @param tl the timeline.
+ * @param queued the bytes still queued, from the callback.
+ */
+void timelineWritable(struct timeline *tl, uint32_t queued);
+
+/* Print one line per entry with its scheduled time, the actual-minus-
+ *   scheduled send error and the write result, then a summary.
+ */
+void timelineReport(const struct timeline *tl, FILE *out);
+
+/* Disarm the timer and free the timeline. */
+void timelineFree(struct timeline *tl);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,432 @@
+#define _GNU_SOURCE // recvmmsg, sendmmsg
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <errno.h>
+#include <stdio.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "udp_serial.h"
+#include "bufpool.h"
+
+// Datagrams moved per sendmmsg/recvmmsg call
+#define UDP_BATCH 16
+
+#define PRIV(arg) ((struct udpSerialInterfacePriv *) (arg))
+
+struct UdpWriteNode {
+   int data_len;
+   struct UdpWriteNode *next;
+   char data[1];
+};
+
+#define WRITENODE_SIZE(bytes) (sizeof(struct UdpWriteNode) + (bytes))
+
+struct udpSerialInterfacePriv {
+   int (*cleanup)(struct udpSerialInterfacePriv *self);
+   int (*write)(struct udpSerialInterfacePriv *self, void *src, int bytes);
+   struct serialStats *(*stats)(struct udpSerialInterfacePriv *self);
+
+   // Private fields
+   int sockfd;
+   struct sockaddr_in server_addr;
+   serialConnectCB connectCallback;
+   serialReadCB readCB; // callback up controlling context
+   struct EventState *evt_loop; // Pointer to proclib process context
+   uint32_t readSize; // Largest datagram accepted
+   void *opaque;
+   int write_reg;
+   struct UdpWriteNode *writes;
+   struct UdpWriteNode *writes_tail;
+   struct serialStats st;
+   uint32_t queuedBytes; // Bytes held in the writes list
+   uint32_t highWater; // queuedBytes limit before writes would block
+   int blocked; // A write returned SERIAL_WRITE_WOULDBLOCK since last notify
+   serialWritableCB writableCB;
+   int prealloc; // SERIAL_OPT_PREALLOC: buffers come from the reserves below
+   struct bufpoolReserved readRes; // The receive batch, this link's alone
+   struct bufpoolReserved nodeRes; // SERIAL_PREALLOC_NODES write nodes
+};
+
+// A preallocated link takes write nodes from its own reserve
+static struct UdpWriteNode *nodeGet(struct udpSerialInterfacePriv *self,
+      int bytes)
+{
+   if (self->prealloc)
+      return bufpoolReservedGet(&self->nodeRes);
+   return bufpoolGet(WRITENODE_SIZE(bytes), NULL);
+}
+
+static void nodePut(struct udpSerialInterfacePriv *self,
+      struct UdpWriteNode *wr)
+{
+   if (self->prealloc)
+      bufpoolReservedPut(&self->nodeRes, wr);
+   else
+      bufpoolPut(wr, WRITENODE_SIZE(wr->data_len));
+}
+
+// Receive batch buffers, from the link's reserve when it has one
+static char *readBuffGet(struct udpSerialInterfacePriv *self)
+{
+   if (self->prealloc)
+      return bufpoolReservedGet(&self->readRes);
+   return bufpoolGet(UDP_BATCH * self->readSize, NULL);
+}
+
+static void readBuffPut(struct udpSerialInterfacePriv *self, char *buff)
+{
+   if (self->prealloc)
+      bufpoolReservedPut(&self->readRes, buff);
+   else
+      bufpoolPut(buff, UDP_BATCH * self->readSize);
+}
+
+static int udpReadEvent(int fd, char type, void *arg)
+{
+   struct udpSerialInterfacePriv *self = PRIV(arg);
+   struct mmsghdr msgs[UDP_BATCH];
+   struct iovec iovs[UDP_BATCH];
+   uint32_t stride = self->readSize;
+   char *buff, discard;
+   int i, res;
+
+   // Left queued the datagram keeps the socket readable and the loop would
+   // spin on it, so it is dropped
+   buff = readBuffGet(self);
+   if (!buff) {
+      DBG_print(DBG_LEVEL_WARN, "Insufficient memory\n");
+      recv(self->sockfd, &discard, 1, MSG_DONTWAIT);
+      return EVENT_KEEP;
+   }
+
+   memset(msgs, 0, sizeof(msgs));
+   for (i = 0; i < UDP_BATCH; i++) {
+      iovs[i].iov_base = buff + i * stride;
+      iovs[i].iov_len = stride;
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+   }
+
+   res = recvmmsg(self->sockfd, msgs, UDP_BATCH, MSG_DONTWAIT, NULL);
+   self->st.readWakeups++;
+   self->st.readCalls++;
+   if (res < 0) {
+      // ICMP errors from the peer surface here; the socket stays usable
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+         DBG_print(DBG_LEVEL_WARN, "UDP receive error: %s\n",
+               strerror(errno));
+      readBuffPut(self, buff);
+      return EVENT_KEEP;
+   }
+
+   for (i = 0; i < res; i++) {
+      self->st.bytesReceived += msgs[i].msg_len;
+      self->st.framesReceived++;
+      if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+         DBG_print(DBG_LEVEL_WARN, "UDP datagram truncated to %u bytes\n",
+               stride);
+      if (self->readCB)
+         self->readCB(iovs[i].iov_base, msgs[i].msg_len, self->opaque);
+   }
+
+   readBuffPut(self, buff);
+
+   return EVENT_KEEP;
+}
+
+// Tell the owner there is room again: when the queue drains, or once it
+// is down to half the high-water mark after a write was refused
+static void udpNotifyWritable(struct udpSerialInterfacePriv *self)
+{
+   if (!self->writableCB)
+      return;
+   if (self->queuedBytes && (!self->blocked ||
+         self->queuedBytes > self->highWater / 2))
+      return;
+
+   self->blocked = 0;
+   self->writableCB(self->queuedBytes, self->opaque);
+}
+
+// Errors about the link rather than the datagram being sent.  Most are an
+// ICMP report for an earlier datagram, which the failed send consumed.
+static int udpLinkError(int err)
+{
+   return err == ECONNREFUSED || err == EHOSTUNREACH ||
+      err == ENETUNREACH || err == ENOBUFS;
+}
+
+static int udpWriteEvent(int fd, char type, void *arg)
+{
+   struct udpSerialInterfacePriv *self = PRIV(arg);
+   struct mmsghdr msgs[UDP_BATCH];
+   struct iovec iovs[UDP_BATCH];
+   struct UdpWriteNode *wr;
+   int i, res, retried = 0;
+
+   while (self->writes) {
+      memset(msgs, 0, sizeof(msgs));
+      for (i = 0, wr = self->writes; wr && i < UDP_BATCH; i++, wr = wr->next) {
+         iovs[i].iov_base = wr->data;
+         iovs[i].iov_len = wr->data_len;
+         msgs[i].msg_hdr.msg_iov = &iovs[i];
+         msgs[i].msg_hdr.msg_iovlen = 1;
+      }
+
+      res = sendmmsg(self->sockfd, msgs, i, MSG_DONTWAIT);
+      if (res < 0) {
+         if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            return EVENT_KEEP;
+
+         // Nothing in the batch was sent; try it again now, and after
+         // that leave it queued for the next writable event
+         if (udpLinkError(errno)) {
+            if (!retried++)
+               continue;
+            DBG_print(DBG_LEVEL_WARN, "UDP send error: %s\n",
+                  strerror(errno));
+            return EVENT_KEEP;
+         }
+
+         // Drop the datagram that failed so one bad frame can't wedge the queue
+         DBG_print(DBG_LEVEL_WARN, "UDP send error: %s\n", strerror(errno));
+         wr = self->writes;
+         self->writes = wr->next;
+         if (!self->writes)
+            self->writes_tail = NULL;
+         self->st.droppedWrites++;
+         self->queuedBytes -= wr->data_len;
+         nodePut(self, wr);
+         res = 0;
+      }
+
+      while (res-- > 0 && (wr = self->writes)) {
+         self->writes = wr->next;
+         self->st.bytesSent += wr->data_len;
+         self->queuedBytes -= wr->data_len;
+         nodePut(self, wr);
+      }
+      if (!self->writes)
+         self->writes_tail = NULL;
+      serialStatsQueue(&self->st, self->queuedBytes);
+
+      // Anything the owner queues from here goes out in this same pass
+      udpNotifyWritable(self);
+   }
+
+   self->write_reg = 0;
+
+   return EVENT_REMOVE;
+}
+
+static int udpSerialWrite(struct serialInterface *si, void *src, int bytes)
+{
+   struct udpSerialInterfacePriv *self = PRIV(si);
+   struct UdpWriteNode *wr;
+
+   // A reserved node is the most one write can ever take
+   if (self->prealloc && WRITENODE_SIZE(bytes) > SERIAL_PREALLOC_NODE_SIZE) {
+      self->st.droppedWrites++;
+      return SERIAL_WRITE_DROPPED;
+   }
+
+   // An oversized datagram is still taken when nothing else is queued
+   if (self->queuedBytes && self->queuedBytes + bytes > self->highWater) {
+      self->st.blockedWrites++;
+      self->blocked = 1;
+      return SERIAL_WRITE_WOULDBLOCK;
+   }
+
+   wr = nodeGet(self, bytes);
+   // The reserved nodes are all queued, wait for some to be sent
+   if (!wr && self->prealloc && self->writes) {
+      self->st.blockedWrites++;
+      self->blocked = 1;
+      return SERIAL_WRITE_WOULDBLOCK;
+   }
+   if (!wr) {
+      DBG_print(DBG_LEVEL_WARN, "Insufficient memory\n");
+      self->st.droppedWrites++;
+      return SERIAL_WRITE_DROPPED;
+   }
+
+   wr->data_len = bytes;
+   wr->next = NULL;
+   memcpy(wr->data, src, bytes);
+
+   if (!self->writes)
+      self->writes = self->writes_tail = wr;
+   else {
+      self->writes_tail->next = wr;
+      self->writes_tail = wr;
+   }
+   self->st.framesSent++;
+   self->queuedBytes += bytes;
+   serialStatsQueue(&self->st, self->queuedBytes);
+
+   // Everything queued before the loop comes back around goes in one batch
+   if (!self->write_reg) {
+      EVT_fd_add(self->evt_loop, self->sockfd, EVENT_FD_WRITE,
+         &udpWriteEvent, self);
+      self->write_reg = 1;
+   }
+
+   return SERIAL_WRITE_QUEUED;
+}
+
+static struct serialStats *udpSerialStats(struct serialInterface *si)
+{
+   return &PRIV(si)->st;
+}
+
+static int udpSerialCleanup(struct serialInterface *si)
+{
+   struct udpSerialInterfacePriv *self = PRIV(si);
+   struct UdpWriteNode *wr;
+
+   if (self->write_reg) {
+      EVT_fd_remove(self->evt_loop, self->sockfd, EVENT_FD_WRITE);
+      self->write_reg = 0;
+   }
+
+   EVT_fd_remove(self->evt_loop, self->sockfd, EVENT_FD_READ);
+   close(self->sockfd);
+
+   while ((wr = self->writes)) {
+      self->writes = wr->next;
+      self->st.droppedWrites++;
+      nodePut(self, wr);
+   }
+   self->writes_tail = NULL;
+   self->queuedBytes = 0;
+   serialStatsQueue(&self->st, 0);
+
+   if (self->connectCallback)
+      (*self->connectCallback)(0, self->opaque);
+
+   if (self->prealloc) {
+      bufpoolUnreserve(&self->readRes);
+      bufpoolUnreserve(&self->nodeRes);
+   }
+
+   free(si);
+
+   return 0;
+}
+
+int udpSerialInit(struct serialInterface **si,
+                  struct EventState *evt_loop,
+                  serialReadCB readCallback,
+                  serialConnectCB connectCallback,
+                  const char *devFile,
+                  int baudRate,
+                  const char *eolMarker,
+                  void *opaque,
+                  const struct serialOptions *opts)
+{
+   struct udpSerialInterfacePriv *self;
+   struct hostent *hp;
+   char *server_name, *split;
+
+   if (!devFile || 0 != strncasecmp("udp://", devFile, 6))
+      return -1;
+
+   if (eolMarker)
+      DBG_print(DBG_LEVEL_WARN, "UDP links are datagram framed, "
+            "ignoring EOL marker\n");
+
+   // Allocate memory for serial struct
+   *si = (struct serialInterface *) malloc(
+               sizeof(struct udpSerialInterfacePriv));
+   if (*si == NULL) {
+      DBG_print(DBG_LEVEL_WARN, "Insufficient memory\n");
+      return -1;
+   }
+   memset(*si, 0, sizeof(struct udpSerialInterfacePriv));
+   self = PRIV(*si);
+
+   server_name = strdup(&devFile[6]);
+   split = strchr(server_name, ':');
+   if (split) {
+      self->server_addr.sin_port = htons(atol(split + 1));
+      *split = 0;
+   }
+   if ((hp = gethostbyname(server_name)) != NULL)
+      self->server_addr.sin_addr = *(struct in_addr*)(hp->h_addr);
+   self->server_addr.sin_family = AF_INET;
+   free(server_name);
+
+   if (!self->server_addr.sin_addr.s_addr || !self->server_addr.sin_port) {
+      DBG_print(DBG_LEVEL_WARN, "Invalid UDP address %s\n", devFile);
+      free(*si);
+      *si = NULL;
+      return -1;
+   }
+
+   self->sockfd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC,
+         0);
+   if (self->sockfd < 0) {
+      DBG_print(DBG_LEVEL_WARN, "Failed to allocate socket: %s\n",
+            strerror(errno));
+      free(*si);
+      *si = NULL;
+      return -1;
+   }
+
+   // A connected UDP socket only sets the default peer, nothing goes out
+   if (connect(self->sockfd, (struct sockaddr *)&self->server_addr,
+            sizeof(self->server_addr)) < 0) {
+      DBG_print(DBG_LEVEL_WARN, "Unable to set UDP peer: %s\n",
+            strerror(errno));
+      close(self->sockfd);
+      free(*si);
+      *si = NULL;
+      return -1;
+   }
+
+   (*si)->write = udpSerialWrite;
+   (*si)->cleanup = udpSerialCleanup;
+   (*si)->stats = udpSerialStats;
+   self->readCB = readCallback;
+   self->connectCallback = connectCallback;
+   self->evt_loop = evt_loop;
+   self->opaque = opaque;
+   self->readSize = SERIAL_DEFAULT_BUFFER_SIZE;
+   if (opts && opts->readBufferSize)
+      self->readSize = opts->readBufferSize;
+   self->highWater = SERIAL_DEFAULT_QUEUE_LIMIT;
+   if (opts && opts->highWater)
+      self->highWater = opts->highWater;
+   self->writableCB = opts ? opts->writableCallback : NULL;
+
+   if (opts && (opts->flags & SERIAL_OPT_PREALLOC)) {
+      if (bufpoolReserve(&self->readRes, UDP_BATCH * self->readSize, 1) < 0) {
+         DBG_print(DBG_LEVEL_WARN, "Insufficient memory\n");
+         close(self->sockfd);
+         free(*si);
+         *si = NULL;
+         return -1;
+      }
+      if (bufpoolReserve(&self->nodeRes, SERIAL_PREALLOC_NODE_SIZE,
+            SERIAL_PREALLOC_NODES) < 0) {
+         DBG_print(DBG_LEVEL_WARN, "Insufficient memory\n");
+         bufpoolUnreserve(&self->readRes);
+         close(self->sockfd);
+         free(*si);
+         *si = NULL;
+         return -1;
+      }
+      self->prealloc = 1;
+   }
+
+   EVT_fd_add(evt_loop, self->sockfd, EVENT_FD_READ, &udpReadEvent, self);
+
+   if (connectCallback)
+      connectCallback(1, opaque);
+
+   return 0;
+}
@@ -0,0 +1,40 @@
+#ifndef UDP_SERIAL_H
+#define UDP_SERIAL_H
+
+#include "serial.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Constructor for UDP serial interface.  Each write is sent as one
+ *   datagram and each received datagram is passed to the read callback as
+ *   one frame.  There is no connection setup; the connect callback is
+ *   called before this returns.
+ * @param si double pointer to the serial interface struct that will be
+ *             allocated on a succesful call to serialInit.
+ * @param proc a pointer to the process contex for which this interface will
+ *             register events.
+ * @param readCallback function pointer to callback function that handles reads.
+ * @param connectCallback function pointer to callback for link status.
+ * @param deviceFile the udp://host:port URL of the peer.
+ * @param opaque pointer to whatever developer desires. Passed to read callback.
+ * @param opts optional settings, or NULL for the defaults.
+ * @return -1 on error, 0 on success. Check /var/log/syslog on error.
+ */
+int udpSerialInit(struct serialInterface **si,
+                  struct EventState *evl_loop,
+                  serialReadCB readCallback,
+                  serialConnectCB connectCallback,
+                  const char *deviceFile,
+                  int baudRate,
+                  const char *eolMarker,
+                  void *opaque,
+                  const struct serialOptions *opts);
+
+#ifdef __cplusplus
+}
+#endif
+
+
+#endif
@@ -0,0 +1,280 @@
+#include <stdlib.h>
+#include <string.h>
+#include "kiss.h"
+#include "lz.h"
+#include "upload.h"
+
+#define UPLOAD_START_LEN 12
+// Encoded size limit for one command, see kissCommand
+#define UPLOAD_FRAME_MAX (2 * (UPLOAD_MAX_CHUNK + 3) + 9)
+
+struct upload {
+   unsigned char *frames; // Every KISS frame back to back
+   int *offsets;          // Start of frame i, plus the end at [count]
+   int count;
+   uint32_t rawLen;
+   uint32_t dataLen;       // Bytes carried by the data commands
+   int compressed;
+   uint32_t wireBytes;     // KISS bytes on the link
+   uint32_t rawWireBytes;  // KISS bytes had it not been compressed
+};
+
+struct uploadRx {
+   int started;
+   int flags;
+   uint32_t rawLen, dataLen, received;
+   uint16_t rawCrc;
+   uint16_t nextSeq;
+   unsigned char *data;
+   unsigned char *raw;
+   int done;
+};
+
+static void putBE32(unsigned char *p, uint32_t v)
+{
+   p[0] = v >> 24;
+   p[1] = v >> 16;
+   p[2] = v >> 8;
+   p[3] = v;
+}
+
+static uint32_t getBE32(const unsigned char *p)
+{
+   return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+// KISS bytes needed to send data in chunk sized commands
+static uint32_t wireSize(const unsigned char *data, uint32_t len, int chunk)
+{
+   unsigned char body[UPLOAD_MAX_CHUNK + 3], kiss[UPLOAD_FRAME_MAX];
+   uint32_t off, total = 0;
+   uint16_t seq;
+   int n;
+
+   for (off = 0, seq = 0; off < len; off += n, seq++) {
+      n = len - off < chunk ? len - off : chunk;
+      body[0] = UPLOAD_OP_DATA;
+      body[1] = seq >> 8;
+      body[2] = seq;
+      memcpy(body + 3, data + off, n);
+      total += kissCommand(kiss, sizeof(kiss), body, n + 3);
+   }
+
+   return total;
+}
+
+static int addFrame(struct upload *up, const unsigned char *body, int len)
+{
+   int res = kissCommand(up->frames + up->offsets[up->count],
+         UPLOAD_FRAME_MAX, body, len);
+
+   if (res < 0)
+      return -1;
+   up->wireBytes += res;
+   up->offsets[up->count + 1] = up->offsets[up->count] + res;
+   up->count++;
+
+   return 0;
+}
+
+struct upload *uploadCreate(const void *data, uint32_t len, int compress,
+      int chunk)
+{
+   unsigned char body[UPLOAD_MAX_CHUNK + 3];
+   const unsigned char *payload = (const unsigned char *)data;
+   unsigned char *packed = NULL;
+   struct upload *up;
+   uint32_t off;
+   int frames, n, packedLen;
+   uint16_t seq;
+
+   if (chunk <= 0)
+      chunk = UPLOAD_DEFAULT_CHUNK;
+   if (chunk > UPLOAD_MAX_CHUNK)
+      chunk = UPLOAD_MAX_CHUNK;
+
+   up = (struct upload *)calloc(1, sizeof(*up));
+   if (!up)
+      return NULL;
+   up->rawLen = up->dataLen = len;
+
+   if (compress && len) {
+      packed = malloc(LZ_BOUND(len));
+      packedLen = packed ? lzCompress(data, len, packed, LZ_BOUND(len)) : -1;
+      if (packedLen > 0 && packedLen < len) {
+         payload = packed;
+         up->dataLen = packedLen;
+         up->compressed = 1;
+      }
+   }
+
+   frames = 1 + (up->dataLen + chunk - 1) / chunk;
+   if (frames - 1 > 0xFFFF)
+      goto fail;
+   up->frames = malloc((size_t)frames * UPLOAD_FRAME_MAX);
+   up->offsets = (int *)calloc(frames + 1, sizeof(*up->offsets));
+   if (!up->frames || !up->offsets)
+      goto fail;
+
+   body[0] = UPLOAD_OP_START;
+   body[1] = up->compressed ? UPLOAD_FLAG_LZ : 0;
+   putBE32(body + 2, up->rawLen);
+   putBE32(body + 6, up->dataLen);
+   n = crc16(data, len);
+   body[10] = n >> 8;
+   body[11] = n;
+   if (addFrame(up, body, UPLOAD_START_LEN) < 0)
+      goto fail;
+
+   for (off = 0, seq = 0; off < up->dataLen; off += n, seq++) {
+      n = up->dataLen - off < chunk ? up->dataLen - off : chunk;
+      body[0] = UPLOAD_OP_DATA;
+      body[1] = seq >> 8;
+      body[2] = seq;
+      memcpy(body + 3, payload + off, n);
+      if (addFrame(up, body, n + 3) < 0)
+         goto fail;
+   }
+
+   up->rawWireBytes = up->compressed ?
+      up->offsets[1] + wireSize(data, len, chunk) : up->wireBytes;
+   free(packed);
+
+   return up;
+
+fail:
+   free(packed);
+   uploadFree(up);
+   return NULL;
+}
+
+int uploadFrames(const struct upload *up)
+{
+   return up->count;
+}
+
+const unsigned char *uploadFrame(const struct upload *up, int i, int *len)
+{
+   *len = up->offsets[i + 1] - up->offsets[i];
+   return up->frames + up->offsets[i];
+}
+
+void uploadReport(const struct upload *up, int baud, uint64_t elapsedUs,
+      FILE *out)
+{
+   // 8N1 serial: ten bit times per byte
+   double airtime = up->wireBytes * 10.0 / baud;
+   double rawAirtime = up->rawWireBytes * 10.0 / baud;
+
+   fprintf(out, "upload: %u bytes, %u sent%s (ratio %.2f), %d frames, "
+         "%u bytes on the wire\n", up->rawLen, up->dataLen,
+         up->compressed ? " compressed" : "",
+         up->dataLen ? (double)up->rawLen / up->dataLen : 1.0, up->count,
+         up->wireBytes);
+   fprintf(out, "upload: airtime at %d baud %.2f s (%.2f s uncompressed), "
+         "goodput %.0f B/s\n", baud, airtime, rawAirtime,
+         airtime > 0 ? up->rawLen / airtime : 0.0);
+   if (elapsedUs)
+      fprintf(out, "upload: sent in %.3f s, measured goodput %.0f B/s\n",
+            elapsedUs / 1e6, up->rawLen / (elapsedUs / 1e6));
+}
+
+void uploadFree(struct upload *up)
+{
+   if (!up)
+      return;
+
+   free(up->frames);
+   free(up->offsets);
+   free(up);
+}
+
+struct uploadRx *uploadRxCreate(void)
+{
+   return (struct uploadRx *)calloc(1, sizeof(struct uploadRx));
+}
+
+static int rxFinish(struct uploadRx *rx)
+{
+   int len;
+
+   if (rx->flags & UPLOAD_FLAG_LZ) {
+      rx->raw = malloc(rx->rawLen ? rx->rawLen : 1);
+      if (!rx->raw)
+         return -1;
+      len = lzDecompress(rx->data, rx->dataLen, rx->raw, rx->rawLen);
+      if (len < 0 || len != rx->rawLen)
+         return -1;
+   }
+   else if (rx->dataLen == rx->rawLen) {
+      rx->raw = rx->data;
+      rx->data = NULL;
+   }
+   else
+      return -1;
+
+   if (crc16(rx->raw, rx->rawLen) != rx->rawCrc)
+      return -1;
+   rx->done = 1;
+
+   return 1;
+}
+
+int uploadRxFrame(struct uploadRx *rx, const unsigned char *frame, int len)
+{
+   const unsigned char *cmd = frame + 1;
+   int cmdLen = len - 3;
+   uint16_t seq;
+
+   if (cmdLen < 1 || rx->done)
+      return rx->done;
+
+   if (cmd[0] == UPLOAD_OP_START && cmdLen >= UPLOAD_START_LEN) {
+      free(rx->data);
+      free(rx->raw);
+      memset(rx, 0, sizeof(*rx));
+      rx->flags = cmd[1];
+      rx->rawLen = getBE32(cmd + 2);
+      rx->dataLen = getBE32(cmd + 6);
+      rx->rawCrc = (cmd[10] << 8) | cmd[11];
+      rx->data = malloc(rx->dataLen ? rx->dataLen : 1);
+      if (!rx->data)
+         return -1;
+      rx->started = 1;
+      return rx->dataLen ? 0 : rxFinish(rx);
+   }
+
+   if (cmd[0] != UPLOAD_OP_DATA || cmdLen < 3 || !rx->started)
+      return 0;
+
+   // In order only: a repeat is ignored, a gap fails the upload
+   seq = (cmd[1] << 8) | cmd[2];
+   if (seq != rx->nextSeq)
+      return seq < rx->nextSeq ? 0 : -1;
+   if (rx->received + cmdLen - 3 > rx->dataLen)
+      return -1;
+   memcpy(rx->data + rx->received, cmd + 3, cmdLen - 3);
+   rx->received += cmdLen - 3;
+   rx->nextSeq++;
+
+   return rx->received == rx->dataLen ? rxFinish(rx) : 0;
+}
+
+const unsigned char *uploadRxData(const struct uploadRx *rx, uint32_t *len)
+{
+   if (!rx->done)
+      return NULL;
+
+   *len = rx->rawLen;
+   return rx->raw;
+}
+
+void uploadRxFree(struct uploadRx *rx)
+{
+   if (!rx)
+      return;
+
+   free(rx->data);
+   free(rx->raw);
+   free(rx);
+}
@@ -0,0 +1,82 @@
+#ifndef UPLOAD_H
+#define UPLOAD_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Multi-frame uploads.  A buffer, optionally LZ compressed (lz.h), is sent
+ *   as one start command followed by numbered data commands, each an
+ *   ordinary EnduraSat command frame with its own length and CRC16:
+ *
+ *     start: UPLOAD_OP_START flags rawLen(4) dataLen(4) rawCrc(2)
+ *     data:  UPLOAD_OP_DATA seq(2) bytes...
+ *
+ *   Multi-byte fields are big-endian.  dataLen counts the bytes carried by
+ *   the data commands, compressed when UPLOAD_FLAG_LZ is set.  rawCrc is
+ *   the crc16 of the original buffer, so the receiver can check the
+ *   result after decompressing.
+ */
+#define UPLOAD_OP_START 0x70
+#define UPLOAD_OP_DATA 0x71
+#define UPLOAD_FLAG_LZ 0x01
+
+#define UPLOAD_DEFAULT_CHUNK 200 // Data bytes per command
+#define UPLOAD_MAX_CHUNK 240
+
+struct upload;
+
+/* Build every frame of an upload, KISS encoded and ready to write.
+ * @param data the bytes to upload.
+ * @param len the number of bytes.
+ * @param compress non-zero to LZ compress, which is skipped if it does not
+ *   make the upload smaller.
+ * @param chunk data bytes per command, 0 for the default.
+ * @return the upload, or NULL on error.
+ */
+struct upload *uploadCreate(const void *data, uint32_t len, int compress,
+      int chunk);
+
+/* Number of frames, start command included. */
+int uploadFrames(const struct upload *up);
+
+/* The i'th KISS encoded frame.
+ * @param len receives its length.
+ */
+const unsigned char *uploadFrame(const struct upload *up, int i, int *len);
+
+/* Print the sizes, compression ratio and airtime at a baud rate.  When
+ *   elapsedUs is non-zero the measured goodput is printed too.
+ */
+void uploadReport(const struct upload *up, int baud, uint64_t elapsedUs,
+      FILE *out);
+
+void uploadFree(struct upload *up);
+
+/* Ground side stand-in for the flight receiver: reassembles start and data
+ *   commands, decompresses and checks the length and CRC.
+ */
+struct uploadRx;
+
+struct uploadRx *uploadRxCreate(void);
+
+/* Feed one EnduraSat frame: <len> <command> <crc16>, CRC already checked.
+ *   Frames that are not upload commands are ignored.
+ * @return 1 once the upload is complete and verified, -1 if it failed,
+ *   0 while incomplete.
+ */
+int uploadRxFrame(struct uploadRx *rx, const unsigned char *frame, int len);
+
+/* The verified upload and its length, NULL until complete. */
+const unsigned char *uploadRxData(const struct uploadRx *rx, uint32_t *len);
+
+void uploadRxFree(struct uploadRx *rx);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
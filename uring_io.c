@@ -0,0 +1,413 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "uring_io.h"
+
+#ifdef HAVE_LIBURING
+
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <liburing.h>
+
+#define URING_ENTRIES 64
+#define URING_RBUFS 16 // must be a power of two
+#define URING_RBUF_SIZE 4096
+#define URING_WBUFS 16
+#define URING_WBUF_SIZE 4096
+#define URING_BGID 0
+
+// user_data tags. Write completions carry the slot index above the tag.
+#define UD_READ 1
+#define UD_WRITE 2
+#define UD_SLOT_SHIFT 8
+
+struct uringSlot {
+   int len; // Bytes copied into the slot
+   int off; // Bytes of the slot already written
+};
+
+struct uringIO {
+   struct io_uring ring;
+   struct io_uring_buf_ring *br;
+   struct EventState *evt_loop;
+   int fd;
+   int efd;
+   int isSocket;
+   int readArmed;
+   int readFailed;
+   int readSeen; // A read has completed with data
+   int singleShot; // Receive with one recv per buffer, not multishot
+   uringReadCB readCB;
+   uringErrorCB errorCB;
+   uringWritableCB writableCB;
+   void *opaque;
+   char *rbufs; // Provided receive buffers
+   char *wbufs; // Registered transmit buffers
+   struct uringSlot slots[URING_WBUFS]; // FIFO of filled transmit slots
+   int head, count;
+   int inflight; // Slots in the linked chain owned by the kernel
+   int chainWritten; // Bytes the current chain has written, -1 on error
+};
+
+#define SLOT_DATA(io, s) ((io)->wbufs + (s) * URING_WBUF_SIZE)
+
+// What earlier contexts learned about this kernel: multishot recv (6.0)
+// rejected, or buffer-selected reads rejected altogether.  Both stick for
+// the life of the process so reconnects don't trip over them again.
+static int noMultishot;
+static int noReads;
+
+static void armRead(struct uringIO *io)
+{
+   struct io_uring_sqe *sqe = io_uring_get_sqe(&io->ring);
+
+   if (!sqe)
+      return;
+
+   if (io->isSocket && !io->singleShot)
+      io_uring_prep_recv_multishot(sqe, io->fd, NULL, 0, 0);
+   else if (io->isSocket)
+      io_uring_prep_recv(sqe, io->fd, NULL, URING_RBUF_SIZE, 0);
+   else
+      io_uring_prep_read(sqe, io->fd, NULL, URING_RBUF_SIZE, (uint64_t)-1);
+   sqe->flags |= IOSQE_BUFFER_SELECT;
+   sqe->buf_group = URING_BGID;
+   io_uring_sqe_set_data64(sqe, UD_READ);
+   io->readArmed = 1;
+}
+
+// Submit every filled slot as one chain of linked writes
+static void submitWrites(struct uringIO *io)
+{
+   struct io_uring_sqe *sqe;
+   int i, s;
+
+   for (i = 0; i < io->count; i++) {
+      s = (io->head + i) % URING_WBUFS;
+      sqe = io_uring_get_sqe(&io->ring);
+      if (!sqe)
+         break;
+      io_uring_prep_write_fixed(sqe, io->fd,
+            SLOT_DATA(io, s) + io->slots[s].off,
+            io->slots[s].len - io->slots[s].off, (uint64_t)-1, 0);
+      io_uring_sqe_set_data64(sqe, UD_WRITE | (s << UD_SLOT_SHIFT));
+      if (i + 1 < io->count)
+         sqe->flags |= IOSQE_IO_LINK;
+      io->inflight++;
+   }
+}
+
+// Bytes in transmit slots not yet written
+static int queuedBytes(struct uringIO *io)
+{
+   int i, slot, queued = 0;
+
+   for (i = 0; i < io->count; i++) {
+      slot = (io->head + i) % URING_WBUFS;
+      queued += io->slots[slot].len - io->slots[slot].off;
+   }
+   return queued;
+}
+
+static void recycleReadBuffer(struct uringIO *io, int bid)
+{
+   io_uring_buf_ring_add(io->br, io->rbufs + bid * URING_RBUF_SIZE,
+         URING_RBUF_SIZE, bid, io_uring_buf_ring_mask(URING_RBUFS), 0);
+   io_uring_buf_ring_advance(io->br, 1);
+}
+
+static void readComplete(struct uringIO *io, struct io_uring_cqe *cqe)
+{
+   int bid;
+
+   if (!(cqe->flags & IORING_CQE_F_MORE))
+      io->readArmed = 0;
+
+   if (cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+      io->readSeen = 1;
+      bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+      if (io->readCB)
+         io->readCB(io->rbufs + bid * URING_RBUF_SIZE, cqe->res, io->opaque);
+      recycleReadBuffer(io, bid);
+      return;
+   }
+
+   // Out of provided buffers; they are recycled above, so just re-arm
+   if (cqe->res == -ENOBUFS)
+      return;
+
+   // Buffer rings (5.19) arrived before multishot recv (6.0).  A kernel
+   // in between rejects the first recv; carry on with single recvs.
+   if (!io->readSeen && (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP)) {
+      if (io->isSocket && !io->singleShot) {
+         DBG_print(DBG_LEVEL_INFO, "io_uring multishot recv unsupported, "
+               "using single recvs\n");
+         noMultishot = io->singleShot = 1;
+         return;
+      }
+      // The link is torn down below; its reconnect uses fd events
+      DBG_print(DBG_LEVEL_INFO, "io_uring reads unsupported, using fd "
+            "events\n");
+      noReads = 1;
+   }
+
+   if (io->readFailed)
+      return;
+   io->readFailed = 1;
+   if (io->errorCB)
+      io->errorCB(cqe->res < 0 ? -cqe->res : 0, io->opaque);
+}
+
+static void writeComplete(struct uringIO *io, struct io_uring_cqe *cqe,
+      int s)
+{
+   int written;
+
+   io->inflight--;
+
+   // A short write severs the chain; the rest complete with -ECANCELED
+   // and are resubmitted from their current offsets once the chain ends.
+   if (cqe->res > 0) {
+      io->slots[s].off += cqe->res;
+      if (io->chainWritten >= 0)
+         io->chainWritten += cqe->res;
+   }
+   else if (cqe->res < 0 && cqe->res != -ECANCELED) {
+      DBG_print(DBG_LEVEL_WARN, "io_uring write failed: %s\n",
+            strerror(-cqe->res));
+      io->slots[s].off = io->slots[s].len;
+      io->chainWritten = -1;
+   }
+
+   if (io->inflight > 0)
+      return;
+   written = io->chainWritten;
+   io->chainWritten = 0;
+
+   while (io->count > 0 &&
+         io->slots[io->head].off >= io->slots[io->head].len) {
+      io->slots[io->head].len = io->slots[io->head].off = 0;
+      io->head = (io->head + 1) % URING_WBUFS;
+      io->count--;
+   }
+
+   if (io->count > 0)
+      submitWrites(io);
+
+   if (io->writableCB)
+      io->writableCB(written, queuedBytes(io), io->opaque);
+}
+
+static int completionEvent(int fd, char type, void *arg)
+{
+   struct uringIO *io = (struct uringIO *)arg;
+   struct io_uring_cqe *cqe;
+   unsigned head, seen = 0;
+   uint64_t ud, val;
+
+   if (read(io->efd, &val, sizeof(val)) < 0 && errno != EAGAIN)
+      return EVENT_KEEP;
+
+   io_uring_for_each_cqe(&io->ring, head, cqe) {
+      ud = io_uring_cqe_get_data64(cqe);
+      if ((ud & 0xFF) == UD_READ)
+         readComplete(io, cqe);
+      else if ((ud & 0xFF) == UD_WRITE)
+         writeComplete(io, cqe, (int)(ud >> UD_SLOT_SHIFT));
+      seen++;
+   }
+   io_uring_cq_advance(&io->ring, seen);
+
+   if (!io->readArmed && !io->readFailed)
+      armRead(io);
+
+   io_uring_submit(&io->ring);
+
+   return EVENT_KEEP;
+}
+
+struct uringIO *uringIOCreate(struct EventState *evt_loop, int fd,
+      int isSocket, uringReadCB readCB, uringErrorCB errorCB, void *opaque)
+{
+   struct uringIO *io;
+   struct io_uring_probe *probe;
+   struct iovec iov;
+   int res, i;
+
+   if (noReads)
+      return NULL;
+
+   io = (struct uringIO *)malloc(sizeof(*io));
+   if (!io)
+      return NULL;
+   memset(io, 0, sizeof(*io));
+   io->efd = -1;
+   io->singleShot = noMultishot;
+
+   if (io_uring_queue_init(URING_ENTRIES, &io->ring, 0) < 0) {
+      DBG_print(DBG_LEVEL_INFO, "io_uring unavailable, using fd events\n");
+      free(io);
+      return NULL;
+   }
+
+   // Multishot is a recv flag the probe can't see; readComplete learns it
+   probe = io_uring_get_probe_ring(&io->ring);
+   res = probe && io_uring_opcode_supported(probe, IORING_OP_WRITE_FIXED) &&
+      io_uring_opcode_supported(probe,
+            isSocket ? IORING_OP_RECV : IORING_OP_READ);
+   if (probe)
+      io_uring_free_probe(probe);
+   if (!res)
+      goto fail;
+
+   io->rbufs = malloc(URING_RBUFS * URING_RBUF_SIZE);
+   io->wbufs = malloc(URING_WBUFS * URING_WBUF_SIZE);
+   if (!io->rbufs || !io->wbufs)
+      goto fail;
+
+   io->br = io_uring_setup_buf_ring(&io->ring, URING_RBUFS, URING_BGID, 0,
+         &res);
+   if (!io->br)
+      goto fail;
+   for (i = 0; i < URING_RBUFS; i++)
+      io_uring_buf_ring_add(io->br, io->rbufs + i * URING_RBUF_SIZE,
+            URING_RBUF_SIZE, i, io_uring_buf_ring_mask(URING_RBUFS), i);
+   io_uring_buf_ring_advance(io->br, URING_RBUFS);
+
+   iov.iov_base = io->wbufs;
+   iov.iov_len = URING_WBUFS * URING_WBUF_SIZE;
+   if (io_uring_register_buffers(&io->ring, &iov, 1) < 0)
+      goto fail;
+
+   io->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+   if (io->efd < 0 || io_uring_register_eventfd(&io->ring, io->efd) < 0)
+      goto fail;
+
+   io->evt_loop = evt_loop;
+   io->fd = fd;
+   io->isSocket = isSocket;
+   io->readCB = readCB;
+   io->errorCB = errorCB;
+   io->writableCB = NULL;
+   io->opaque = opaque;
+
+   armRead(io);
+   io_uring_submit(&io->ring);
+
+   EVT_fd_add(evt_loop, io->efd, EVENT_FD_READ, &completionEvent, io);
+
+   return io;
+
+fail:
+   DBG_print(DBG_LEVEL_INFO, "io_uring setup failed, using fd events\n");
+   if (io->br)
+      io_uring_free_buf_ring(&io->ring, io->br, URING_RBUFS, URING_BGID);
+   io_uring_queue_exit(&io->ring);
+   if (io->efd >= 0)
+      close(io->efd);
+   free(io->rbufs);
+   free(io->wbufs);
+   free(io);
+   return NULL;
+}
+
+int uringIOWrite(struct uringIO *io, const void *src, int bytes)
+{
+   const char *s = (const char *)src;
+   int avail, tail = -1, chunk;
+
+   // Only slots the kernel does not own may be appended to
+   avail = (URING_WBUFS - io->count) * URING_WBUF_SIZE;
+   if (io->count > io->inflight) {
+      tail = (io->head + io->count - 1) % URING_WBUFS;
+      avail += URING_WBUF_SIZE - io->slots[tail].len;
+   }
+   if (bytes > avail)
+      return -1;
+
+   while (bytes > 0) {
+      if (tail < 0 || io->slots[tail].len == URING_WBUF_SIZE) {
+         tail = (io->head + io->count) % URING_WBUFS;
+         io->slots[tail].len = io->slots[tail].off = 0;
+         io->count++;
+      }
+      chunk = URING_WBUF_SIZE - io->slots[tail].len;
+      if (chunk > bytes)
+         chunk = bytes;
+      memcpy(SLOT_DATA(io, tail) + io->slots[tail].len, s, chunk);
+      io->slots[tail].len += chunk;
+      s += chunk;
+      bytes -= chunk;
+   }
+
+   if (io->inflight == 0) {
+      submitWrites(io);
+      io_uring_submit(&io->ring);
+   }
+
+   return 0;
+}
+
+int uringIOQueued(struct uringIO *io)
+{
+   return queuedBytes(io);
+}
+
+int uringIOCapacity(void)
+{
+   return URING_WBUFS * URING_WBUF_SIZE;
+}
+
+void uringIOSetWritableCB(struct uringIO *io, uringWritableCB cb)
+{
+   io->writableCB = cb;
+}
+
+void uringIODestroy(struct uringIO *io)
+{
+   if (!io)
+      return;
+
+   EVT_fd_remove(io->evt_loop, io->efd, EVENT_FD_READ);
+   io_uring_free_buf_ring(&io->ring, io->br, URING_RBUFS, URING_BGID);
+   io_uring_queue_exit(&io->ring);
+   close(io->efd);
+   free(io->rbufs);
+   free(io->wbufs);
+   free(io);
+}
+
+#else
+
+struct uringIO *uringIOCreate(struct EventState *evt_loop, int fd,
+      int isSocket, uringReadCB readCB, uringErrorCB errorCB, void *opaque)
+{
+   return NULL;
+}
+
+int uringIOWrite(struct uringIO *io, const void *src, int bytes)
+{
+   return -1;
+}
+
+int uringIOQueued(struct uringIO *io)
+{
+   return 0;
+}
+
+int uringIOCapacity(void)
+{
+   return 0;
+}
+
+void uringIOSetWritableCB(struct uringIO *io, uringWritableCB cb)
+{
+}
+
+void uringIODestroy(struct uringIO *io)
+{
+}
+
+#endif
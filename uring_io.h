@@ -0,0 +1,78 @@
+#ifndef URING_IO_H
+#define URING_IO_H
+
+#include <polysat/polysat.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct uringIO;
+
+/* Type definition of the callback invoked with received bytes.
+ * @param buffer a pointer to the bytes read. Only valid during the call.
+ * @param bytes the number of bytes read.
+ * @param opaque user supplied argument
+ */
+typedef void (*uringReadCB)(void *buffer, int bytes, void *opaque);
+
+/* Type definition of the callback invoked when the receive side fails.
+ *   No further reads are issued after this is called.
+ * @param err 0 for end-of-file, otherwise a positive errno value.
+ * @param opaque user supplied argument
+ */
+typedef void (*uringErrorCB)(int err, void *opaque);
+
+/* Type definition of the callback invoked each time a chain of linked
+ *   writes completes and transmit buffers are released.
+ * @param written the bytes the chain wrote, or -1 if a write failed.
+ * @param queued the number of bytes still waiting to be written.
+ * @param opaque user supplied argument
+ */
+typedef void (*uringWritableCB)(int written, int queued, void *opaque);
+
+/* Create an io_uring backed I/O context for an open file descriptor.
+ *   Completions are delivered through an eventfd registered with the
+ *   libproc event loop, so callbacks run on the event loop thread.
+ * @param evt_loop the event loop to register the completion eventfd with.
+ * @param fd the already open and connected file descriptor. Not owned.
+ * @param isSocket true to use multishot receive, false for plain reads.
+ * @param readCB function called with received data.
+ * @param errorCB function called on end-of-file or a receive error.
+ * @param opaque pointer passed through to the callbacks.
+ * @return the new context, or NULL when io_uring is unavailable. Callers
+ *   should fall back to libproc fd events in that case.
+ */
+struct uringIO *uringIOCreate(struct EventState *evt_loop, int fd,
+      int isSocket, uringReadCB readCB, uringErrorCB errorCB, void *opaque);
+
+/* Queue bytes for transmission.  Data is copied into a registered buffer
+ *   and submitted as part of a chain of linked writes, so ordering is
+ *   preserved.
+ * @return -1 if the registered buffers are full, 0 on success.
+ */
+int uringIOWrite(struct uringIO *io, const void *src, int bytes);
+
+/* Bytes queued with uringIOWrite that the kernel has not written yet. */
+int uringIOQueued(struct uringIO *io);
+
+/* Total bytes the registered transmit buffers hold.  A write larger than
+ *   this can never be queued.
+ */
+int uringIOCapacity(void);
+
+/* Set the function called when transmit buffers are released.  It
+ *   receives the opaque pointer given to uringIOCreate and may write.
+ */
+void uringIOSetWritableCB(struct uringIO *io, uringWritableCB cb);
+
+/* Cancel outstanding I/O and release all resources.  The file descriptor
+ *   is left open.
+ */
+void uringIODestroy(struct uringIO *io);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif